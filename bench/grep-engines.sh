@@ -0,0 +1,93 @@
+#!/bin/sh
+# Compare grep's lazy DFA with the POSIX regexec() fallback.
+#
+#   bench/grep-engines.sh [corpus-size-in-MB] [corpus-file]
+#
+# Without a corpus file a synthetic log is generated. Each pattern is run
+# with --engine=dfa and --engine=posix; both runs must print the same lines.
+
+set -e
+cd "$(dirname "$0")/.."
+
+SIZE_MB=${1:-64}
+CORPUS=${2:-}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+gcc -O2 src/grep.c -o "$WORK/grep"
+
+# Regression cases: pattern<TAB>input lines (\n-separated)<TAB>expected output.
+# Both engines must print exactly the expected lines.
+while IFS='	' read -r pat input want; do
+  [ -z "$pat" ] && continue
+  for engine in dfa posix; do
+    got=$(printf "$input" | "$WORK/grep" --engine=$engine "$pat" | tr '\n' ' ')
+    if [ "$got" != "$want" ]; then
+      echo "--engine=$engine $pat: got '$got', want '$want'" >&2
+      exit 1
+    fi
+  done
+done <<'CASES'
+(ab)*c	c\nabc\n	c abc 
+(foo)?bar	bar\n	bar 
+$^	a\n\nb\n	 
+a$^	a\n\nb\n	
+CASES
+
+# The trigram index (--index) must not narrow by a literal from an optional group.
+mkdir "$WORK/tree"
+printf 'foo\n' > "$WORK/tree/a"
+printf 'abcdef foo\n' > "$WORK/tree/b"
+got=$(cd "$WORK" && ./grep -r --index=index '(abcdef)?foo' tree | sort | tr '\n' ' ')
+if [ "$got" != "tree/a:foo tree/b:abcdef foo " ]; then
+  echo "--index (abcdef)?foo: got '$got'" >&2
+  exit 1
+fi
+
+if [ -z "$CORPUS" ]; then
+  CORPUS=$WORK/corpus.log
+  awk -v mb="$SIZE_MB" 'BEGIN {
+    srand(42);
+    split("GET POST PUT DELETE HEAD", method);
+    split("200 200 200 301 404 500 503", status);
+    split("INFO WARN ERROR DEBUG", level);
+    target = mb * 1024 * 1024;
+    while (n < target) {
+      line = sprintf("2024-%02d-%02dT%02d:%02d:%02d %s %s /api/v%d/item/%d %s %dms user%d@example.com",
+                     int(rand() * 12) + 1, int(rand() * 28) + 1, int(rand() * 24),
+                     int(rand() * 60), int(rand() * 60), level[int(rand() * 4) + 1],
+                     method[int(rand() * 5) + 1], int(rand() * 3) + 1, int(rand() * 100000),
+                     status[int(rand() * 7) + 1], int(rand() * 2000), int(rand() * 5000));
+      print line;
+      n += length(line) + 1;
+    }
+  }' > "$CORPUS"
+fi
+
+time_run() {
+  start=$(date +%s.%N)
+  "$WORK/grep" "$@" "$CORPUS" > "$WORK/out.$1"
+  end=$(date +%s.%N)
+  awk -v s="$start" -v e="$end" 'BEGIN { printf "%.3f", e - s }'
+}
+
+printf '%-48s %10s %10s %8s\n' pattern dfa posix speedup
+while IFS= read -r pat; do
+  [ -z "$pat" ] && continue
+  dfa=$(time_run --engine=dfa "$pat")
+  posix=$(time_run --engine=posix "$pat")
+  if ! cmp -s "$WORK/out.--engine=dfa" "$WORK/out.--engine=posix"; then
+    echo "output differs for: $pat" >&2
+    exit 1
+  fi
+  awk -v p="$pat" -v d="$dfa" -v x="$posix" \
+    'BEGIN { printf("%-48s %9.3fs %9.3fs %7.1fx\n", p, d, x, (d > 0 ? x / d : 0)) }'
+done <<'PATTERNS'
+(ERROR|WARN) (GET|POST)
+[0-9]{3}ms
+/api/v[12]/item/[0-9]+ (404|500)
+^2024-0[1-6]-[0-9]+T(0[0-9]|1[0-2])
+user[0-9]*@example\.com$
+(PUT|DELETE) .* 50[03]
+[[:upper:]]{4,5} [[:upper:]]{3,4} /api
+PATTERNS
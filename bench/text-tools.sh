@@ -0,0 +1,64 @@
+#!/bin/sh
+# Throughput of the text tools before and after the shared fastio.h.
+#
+#   bench/text-tools.sh [corpus-size-in-MB] [baseline-rev]
+#
+# The "before" binaries are built from baseline-rev (default: the first
+# commit, with the original per-byte loops); "after" from the work tree.
+# Both must produce the same output for every tool.
+
+set -e
+cd "$(dirname "$0")/.."
+
+SIZE_MB=${1:-256}
+BASE=${2:-$(git rev-list --max-parents=0 HEAD)}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+for tool in cat2 cat3 head wc-l; do
+  git show "$BASE:src/$tool.c" > "$WORK/$tool.before.c"
+  gcc -O2 -w "$WORK/$tool.before.c" -o "$WORK/$tool.before"
+  gcc -O2 "src/$tool.c" -o "$WORK/$tool.after"
+done
+
+CORPUS=$WORK/corpus.txt
+awk -v mb="$SIZE_MB" 'BEGIN {
+  srand(7);
+  target = mb * 1024 * 1024;
+  while (n < target) {
+    line = sprintf("%d\tGET /item/%d\t%dms\tuser%d", int(rand() * 1e9), int(rand() * 1e5),
+                   int(rand() * 2000), int(rand() * 5000));
+    print line;
+    n += length(line) + 1;
+  }
+}' > "$CORPUS"
+LINES=$(awk 'END { print NR }' "$CORPUS")
+
+time_run() {
+  out=$1
+  shift
+  start=$(date +%s.%N)
+  "$@" > "$out"
+  end=$(date +%s.%N)
+  awk -v s="$start" -v e="$end" 'BEGIN { printf "%.3f", e - s }'
+}
+
+printf '%-20s %10s %10s %10s %8s\n' tool before after MB/s speedup
+for run in "cat2 $CORPUS" "cat3 $CORPUS" "head -n $LINES $CORPUS" "wc-l"; do
+  set -- $run
+  tool=$1
+  shift
+  if [ "$tool" = wc-l ]; then
+    before=$(time_run "$WORK/out.before" sh -c "'$WORK/$tool.before' < '$CORPUS'")
+    after=$(time_run "$WORK/out.after" sh -c "'$WORK/$tool.after' < '$CORPUS'")
+  else
+    before=$(time_run "$WORK/out.before" "$WORK/$tool.before" "$@")
+    after=$(time_run "$WORK/out.after" "$WORK/$tool.after" "$@")
+  fi
+  if ! cmp -s "$WORK/out.before" "$WORK/out.after"; then
+    echo "output differs for: $tool" >&2
+    exit 1
+  fi
+  awk -v t="$tool" -v b="$before" -v a="$after" -v mb="$SIZE_MB" \
+    'BEGIN { printf("%-20s %9.3fs %9.3fs %10.0f %7.1fx\n", t, b, a, (a > 0 ? mb / a : 0), (a > 0 ? b / a : 0)) }'
+done
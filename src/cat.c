@@ -1,11 +1,16 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <fcntl.h>
 
 static void do_cat(int fd, const char *path);
+static int copy_kernel(int fd, const struct stat *in, const struct stat *out);
+static void copy_buffered(int fd, const char *path);
 static void die(const char *s);
 
 int main(int argc, char *argv[]) {
@@ -22,20 +27,90 @@ int main(int argc, char *argv[]) {
     exit(0);
 }
 
-#define BUFFER_SIZE 2040
+#define BUFFER_SIZE (128 * 1024)
+#define KERNEL_CHUNK (1024 * 1024 * 1024)
+
+enum { COPY_DONE, COPY_UNSUPPORTED, COPY_FAILED };
 
 static void do_cat(int fd, const char *path) {
-    unsigned char buf[BUFFER_SIZE];
+    struct stat in, out;
 
     if (fd < 0) { die(path); }
+    if (fstat(fd, &in) < 0) { die(path); }
+    if (fstat(STDOUT_FILENO, &out) < 0) { die("stdout"); }
+    switch (copy_kernel(fd, &in, &out)) {
+    case COPY_DONE:
+        break;
+    case COPY_UNSUPPORTED:
+        copy_buffered(fd, path);
+        break;
+    default:
+        die(path);
+    }
+    if (close(fd) < 0) { die(path); }
+}
+
+/*
+ * Let the kernel move the data when the pair of file types allows it:
+ * copy_file_range(2) between regular files (which may reflink), splice(2)
+ * whenever either side is a pipe, and sendfile(2) from a file into a
+ * socket. A call that fails before anything was moved means the pair is
+ * not supported after all, and the caller falls back to read/write from
+ * the current offset.
+ */
+static int copy_kernel(int fd, const struct stat *in, const struct stat *out) {
+    int moved = 0;
+
+    while (1) {
+        ssize_t n;
+
+        if (S_ISREG(in->st_mode) && S_ISREG(out->st_mode)) {
+            n = copy_file_range(fd, NULL, STDOUT_FILENO, NULL, KERNEL_CHUNK, 0);
+        } else if (S_ISFIFO(in->st_mode) || S_ISFIFO(out->st_mode)) {
+            n = splice(fd, NULL, STDOUT_FILENO, NULL, KERNEL_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        } else if (S_ISREG(in->st_mode) && S_ISSOCK(out->st_mode)) {
+            n = sendfile(STDOUT_FILENO, fd, NULL, KERNEL_CHUNK);
+        } else {
+            return COPY_UNSUPPORTED;
+        }
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            return moved ? COPY_FAILED : COPY_UNSUPPORTED;
+        }
+        if (n == 0) { return COPY_DONE; }
+        moved = 1;
+    }
+}
+
+static void copy_buffered(int fd, const char *path) {
+    static unsigned char *buf = NULL;
+
+    if (!buf) {
+        long pagesize = sysconf(_SC_PAGESIZE);
+
+        if (posix_memalign((void **)&buf, pagesize, BUFFER_SIZE) != 0) {
+            die("posix_memalign(3)");
+        }
+    }
     while (1) {
-        int n;
-        n = read(fd, buf, sizeof buf);
-        if (n < 0) { die(path); }
+        ssize_t n, done;
+
+        n = read(fd, buf, BUFFER_SIZE);
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            die(path);
+        }
         if (n == 0) { break; }
-        if (write(STDOUT_FILENO, buf, n) < 0) { die(path); }
+        for (done = 0; done < n; ) {
+            ssize_t w = write(STDOUT_FILENO, buf + done, n - done);
+
+            if (w < 0) {
+                if (errno == EINTR) { continue; }
+                die(path);
+            }
+            done += w;
+        }
     }
-    if (close(fd) < 0) { die(path); }
 }
 
 static void die(const char *s) {
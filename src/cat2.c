@@ -1,31 +1,49 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include "fastio.h"
 
-void putsStdout(FILE *f, const char *path);
+static void putsStdout(int fd, const char *path);
+
+static struct FioWriter out;
 
 int main(int argc, char *argv[]) {
     int i;
-    FILE *f;
 
+    if (fio_writer_open(&out, STDOUT_FILENO) < 0) {
+        perror("stdout");
+        exit(1);
+    }
     if (argc < 2) {
-        f = fdopen(STDIN_FILENO, "r");
-        putsStdout(f, argv[i]);
+        putsStdout(STDIN_FILENO, "stdin");
     }
     for (i = 1; i < argc; i++) {
-        f = fopen(argv[i], "r");
-        putsStdout(f, argv[i]);
+        putsStdout(open(argv[i], O_RDONLY), argv[i]);
     }
+    if (fio_writer_close(&out) < 0) { exit(1); }
     exit(0);
 }
 
-void putsStdout(FILE *f, const char *path) {
-    int c;
-    if (!f) {
-      perror(path);
-      exit(1);
+static void putsStdout(int fd, const char *path) {
+    struct FioReader in;
+    const unsigned char *p = NULL;
+    size_t n = 0;
+    int ret;
+
+    if (fd < 0 || fio_open(&in, fd) < 0) {
+        perror(path);
+        exit(1);
+    }
+    while ((ret = fio_block(&in, &p, &n)) > 0) {
+        if (fio_write(&out, p, n) < 0) { exit(1); }
+    }
+    if (ret < 0) {
+        perror(path);
+        exit(1);
     }
-    while((c =fgetc(f)) != EOF) {
-        if (putchar(c) < 0) { exit(1); }
+    fio_close(&in);
+    if (fd != STDIN_FILENO) {
+        close(fd);
     }
 }
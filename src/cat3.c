@@ -1,36 +1,178 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include "fastio.h"
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
 
-void putsStdout(FILE *f, const char *path);
+#define MAX_ESCAPE 4  /* "M-^?" */
+
+struct Escape {
+    unsigned char len;
+    char s[MAX_ESCAPE];
+};
+
+static void build_table(int visible);
+static void putsStdout(int fd, const char *path);
+
+static struct Escape escapes[256];
+static unsigned char special[256];
+static int show_nonprinting = 0;
+static struct FioWriter out;
 
 int main(int argc, char *argv[]) {
-    int i;
-    FILE *f;
+    int i, opt;
+
+    while ((opt = getopt(argc, argv, "v")) != -1) {
+        switch (opt) {
+        case 'v':
+            show_nonprinting = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-v] [file...]\n", argv[0]);
+            exit(1);
+        }
+    }
+    build_table(show_nonprinting);
+    if (fio_writer_open(&out, STDOUT_FILENO) < 0) {
+        perror("stdout");
+        exit(1);
+    }
 
-    if (argc < 2) {
-        f = fdopen(STDIN_FILENO, "r");
-        putsStdout(f, argv[i]);
+    if (optind == argc) {
+        putsStdout(STDIN_FILENO, "stdin");
     }
-    for (i = 1; i < argc; i++) {
-        f = fopen(argv[i], "r");
-        putsStdout(f, argv[i]);
+    for (i = optind; i < argc; i++) {
+        putsStdout(open(argv[i], O_RDONLY), argv[i]);
     }
+    if (fio_writer_close(&out) < 0) { exit(1); }
     exit(0);
 }
 
-void putsStdout(FILE *f, const char *path) {
+static void set_escape(int c, const char *s) {
+    escapes[c].len = strlen(s);
+    memcpy(escapes[c].s, s, escapes[c].len);
+    special[c] = 1;
+}
+
+/*
+ * Every byte that does not print as itself gets its expansion here:
+ * tab as \t and newline as $\n, and under -v control characters as ^X,
+ * DEL as ^? and high-bit bytes as M- followed by the low 7-bit form.
+ */
+static void build_table(int visible) {
     int c;
-    if (!f) {
-      perror(path);
-      exit(1);
+
+    for (c = 0; c < 256; c++) {
+        escapes[c].len = 1;
+        escapes[c].s[0] = c;
+    }
+    if (visible) {
+        for (c = 0; c < 256; c++) {
+            char s[5];
+            int low = c & 0x7f;
+            size_t n = 0;
+
+            if (c < 0x20 || c >= 0x7f) {
+                if (c >= 0x80) { s[n++] = 'M'; s[n++] = '-'; }
+                if (low < 0x20) { s[n++] = '^'; s[n++] = low + '@'; }
+                else if (low == 0x7f) { s[n++] = '^'; s[n++] = '?'; }
+                else { s[n++] = low; }
+                s[n] = '\0';
+                set_escape(c, s);
+            }
+        }
     }
-    while((c = fgetc(f)) != EOF) {
-        if ('\t' == c) {
-            printf("\\t");
+    set_escape('\t', "\\t");
+    set_escape('\n', "$\n");
+}
+
+/* length of the leading run of bytes that are copied as they are */
+static size_t plain_run(const unsigned char *p, size_t n) {
+    size_t i = 0;
+
+#if defined(__x86_64__)
+    const __m128i tab = _mm_set1_epi8('\t'), nl = _mm_set1_epi8('\n');
+    const __m128i space = _mm_set1_epi8(' '), del = _mm_set1_epi8(0x7f);
+
+    for (; n - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i hit;
+        int mask;
+
+        if (show_nonprinting) {
+            /* signed compare: below ' ' catches both controls and high-bit bytes */
+            hit = _mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del));
         } else {
-            if ('\n' == c) { putchar('$'); }
-            if (putchar(c) < 0) { exit(1); }
+            hit = _mm_or_si128(_mm_cmpeq_epi8(v, tab), _mm_cmpeq_epi8(v, nl));
+        }
+        mask = _mm_movemask_epi8(hit);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    while (i < n && !special[p[i]]) {
+        i++;
+    }
+    return i;
+}
+
+/*
+ * Input comes in whole mappings or large blocks and is expanded in
+ * pieces of at most PIECE bytes, each into space reserved for the worst
+ * case so the inner loop never checks for room.
+ */
+#define PIECE (64 * 1024)
+
+static void putsStdout(int fd, const char *path) {
+    struct FioReader in;
+    const unsigned char *block = NULL;
+    size_t n = 0;
+    int ret;
+
+    if (fd < 0 || fio_open(&in, fd) < 0) {
+        perror(path);
+        exit(1);
+    }
+    while ((ret = fio_block(&in, &block, &n)) > 0) {
+        const unsigned char *end = block + n;
+
+        while (block < end) {
+            const unsigned char *p = block;
+            const unsigned char *stop = end - p > PIECE ? p + PIECE : end;
+            unsigned char *dst = fio_reserve(&out, (stop - p) * MAX_ESCAPE + MAX_ESCAPE);
+            unsigned char *d = dst;
+
+            if (!dst) { exit(1); }
+            while (p < stop) {
+                size_t run = plain_run(p, stop - p);
+                const struct Escape *e;
+
+                memcpy(d, p, run);
+                d += run;
+                p += run;
+                if (p == stop) {
+                    break;
+                }
+                e = &escapes[*p++];
+                memcpy(d, e->s, MAX_ESCAPE);  /* the slack covers the overrun */
+                d += e->len;
+            }
+            fio_commit(&out, d - dst);
+            block = stop;
         }
     }
+    if (ret < 0) {
+        perror(path);
+        exit(1);
+    }
+    fio_close(&in);
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
 }
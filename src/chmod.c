@@ -1,22 +1,311 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include "walk.h"
+
+#define MAX_ACTIONS 64
+#define PENDING 0x10000 /* WalkDir.data: a mode still to be set on leave */
+
+/* one [+-=] with its permissions, e.g. the "+x" in "go+x,u=rw" */
+struct Action {
+  mode_t who;   /* bits the clause may touch; 0 for none given */
+  char op;
+  mode_t perm;  /* from r, w, x, s, t */
+  int cond_x;   /* X: x if a directory or already executable by someone */
+  int copy;     /* u, g or o: copy that class's current bits; -1 for none */
+};
+
+static void usage(const char *prog);
+static void parse_mode(const char *s);
+static mode_t apply(mode_t mode, int is_dir);
+static void do_path(const char *path);
+static void error(const char *path, const char *name);
+static void chmod_dir(struct Walker *w, struct WalkDir *dir, struct WalkEntry *ents, size_t n);
+static void chmod_leave(struct Walker *w, struct WalkDir *dir);
+
+static struct Action actions[MAX_ACTIONS];
+static int nactions = 0;
+static int numeric = 0;
+static mode_t numeric_mode;
+static int numeric_special = 0; /* five or more digits: set-id bits given explicitly */
+static mode_t umask_bits;
+static int opt_recursive = 0;
+static int nthreads;
+static int errors = 0;
 
 int main(int argc, char *argv[]) {
-  int mode;
-  int i;
+  static struct WalkOps ops;
+  char **roots;
+  mode_t *root_modes;
+  int i, nroots = 0;
 
-  if (argc < 2) {
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  /* by hand, since modes like -w look like options */
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (strcmp(argv[i], "--") == 0) {
+      i++;
+      break;
+    } else if (strcmp(argv[i], "-R") == 0 || strcmp(argv[i], "--recursive") == 0) {
+      opt_recursive = 1;
+    } else if (strncmp(argv[i], "-j", 2) == 0) {
+      const char *n = argv[i][2] ? argv[i] + 2 : argv[++i];
+
+      if (!n) {
+        usage(argv[0]);
+      }
+      nthreads = atoi(n);
+    } else {
+      break;
+    }
+  }
+  if (i >= argc) {
     fprintf(stderr, "no mode given\n");
     exit(1);
   }
+  parse_mode(argv[i++]);
+
+  roots = malloc(sizeof(char *) * (argc - i + 1));
+  root_modes = malloc(sizeof(mode_t) * (argc - i + 1));
+  if (!roots || !root_modes) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  for (; i < argc; i++) {
+    struct stat st;
+    mode_t new;
+
+    if (!opt_recursive) {
+      do_path(argv[i]);
+      continue;
+    }
+    if (lstat(argv[i], &st) < 0) {
+      error(argv[i], NULL);
+      continue;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+      do_path(argv[i]);
+      continue;
+    }
+    new = apply(st.st_mode, 1);
+    if ((new | (st.st_mode & 07777)) != (st.st_mode & 07777) &&
+        chmod(argv[i], new | (st.st_mode & 07777)) < 0) {
+      error(argv[i], NULL);
+      continue;
+    }
+    roots[nroots] = argv[i];
+    root_modes[nroots++] = (new | (st.st_mode & 07777)) != new ? PENDING | new : 0;
+  }
 
-  mode = strtol(argv[1], NULL, 0);
-  for (i = 2; i < argc; i++) {
-    if (chmod(argv[i], mode) < 0) {
-      perror(argv[i]);
+  if (nroots > 0) {
+    ops.stat_mask = STATX_MODE;
+    ops.hold_fds = 1;
+    ops.dir = chmod_dir;
+    ops.leave = chmod_leave;
+    if (walk_run(&ops, roots, nroots, nthreads)) {
+      errors = 1;
+    }
+    for (i = 0; i < nroots; i++) {
+      if ((root_modes[i] & PENDING) && chmod(roots[i], root_modes[i] & 07777) < 0) {
+        error(roots[i], NULL);
+      }
+    }
+  }
+  free(roots);
+  free(root_modes);
+  exit(errors ? 1 : 0);
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-R] [-j threads] mode path...\n", prog);
+  exit(1);
+}
+
+/*
+ * An octal number, or clauses like chmod(1)'s: [ugoa]*([-+=]([rwxXst]*|[ugo]))+
+ * separated by commas. Without u, g, o or a the clause applies to all,
+ * except for bits set in the umask.
+ */
+static void parse_mode(const char *s) {
+  const char *p = s;
+
+  if (*s >= '0' && *s <= '7') {
+    char *end;
+
+    numeric_mode = strtol(s, &end, 8);
+    if (*end || numeric_mode > 07777) {
+      fprintf(stderr, "invalid mode: %s\n", s);
+      exit(1);
+    }
+    numeric = 1;
+    numeric_special = end - s >= 5;
+    return;
+  }
+  umask_bits = umask(0);
+  umask(umask_bits);
+  while (1) {
+    mode_t who = 0;
+
+    for (; strchr("ugoa", *p) && *p; p++) {
+      who |= *p == 'u' ? 04700 : *p == 'g' ? 02070 : *p == 'o' ? 01007 : 07777;
+    }
+    if (!*p || !strchr("+-=", *p)) {
+      fprintf(stderr, "invalid mode: %s\n", s);
+      exit(1);
+    }
+    while (*p && strchr("+-=", *p)) {
+      struct Action *a = &actions[nactions];
+
+      if (nactions == MAX_ACTIONS) {
+        fprintf(stderr, "mode too long: %s\n", s);
+        exit(1);
+      }
+      nactions++;
+      memset(a, 0, sizeof *a);
+      a->who = who;
+      a->op = *p++;
+      a->copy = -1;
+      if (*p && strchr("ugo", *p)) {
+        a->copy = *p == 'u' ? 6 : *p == 'g' ? 3 : 0;
+        p++;
+        continue;
+      }
+      for (; *p && strchr("rwxXst", *p); p++) {
+        switch (*p) {
+          case 'r': a->perm |= 0444; break;
+          case 'w': a->perm |= 0222; break;
+          case 'x': a->perm |= 0111; break;
+          case 'X': a->cond_x = 1; break;
+          case 's': a->perm |= 06000; break;
+          case 't': a->perm |= 01000; break;
+        }
+      }
+    }
+    if (*p == '\0') {
+      break;
+    }
+    if (*p++ != ',') {
+      fprintf(stderr, "invalid mode: %s\n", s);
+      exit(1);
     }
   }
-  exit(0);
+}
+
+static mode_t apply(mode_t mode, int is_dir) {
+  int i;
+
+  mode &= 07777;
+  /*
+   * As in GNU chmod, a directory keeps its set-user-ID and set-group-ID
+   * bits unless the mode names them: g+s, u-s, or 5-digit octal.
+   */
+  if (numeric) {
+    return is_dir && !numeric_special ? numeric_mode | (mode & 06000) : numeric_mode;
+  }
+  for (i = 0; i < nactions; i++) {
+    struct Action *a = &actions[i];
+    mode_t perm = a->perm, who = a->who ? a->who : 07777 & ~umask_bits;
+
+    if (a->cond_x && (is_dir || (mode & 0111))) {
+      perm |= 0111;
+    }
+    if (a->copy >= 0) {
+      perm |= ((mode >> a->copy) & 7) * 0111;
+    }
+    switch (a->op) {
+      case '+':
+        mode |= perm & who;
+        break;
+      case '-':
+        mode &= ~(perm & who);
+        break;
+      case '=':
+        mode = (mode & ~((a->who ? a->who : 07777) & ~(is_dir ? 06000 : 0))) | (perm & who);
+        break;
+    }
+  }
+  return mode;
+}
+
+static void error(const char *path, const char *name) {
+  if (name) {
+    fprintf(stderr, "%s/%s: %s\n", path, name, strerror(errno));
+  } else {
+    perror(path);
+  }
+  __atomic_store_n(&errors, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * The new mode of every entry is compared with the one statx(2) reported
+ * (walk.h, relative to the directory fd), so entries that are already
+ * right are never written. A directory that needs bits added gets them
+ * now, before the walker opens it; bits it loses are taken away on the
+ * way back up, so a mode like a-rx still lets the walk get through.
+ * Symlinks are skipped, as chmod(2) would follow them.
+ */
+static void chmod_dir(struct Walker *w, struct WalkDir *dir, struct WalkEntry *ents, size_t n) {
+  size_t i;
+
+  (void)w;
+  for (i = 0; i < n; i++) {
+    struct WalkEntry *e = &ents[i];
+    mode_t old, new, first;
+
+    if (e->type == DT_LNK) {
+      continue;
+    }
+    if (!e->stat_ok) {
+      continue; /* removed since it was read */
+    }
+    old = e->st.mode & 07777;
+    new = apply(old, e->type == DT_DIR);
+    first = e->sub ? old | new : new;
+    if (first != old && fchmodat(dir->fd, e->name, first, 0) < 0) {
+      error(dir->path, e->name);
+      continue;
+    }
+    if (e->sub && new != first) {
+      e->sub->data = (void *)(uintptr_t)(PENDING | new);
+    }
+  }
+}
+
+static void chmod_leave(struct Walker *w, struct WalkDir *dir) {
+  uintptr_t pending = (uintptr_t)dir->data;
+  int ret;
+
+  (void)w;
+  if (!(pending & PENDING) || !dir->parent) {
+    return;
+  }
+  if (dir->parent->fd >= 0) {
+    ret = fchmodat(dir->parent->fd, dir->name, pending & 07777, 0);
+  } else {
+    ret = chmod(dir->path, pending & 07777);
+  }
+  if (ret < 0) {
+    error(dir->path, NULL);
+  }
+}
+
+/* a single path, written only if its mode actually changes */
+static void do_path(const char *path) {
+  struct stat st;
+  mode_t new;
+
+  if (stat(path, &st) < 0) {
+    error(path, NULL);
+    return;
+  }
+  new = apply(st.st_mode, S_ISDIR(st.st_mode));
+  if (new != (st.st_mode & 07777) && chmod(path, new) < 0) {
+    error(path, NULL);
+  }
 }
@@ -1,19 +1,100 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 #include <netdb.h>
 
+#define DEFAULT_SERVICE "daytime"
+#define DEFAULT_TIMEOUT_MS 3000
+#define DEFAULT_CONCURRENCY 512
+#define CONNECTION_ATTEMPT_DELAY_MS 250 /* RFC 8305 */
+#define MAX_EVENTS 256
+#define RESPONSE_BUF_SIZE 128
+
 static int open_connection(char *host, char *service);
+static void sweep(char **hosts, int nhosts, char *service);
+
+static int timeout_ms = DEFAULT_TIMEOUT_MS;
+static int concurrency = DEFAULT_CONCURRENCY;
 
 int main(int argc, char *argv[]) {
   int sock;
   FILE *f;
   char buf[1024];
+  char *service = DEFAULT_SERVICE;
+  char *list = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "f:s:t:c:")) != -1) {
+    switch (opt) {
+      case 'f':
+        list = optarg;
+        break;
+      case 's':
+        service = optarg;
+        break;
+      case 't':
+        timeout_ms = atoi(optarg);
+        break;
+      case 'c':
+        concurrency = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-s service] [-t timeout_ms] [-c concurrency] [-f hostlist] [host ...]\n", argv[0]);
+        exit(1);
+    }
+  }
+  if (concurrency < 1) {
+    concurrency = 1;
+  }
+
+  if (list) {
+    FILE *lf;
+    char **hosts = NULL;
+    int nhosts = 0, cap = 0;
+    char line[1024];
 
-  sock = open_connection((argc > 1 ? argv[1] : "localhost"), "daytime");
+    lf = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+    if (!lf) {
+      perror(list);
+      exit(1);
+    }
+    while (fgets(line, sizeof line, lf)) {
+      char *host = strtok(line, " \t\r\n");
+
+      if (!host || host[0] == '#') {
+        continue;
+      }
+      if (nhosts == cap) {
+        cap = cap ? cap * 2 : 64;
+        hosts = realloc(hosts, sizeof(char *) * cap);
+        if (!hosts) {
+          perror("realloc(3)");
+          exit(1);
+        }
+      }
+      hosts[nhosts++] = strdup(host);
+    }
+    if (lf != stdin) {
+      fclose(lf);
+    }
+    sweep(hosts, nhosts, service);
+    exit(0);
+  }
+  if (argc - optind > 1) {
+    sweep(argv + optind, argc - optind, service);
+    exit(0);
+  }
+
+  sock = open_connection((optind < argc ? argv[optind] : "localhost"), service);
   f = fdopen(sock, "r");
   if (!f) {
     perror("fopen(3)");
@@ -53,3 +134,345 @@ static int open_connection(char *host, char *service) {
   freeaddrinfo(res);
   exit(1);
 }
+
+/*
+ * Sweep mode.
+ *
+ * Up to `concurrency` targets are in flight at once. Each one races its
+ * addresses happy-eyeballs style: families are interleaved and a new
+ * non-blocking connect(2) is started every CONNECTION_ATTEMPT_DELAY_MS
+ * (or immediately when an attempt fails) until one completes. The first
+ * connected socket wins and the others are closed.
+ */
+
+struct Target;
+
+struct Attempt {
+  struct Target *target;
+  int fd;
+};
+
+struct Target {
+  char *host;
+  struct gaicb req;
+  struct addrinfo hints;
+  struct addrinfo **addrs; /* families interleaved */
+  struct Attempt *attempts;
+  int naddrs;
+  int next;
+  int inflight;
+  int fd;
+  double start;
+  double connected;
+  double next_attempt_at;
+  char addr[INET6_ADDRSTRLEN];
+  char buf[RESPONSE_BUF_SIZE];
+  size_t len;
+};
+
+static int epfd;
+static double *connect_times, *rtts;
+static int nok, nfailed;
+
+static double now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void *xmalloc(size_t size) {
+  void *p = calloc(1, size);
+
+  if (!p) {
+    perror("calloc(3)");
+    exit(1);
+  }
+  return p;
+}
+
+static void order_addresses(struct Target *t) {
+  struct addrinfo *ai, *v6 = NULL, *v4 = NULL;
+  int n = 0;
+
+  for (ai = t->req.ar_result; ai; ai = ai->ai_next) {
+    n++;
+  }
+  t->addrs = xmalloc(sizeof(struct addrinfo *) * (n + 1));
+  t->attempts = xmalloc(sizeof(struct Attempt) * (n + 1));
+  for (ai = t->req.ar_result; ai; ai = ai->ai_next) {
+    if (ai->ai_family == AF_INET6 && !v6) { v6 = ai; }
+    if (ai->ai_family == AF_INET && !v4) { v4 = ai; }
+  }
+  /* v6, v4, v6, v4, ... then whatever is left of the longer family */
+  while (v6 || v4) {
+    if (v6) {
+      t->addrs[t->naddrs++] = v6;
+      for (v6 = v6->ai_next; v6 && v6->ai_family != AF_INET6; v6 = v6->ai_next)
+        ;
+    }
+    if (v4) {
+      t->addrs[t->naddrs++] = v4;
+      for (v4 = v4->ai_next; v4 && v4->ai_family != AF_INET; v4 = v4->ai_next)
+        ;
+    }
+  }
+}
+
+static void close_attempts(struct Target *t, int keep) {
+  int i;
+
+  for (i = 0; i < t->next; i++) {
+    if (t->attempts[i].fd >= 0 && t->attempts[i].fd != keep) {
+      close(t->attempts[i].fd);
+      t->attempts[i].fd = -1;
+    }
+  }
+  t->inflight = 0;
+}
+
+static void finish(struct Target *t, const char *error) {
+  double start = t->start;
+
+  /* the connected socket is one of the attempts, so this closes it too */
+  close_attempts(t, -1);
+  t->fd = -1;
+  t->next_attempt_at = 0;
+  t->start = 0;
+  if (error) {
+    printf("%s\t%s\terror\t%s\n", t->host, t->addr[0] ? t->addr : "-", error);
+    nfailed++;
+  } else {
+    double done = now_ms();
+    double rtt = done - start;
+    struct timespec wall;
+    struct tm tm;
+    char *nl;
+    size_t end;
+
+    clock_gettime(CLOCK_REALTIME, &wall);
+    nl = memchr(t->buf, '\n', t->len);
+    end = nl ? (size_t)(nl - t->buf) : t->len;
+    t->buf[end] = '\0';
+    memset(&tm, 0, sizeof tm);
+    printf("%s\t%s\tconnect=%.3fms\trtt=%.3fms\t", t->host, t->addr,
+           t->connected - start, rtt);
+    if (strptime(t->buf, "%a %b %d %H:%M:%S %Y", &tm)) {
+      double remote, local;
+
+      tm.tm_isdst = -1;
+      remote = mktime(&tm);
+      /* the server sampled its clock somewhere between connect and EOF */
+      local = wall.tv_sec + wall.tv_nsec / 1e9 - (done - t->connected) / 2000.0;
+      printf("skew=%+.0fs\t%s\n", remote - local, t->buf);
+    } else {
+      printf("skew=?\t%s\n", t->buf);
+    }
+    connect_times[nok] = t->connected - start;
+    rtts[nok] = rtt;
+    nok++;
+  }
+}
+
+static void start_attempt(struct Target *t) {
+  while (t->next < t->naddrs) {
+    struct addrinfo *ai = t->addrs[t->next];
+    struct Attempt *a = &t->attempts[t->next++];
+    struct epoll_event ev;
+
+    a->target = t;
+    a->fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK, ai->ai_protocol);
+    if (a->fd < 0) {
+      continue;
+    }
+    if (connect(a->fd, ai->ai_addr, ai->ai_addrlen) < 0 && errno != EINPROGRESS) {
+      close(a->fd);
+      a->fd = -1;
+      continue;
+    }
+    ev.events = EPOLLOUT;
+    ev.data.ptr = a;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, a->fd, &ev);
+    t->inflight++;
+    t->next_attempt_at = now_ms() + CONNECTION_ATTEMPT_DELAY_MS;
+    return;
+  }
+  t->next_attempt_at = 0;
+  if (t->inflight == 0) {
+    finish(t, "connect failed");
+  }
+}
+
+static void on_connect(struct Attempt *a) {
+  struct Target *t = a->target;
+  struct epoll_event ev;
+  int err = 0;
+  socklen_t len = sizeof err;
+
+  getsockopt(a->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+  if (err) {
+    close(a->fd);
+    a->fd = -1;
+    t->inflight--;
+    if (t->next == t->naddrs && t->inflight == 0) {
+      finish(t, strerror(err));
+    } else if (t->next < t->naddrs) {
+      start_attempt(t);
+    }
+    return;
+  }
+  t->connected = now_ms();
+  t->fd = a->fd;
+  close_attempts(t, t->fd);
+  t->next_attempt_at = 0;
+  getnameinfo(t->addrs[a - t->attempts]->ai_addr, t->addrs[a - t->attempts]->ai_addrlen,
+              t->addr, sizeof t->addr, NULL, 0, NI_NUMERICHOST);
+  ev.events = EPOLLIN;
+  ev.data.ptr = a;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, t->fd, &ev);
+}
+
+static void on_readable(struct Attempt *a) {
+  struct Target *t = a->target;
+  ssize_t n;
+
+  n = read(t->fd, t->buf + t->len, sizeof t->buf - 1 - t->len);
+  if (n < 0) {
+    if (errno != EAGAIN && errno != EINTR) {
+      finish(t, strerror(errno));
+    }
+    return;
+  }
+  t->len += n;
+  if (n == 0 || memchr(t->buf, '\n', t->len) || t->len == sizeof t->buf - 1) {
+    finish(t, t->len ? NULL : "empty response");
+  }
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void report(const char *name, double *v, int n) {
+  if (n == 0) {
+    return;
+  }
+  qsort(v, n, sizeof(double), compare_double);
+  fprintf(stderr, "%s\tp50=%.3fms\tp90=%.3fms\tp99=%.3fms\tmax=%.3fms\n", name,
+          v[n / 2], v[n * 90 / 100], v[n * 99 / 100], v[n - 1]);
+}
+
+static void sweep(char **hosts, int nhosts, char *service) {
+  struct Target *targets;
+  struct gaicb **reqs;
+  struct epoll_event events[MAX_EVENTS];
+  int next_target = 0, active = 0;
+  double sweep_start = now_ms();
+  int i;
+
+  targets = xmalloc(sizeof(struct Target) * (nhosts + 1));
+  reqs = xmalloc(sizeof(struct gaicb *) * (nhosts + 1));
+  connect_times = xmalloc(sizeof(double) * (nhosts + 1));
+  rtts = xmalloc(sizeof(double) * (nhosts + 1));
+
+  /* resolve every name concurrently */
+  for (i = 0; i < nhosts; i++) {
+    struct Target *t = &targets[i];
+
+    t->host = hosts[i];
+    t->fd = -1;
+    t->hints.ai_family = AF_UNSPEC;
+    t->hints.ai_socktype = SOCK_STREAM;
+    t->req.ar_name = hosts[i];
+    t->req.ar_service = service;
+    t->req.ar_request = &t->hints;
+    reqs[i] = &t->req;
+  }
+  if (nhosts > 0 && getaddrinfo_a(GAI_WAIT, reqs, nhosts, NULL) != 0) {
+    perror("getaddrinfo_a(3)");
+    exit(1);
+  }
+
+  epfd = epoll_create1(0);
+  if (epfd < 0) {
+    perror("epoll_create1(2)");
+    exit(1);
+  }
+  while (next_target < nhosts || active > 0) {
+    double now;
+    int timeout = -1;
+    int n;
+
+    while (active < concurrency && next_target < nhosts) {
+      struct Target *t = &targets[next_target++];
+      int err = gai_error(&t->req);
+
+      if (err) {
+        finish(t, gai_strerror(err));
+        continue;
+      }
+      order_addresses(t);
+      t->start = now_ms();
+      start_attempt(t);
+    }
+
+    active = 0;
+    now = now_ms();
+    for (i = 0; i < next_target; i++) {
+      struct Target *t = &targets[i];
+      double wait;
+
+      if (!t->start) {
+        continue;
+      }
+      if (now - t->start >= timeout_ms) {
+        finish(t, "timeout");
+        continue;
+      }
+      if (t->fd < 0 && t->next_attempt_at && now >= t->next_attempt_at) {
+        start_attempt(t);
+        if (!t->start) {
+          continue;
+        }
+      }
+      active++;
+      wait = t->start + timeout_ms - now;
+      if (t->fd < 0 && t->next_attempt_at && t->next_attempt_at - now < wait) {
+        wait = t->next_attempt_at - now;
+      }
+      if (timeout < 0 || wait + 1 < timeout) {
+        timeout = wait + 1;
+      }
+    }
+    if (active == 0) {
+      continue;
+    }
+
+    n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+    if (n < 0 && errno != EINTR) {
+      perror("epoll_wait(2)");
+      exit(1);
+    }
+    for (i = 0; i < n; i++) {
+      struct Attempt *a = events[i].data.ptr;
+
+      if (!a->target->start || a->fd < 0) {
+        continue; /* finished earlier in this batch */
+      }
+      if (a->target->fd == a->fd) {
+        on_readable(a);
+      } else {
+        on_connect(a);
+      }
+    }
+  }
+  close(epfd);
+  fflush(stdout);
+
+  fprintf(stderr, "hosts=%d\tok=%d\tfailed=%d\telapsed=%.3fms\n",
+          nhosts, nok, nfailed, now_ms() - sweep_start);
+  report("connect", connect_times, nok);
+  report("rtt", rtts, nok);
+}
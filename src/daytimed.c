@@ -1,42 +1,271 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
 #include <netdb.h>
+#include "event.h"
 
 #define DEFAULT_PORT 13
+#define UDP_BATCH 64
+#define UDP_REQUEST_SIZE 64
+#define TIME_BUF_SIZE 64
 
-static int listen_socket(int port);
+static int listen_socket(int port, int socktype, int reuseport);
+static void serve(int tcp, int udp);
+static void supervise(int tcp, int udp, int port, int workers);
+static const char *current_time(size_t *len);
 
 int main(int argc, char *argv[]) {
-  struct sockaddr_storage addr;
-  socklen_t addrlen = sizeof addr;
-  int sock, server;
+  int opt;
+  int use_tcp = 0, use_udp = 0;
+  int workers = 1;
+  int port;
+
+  while ((opt = getopt(argc, argv, "tuw:")) != -1) {
+    switch (opt) {
+      case 't':
+        use_tcp = 1;
+        break;
+      case 'u':
+        use_udp = 1;
+        break;
+      case 'w':
+        workers = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-t] [-u] [-w workers] [port]\n", argv[0]);
+        exit(1);
+    }
+  }
+  if (!use_tcp && !use_udp) {
+    use_tcp = 1;
+  }
+  if (workers < 1) {
+    workers = 1;
+  }
+  port = optind < argc ? atoi(argv[optind]) : DEFAULT_PORT;
+
+  if (workers == 1) {
+    serve(use_tcp ? listen_socket(port, SOCK_STREAM, 0) : -1,
+          use_udp ? listen_socket(port, SOCK_DGRAM, 0) : -1);
+    exit(0);
+  }
+
+  supervise(use_tcp, use_udp, port, workers);
+  exit(0);
+}
+
+/*
+ * asctime() output for the current second. The string is rebuilt only
+ * when the second changes, so a busy server formats it once per second
+ * instead of once per client.
+ */
+static const char *current_time(size_t *len) {
+  static time_t cached = -1;
+  static char buf[TIME_BUF_SIZE];
+  static size_t buflen;
   time_t t;
-  struct tm *tm;
-  char *timestr;
 
-  server = listen_socket(argc > 1 ? atoi(argv[1]) : DEFAULT_PORT);
+  time(&t);
+  if (t != cached) {
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    asctime_r(&tm, buf);
+    buflen = strlen(buf);
+    cached = t;
+  }
+  *len = buflen;
+  return buf;
+}
+
+static void serve_tcp(int server) {
   while (1) {
-    sock = accept(server, (struct sockaddr*)&addr, &addrlen);
+    const char *timestr;
+    size_t len;
+    int sock;
+
+    sock = accept4(server, NULL, NULL, SOCK_NONBLOCK);
     if (sock < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
       perror("accept(2)");
       exit(1);
     }
-    time(&t);
-    tm = localtime(&t);
-    timestr = asctime(tm);
-    write(sock, timestr, strlen(timestr));
+    timestr = current_time(&len);
+    write(sock, timestr, len);
     close(sock);
   }
-  close(server);
-  exit(0);
 }
 
-static int listen_socket(int port) {
+/* RFC 867: any datagram is answered with the time string */
+static void serve_udp(int sock) {
+  static struct mmsghdr msgs[UDP_BATCH];
+  static struct iovec iovs[UDP_BATCH];
+  static struct sockaddr_storage addrs[UDP_BATCH];
+  static char bufs[UDP_BATCH][UDP_REQUEST_SIZE];
+
+  while (1) {
+    const char *timestr;
+    size_t len;
+    int n, i;
+
+    for (i = 0; i < UDP_BATCH; i++) {
+      iovs[i].iov_base = bufs[i];
+      iovs[i].iov_len = UDP_REQUEST_SIZE;
+      memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof addrs[i];
+    }
+    n = recvmmsg(sock, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return;
+      }
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("recvmmsg(2)");
+      exit(1);
+    }
+    timestr = current_time(&len);
+    for (i = 0; i < n; i++) {
+      /* msg_name and msg_namelen already hold the sender */
+      iovs[i].iov_base = (void *)timestr;
+      iovs[i].iov_len = len;
+    }
+    sendmmsg(sock, msgs, n, MSG_DONTWAIT);
+    if (n < UDP_BATCH) {
+      return;
+    }
+  }
+}
+
+static void tcp_ready(struct EvLoop *loop, struct EvSource *src, uint32_t events) {
+  (void)loop;
+  (void)events;
+  serve_tcp(src->fd);
+}
+
+static void udp_ready(struct EvLoop *loop, struct EvSource *src, uint32_t events) {
+  (void)loop;
+  (void)events;
+  serve_udp(src->fd);
+}
+
+static void stop_by_signal(struct EvLoop *loop, const struct signalfd_siginfo *si, void *arg) {
+  (void)si;
+  (void)arg;
+  ev_stop(loop);
+}
+
+/* the sockets and SIGINT/SIGTERM share one epoll loop (event.h); a signal ends it cleanly */
+static void serve(int tcp, int udp) {
+  static struct EvLoop loop;
+  static struct EvSource tcp_src, udp_src;
+
+  ev_init(&loop);
+  ev_signal(&loop, SIGINT, stop_by_signal, NULL);
+  ev_signal(&loop, SIGTERM, stop_by_signal, NULL);
+  if (tcp >= 0) {
+    ev_add(&loop, &tcp_src, tcp, EPOLLIN, tcp_ready, NULL);
+  }
+  if (udp >= 0) {
+    ev_add(&loop, &udp_src, udp, EPOLLIN, udp_ready, NULL);
+  }
+  ev_run(&loop);
+  ev_free(&loop);
+}
+
+static pid_t *worker_pids;
+static int nworkers, live_workers;
+
+/* pass SIGINT/SIGTERM on to the workers; they are waited for through SIGCHLD */
+static void forward_signal(struct EvLoop *loop, const struct signalfd_siginfo *si, void *arg) {
+  int i;
+
+  (void)loop;
+  (void)arg;
+  for (i = 0; i < nworkers; i++) {
+    if (worker_pids[i] > 0) {
+      kill(worker_pids[i], si->ssi_signo);
+    }
+  }
+}
+
+/* SIGCHLD is merged while pending, so one delivery may stand for several workers */
+static void reap_workers(struct EvLoop *loop, const struct signalfd_siginfo *si, void *arg) {
+  pid_t pid;
+  int i;
+
+  (void)si;
+  (void)arg;
+  while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+    for (i = 0; i < nworkers; i++) {
+      if (worker_pids[i] == pid) {
+        worker_pids[i] = -1;
+        live_workers--;
+      }
+    }
+  }
+  if (live_workers == 0) {
+    ev_stop(loop);
+  }
+}
+
+/*
+ * Every worker binds its own SO_REUSEPORT sockets; the kernel spreads
+ * load. The loop and its signals are set up before the first fork(2),
+ * so a worker that dies early still leaves its SIGCHLD pending for us.
+ */
+static void supervise(int tcp, int udp, int port, int workers) {
+  static struct EvLoop loop;
+  int i;
+
+  worker_pids = calloc(workers, sizeof(pid_t));
+  if (!worker_pids) {
+    perror("calloc(3)");
+    exit(1);
+  }
+  ev_init(&loop);
+  ev_signal(&loop, SIGCHLD, reap_workers, NULL);
+  ev_signal(&loop, SIGINT, forward_signal, NULL);
+  ev_signal(&loop, SIGTERM, forward_signal, NULL);
+  for (i = 0; i < workers; i++) {
+    pid_t pid = fork();
+
+    if (pid < 0) {
+      perror("fork(2)");
+      exit(1);
+    }
+    if (pid == 0) {
+      ev_forked(&loop);
+      serve(tcp ? listen_socket(port, SOCK_STREAM, 1) : -1,
+            udp ? listen_socket(port, SOCK_DGRAM, 1) : -1);
+      exit(0);
+    }
+    worker_pids[nworkers++] = pid;
+    live_workers++;
+  }
+  ev_run(&loop);
+  ev_free(&loop);
+  free(worker_pids);
+}
+
+static int listen_socket(int port, int socktype, int reuseport) {
   struct addrinfo hints, *res, *ai;
   int err;
   char service[16];
@@ -44,7 +273,7 @@ static int listen_socket(int port) {
   memset(&hints, 0, sizeof(struct addrinfo));
 
   hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_socktype = socktype;
   hints.ai_flags = AI_PASSIVE;
   snprintf(service, sizeof service, "%d", port);
   if ((err = getaddrinfo(NULL, service, &hints, &res)) != 0) {
@@ -53,21 +282,27 @@ static int listen_socket(int port) {
   }
   for (ai = res; ai; ai = ai->ai_next) {
     int sock;
+    int on = 1;
 
-    sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    sock = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK, ai->ai_protocol);
     if (sock < 0) {
       continue;
     }
+    if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof on) < 0) {
+      close(sock);
+      continue;
+    }
     if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
       close(sock);
       continue;
     }
-    if (listen(sock, 5) < 0) {
+    if (socktype == SOCK_STREAM && listen(sock, SOMAXCONN) < 0) {
       close(sock);
       continue;
     }
     freeaddrinfo(res);
-    fprintf(stderr, "listening on port %d...\n", port);
+    fprintf(stderr, "listening on %s port %d...\n",
+            socktype == SOCK_STREAM ? "tcp" : "udp", port);
     return sock;
   }
   fprintf(stderr, "cannot listen socket\n");
@@ -0,0 +1,293 @@
+/*
+ * Single-threaded epoll event loop, header-only like fastio.h.
+ *
+ * Signals are not caught with handlers. ev_signal() blocks the signal
+ * and adds it to one signalfd(2) owned by the loop, so a signal arrives
+ * as an ordinary readable fd. Its handler then runs from the loop, where
+ * anything may be called; epoll_wait(2) and the callbacks are never
+ * interrupted, and no EINTR retry is needed. Blocking happens with
+ * pthread_sigmask(3), so set up signals before starting any threads;
+ * they inherit the mask and no thread is left to take the signal.
+ *
+ * A standard signal that is sent again while still pending is merged
+ * with the pending one by the kernel. Each wakeup reads the signalfd
+ * until it is empty, and each signal read counts as one delivery in
+ * loop->sig_count. A handler must therefore not assume one delivery per
+ * kill(2): a SIGCHLD handler, for one, reaps with WNOHANG until no child
+ * is left. Realtime signals are queued and delivered one by one.
+ *
+ * ev_timer() and ev_eventfd() wrap timerfd(2) and eventfd(2). Their
+ * counter is read before the callback runs, so src->count holds the
+ * timer expirations, or the sum of the ev_notify() values, since the
+ * last callback. ev_add() watches any other fd; its callback does the
+ * reading itself.
+ *
+ * The blocked mask is inherited across fork(2) and execve(2), and a
+ * signalfd keeps waking the epoll set of the process that registered it.
+ * A forked child calls ev_forked() and, if it needs one, sets up a loop
+ * of its own.
+ */
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+#define EV_MAX_EVENTS 64
+#define EV_SIGINFO_BATCH 16
+
+struct EvLoop;
+struct EvSource;
+
+typedef void (*ev_callback)(struct EvLoop *loop, struct EvSource *src, uint32_t events);
+typedef void (*ev_sig_handler)(struct EvLoop *loop, const struct signalfd_siginfo *si, void *arg);
+
+struct EvSource {
+  int fd;
+  ev_callback ready; /* the loop's own reader for signalfd/timerfd/eventfd, or NULL */
+  ev_callback cb;
+  void *arg;        /* owned by the caller */
+  int owned;        /* fd was opened by the loop and is closed by ev_del() */
+  uint64_t count;   /* timer/eventfd: counter read for this callback */
+  uint64_t total;   /* timer/eventfd: sum of all counts */
+};
+
+struct EvLoop {
+  int epfd;
+  int stop;
+  sigset_t sigs;           /* signals routed to the signalfd */
+  sigset_t saved_mask;     /* the thread's mask before the first ev_signal() */
+  struct EvSource sigsrc;  /* fd is -1 until the first ev_signal() */
+  ev_sig_handler handlers[NSIG];
+  void *handler_args[NSIG];
+  unsigned long sig_count[NSIG]; /* deliveries, after coalescing */
+};
+
+static inline void ev_fatal(const char *what) {
+  perror(what);
+  exit(1);
+}
+
+static inline void ev_init(struct EvLoop *loop) {
+  memset(loop, 0, sizeof *loop);
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epfd < 0) {
+    ev_fatal("epoll_create1(2)");
+  }
+  sigemptyset(&loop->sigs);
+  pthread_sigmask(SIG_BLOCK, NULL, &loop->saved_mask);
+  loop->sigsrc.fd = -1;
+}
+
+static inline void ev_add(struct EvLoop *loop, struct EvSource *src, int fd, uint32_t events,
+                          ev_callback cb, void *arg) {
+  struct epoll_event ev;
+
+  memset(src, 0, sizeof *src);
+  src->fd = fd;
+  src->cb = cb;
+  src->arg = arg;
+  ev.events = events;
+  ev.data.ptr = src;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    ev_fatal("epoll_ctl(2)");
+  }
+}
+
+static inline void ev_del(struct EvLoop *loop, struct EvSource *src) {
+  if (src->fd < 0) {
+    return;
+  }
+  epoll_ctl(loop->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+  if (src->owned) {
+    close(src->fd);
+  }
+  src->fd = -1;
+}
+
+/* drain the signalfd; every signal read is one delivery */
+static inline void ev_signal_ready(struct EvLoop *loop, struct EvSource *src, uint32_t events) {
+  struct signalfd_siginfo si[EV_SIGINFO_BATCH];
+
+  (void)events;
+  while (1) {
+    ssize_t n = read(src->fd, si, sizeof si);
+    size_t i;
+
+    if (n < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        return;
+      }
+      ev_fatal("read(2) from signalfd");
+    }
+    for (i = 0; i < (size_t)n / sizeof si[0]; i++) {
+      int sig = si[i].ssi_signo;
+
+      if (sig <= 0 || sig >= NSIG) {
+        continue;
+      }
+      loop->sig_count[sig]++;
+      if (loop->handlers[sig]) {
+        loop->handlers[sig](loop, &si[i], loop->handler_args[sig]);
+      }
+    }
+    if ((size_t)n < sizeof si) {
+      return;
+    }
+  }
+}
+
+/*
+ * Route sig to handler. The signal is blocked before it is added to the
+ * signalfd, so one that arrives in between waits as pending and is read
+ * on the next wakeup. A NULL handler still counts deliveries. A signal
+ * whose disposition is SIG_IGN is discarded by the kernel and never
+ * arrives.
+ */
+static inline void ev_signal(struct EvLoop *loop, int sig, ev_sig_handler handler, void *arg) {
+  sigset_t one;
+  int fd;
+
+  sigemptyset(&one);
+  sigaddset(&one, sig);
+  if ((errno = pthread_sigmask(SIG_BLOCK, &one, NULL)) != 0) {
+    ev_fatal("pthread_sigmask(3)");
+  }
+  sigaddset(&loop->sigs, sig);
+  loop->handlers[sig] = handler;
+  loop->handler_args[sig] = arg;
+  fd = signalfd(loop->sigsrc.fd, &loop->sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd < 0) {
+    ev_fatal("signalfd(2)");
+  }
+  if (loop->sigsrc.fd < 0) {
+    ev_add(loop, &loop->sigsrc, fd, EPOLLIN, NULL, NULL);
+    loop->sigsrc.ready = ev_signal_ready;
+    loop->sigsrc.owned = 1;
+  }
+}
+
+/* in a child after fork(2): drop the parent's loop and restore its signal mask */
+static inline void ev_forked(struct EvLoop *loop) {
+  close(loop->epfd);
+  if (loop->sigsrc.fd >= 0) {
+    close(loop->sigsrc.fd);
+  }
+  pthread_sigmask(SIG_SETMASK, &loop->saved_mask, NULL);
+}
+
+/* read a timerfd or eventfd counter into src, then run the callback */
+static inline void ev_counter_ready(struct EvLoop *loop, struct EvSource *src, uint32_t events) {
+  uint64_t n;
+
+  if (read(src->fd, &n, sizeof n) != sizeof n) {
+    if (errno == EAGAIN || errno == EINTR) {
+      return;
+    }
+    ev_fatal("read(2) from timerfd/eventfd");
+  }
+  src->count = n;
+  src->total += n;
+  src->cb(loop, src, events);
+}
+
+static inline void ev_add_counter(struct EvLoop *loop, struct EvSource *src, int fd,
+                                  ev_callback cb, void *arg) {
+  ev_add(loop, src, fd, EPOLLIN, cb, arg);
+  src->ready = ev_counter_ready;
+  src->owned = 1;
+}
+
+/*
+ * First expiry after first_ms, then every interval_ms; 0 for a one-shot.
+ * CLOCK_MONOTONIC, so changes to the wall clock do not move it.
+ */
+static inline void ev_timer(struct EvLoop *loop, struct EvSource *src, long first_ms, long interval_ms,
+                            ev_callback cb, void *arg) {
+  struct itimerspec its;
+  int fd;
+
+  fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0) {
+    ev_fatal("timerfd_create(2)");
+  }
+  if (first_ms <= 0) {
+    first_ms = interval_ms > 0 ? interval_ms : 1;
+  }
+  its.it_value.tv_sec = first_ms / 1000;
+  its.it_value.tv_nsec = first_ms % 1000 * 1000000;
+  its.it_interval.tv_sec = interval_ms / 1000;
+  its.it_interval.tv_nsec = interval_ms % 1000 * 1000000;
+  if (timerfd_settime(fd, 0, &its, NULL) < 0) {
+    ev_fatal("timerfd_settime(2)");
+  }
+  ev_add_counter(loop, src, fd, cb, arg);
+}
+
+static inline void ev_eventfd(struct EvLoop *loop, struct EvSource *src, ev_callback cb, void *arg) {
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  if (fd < 0) {
+    ev_fatal("eventfd(2)");
+  }
+  ev_add_counter(loop, src, fd, cb, arg);
+}
+
+/* wake src's callback with n added to its count; safe from any thread */
+static inline void ev_notify(struct EvSource *src, uint64_t n) {
+  while (write(src->fd, &n, sizeof n) < 0 && errno == EINTR)
+    ;
+}
+
+/* from a callback: return from ev_run() once the current batch is done */
+static inline void ev_stop(struct EvLoop *loop) {
+  loop->stop = 1;
+}
+
+/* dispatch events until ev_stop(); timeout_ms as epoll_wait(2), for one batch */
+static inline int ev_run_once(struct EvLoop *loop, int timeout_ms) {
+  struct epoll_event events[EV_MAX_EVENTS];
+  int n, i;
+
+  n = epoll_wait(loop->epfd, events, EV_MAX_EVENTS, timeout_ms);
+  if (n < 0) {
+    if (errno == EINTR) {
+      return 0; /* a signal nobody routed here, e.g. SIGSTOP/SIGCONT */
+    }
+    ev_fatal("epoll_wait(2)");
+  }
+  for (i = 0; i < n; i++) {
+    struct EvSource *src = events[i].data.ptr;
+
+    if (src->fd < 0) {
+      continue; /* ev_del() by an earlier callback in this batch */
+    }
+    (src->ready ? src->ready : src->cb)(loop, src, events[i].events);
+  }
+  return n;
+}
+
+static inline void ev_run(struct EvLoop *loop) {
+  loop->stop = 0;
+  while (!loop->stop) {
+    ev_run_once(loop, -1);
+  }
+}
+
+static inline void ev_free(struct EvLoop *loop) {
+  ev_del(loop, &loop->sigsrc);
+  close(loop->epfd);
+  pthread_sigmask(SIG_SETMASK, &loop->saved_mask, NULL);
+}
+
+#endif
@@ -0,0 +1,301 @@
+/*
+ * Buffered I/O shared by the text tools (cat2, cat3, head, wc-l, httpd).
+ *
+ * Header-only, so each program under src/ still builds alone with a
+ * plain `gcc src/X.c`. Regular files are mapped whole; anything else is
+ * read into a large page-aligned buffer that grows as needed, so
+ * fio_getline() has no line-length limit unless max_line is set. The
+ * writer batches output and passes large blocks straight to write(2).
+ */
+#ifndef FASTIO_H
+#define FASTIO_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define FIO_BUFFER_SIZE (256 * 1024)
+
+struct FioReader {
+    int fd;
+    unsigned char *buf;  /* the mapping, or a malloc'd buffer */
+    size_t cap;
+    size_t pos;          /* unread bytes are buf[pos..len) */
+    size_t len;
+    size_t scanned;      /* bytes after pos already known to hold no delimiter */
+    size_t max_line;     /* fio_getline() fails with E2BIG past this; 0 = no limit */
+    int mapped;
+    int eof;
+};
+
+struct FioWriter {
+    int fd;
+    unsigned char *buf;
+    size_t len;
+    size_t cap;
+};
+
+static inline void *fio_alloc(size_t size) {
+    void *p;
+
+    if (posix_memalign(&p, sysconf(_SC_PAGESIZE), size) != 0) {
+        return NULL;
+    }
+    return p;
+}
+
+static inline int fio_write_all(int fd, const void *p, size_t n) {
+    const unsigned char *s = p;
+
+    while (n > 0) {
+        ssize_t w = write(fd, s, n);
+
+        if (w < 0) {
+            if (errno == EINTR) { continue; }
+            return -1;
+        }
+        s += w;
+        n -= w;
+    }
+    return 0;
+}
+
+/* Returns 0, or -1 with errno set. */
+static inline int fio_open(struct FioReader *r, int fd) {
+    struct stat st;
+
+    memset(r, 0, sizeof(struct FioReader));
+    r->fd = fd;
+    if (fstat(fd, &st) < 0) {
+        return -1;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        off_t off = lseek(fd, 0, SEEK_CUR);
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map != MAP_FAILED && off >= 0 && off <= st.st_size) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            r->buf = map;
+            r->cap = r->len = st.st_size;
+            r->pos = off;
+            r->mapped = 1;
+            r->eof = 1;
+            return 0;
+        }
+        if (map != MAP_FAILED) {
+            munmap(map, st.st_size);
+        }
+    }
+    r->cap = FIO_BUFFER_SIZE;
+    r->buf = fio_alloc(r->cap);
+    return r->buf ? 0 : -1;
+}
+
+/*
+ * Read more input behind the unread bytes, compacting or growing the
+ * buffer first. Returns the number of bytes added, 0 at end of input.
+ */
+static inline ssize_t fio_fill(struct FioReader *r) {
+    ssize_t n;
+
+    if (r->eof) {
+        return 0;
+    }
+    if (r->pos > 0) {
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+    }
+    if (r->len == r->cap) {
+        unsigned char *bigger = fio_alloc(r->cap * 2);
+
+        if (!bigger) {
+            return -1;
+        }
+        memcpy(bigger, r->buf, r->len);
+        free(r->buf);
+        r->buf = bigger;
+        r->cap *= 2;
+    }
+    do {
+        n = read(r->fd, r->buf + r->len, r->cap - r->len);
+    } while (n < 0 && errno == EINTR);
+    if (n == 0) {
+        r->eof = 1;
+    }
+    if (n > 0) {
+        r->len += n;
+    }
+    return n;
+}
+
+/*
+ * Next record up to and including delim (the last one may lack it). It
+ * stays valid until the next call. Returns 1, 0 at end of input, or -1.
+ */
+static inline int fio_getdelim(struct FioReader *r, int delim, const unsigned char **line, size_t *n) {
+    while (1) {
+        const unsigned char *start = r->buf + r->pos;
+        const unsigned char *nl = memchr(start + r->scanned, delim, r->len - r->pos - r->scanned);
+
+        if (nl) {
+            *line = start;
+            *n = nl - start + 1;
+            r->pos += *n;
+            r->scanned = 0;
+            return 1;
+        }
+        r->scanned = r->len - r->pos;
+        if (r->eof) {
+            if (r->scanned == 0) {
+                return 0;
+            }
+            *line = start;
+            *n = r->scanned;
+            r->pos = r->len;
+            r->scanned = 0;
+            return 1;
+        }
+        if (r->max_line && r->scanned >= r->max_line) {
+            errno = E2BIG;
+            return -1;
+        }
+        if (fio_fill(r) < 0) {
+            return -1;
+        }
+    }
+}
+
+static inline int fio_getline(struct FioReader *r, const unsigned char **line, size_t *n) {
+    return fio_getdelim(r, '\n', line, n);
+}
+
+/* Whatever input is available, up to the whole mapping. Returns 1, 0 or -1. */
+static inline int fio_block(struct FioReader *r, const unsigned char **p, size_t *n) {
+    if (r->pos == r->len) {
+        ssize_t got = fio_fill(r);
+
+        if (got <= 0) {
+            return got;
+        }
+    }
+    *p = r->buf + r->pos;
+    *n = r->len - r->pos;
+    r->pos = r->len;
+    r->scanned = 0;
+    return 1;
+}
+
+/* Give back the last n bytes returned by fio_block(). */
+static inline void fio_unread(struct FioReader *r, size_t n) {
+    r->pos -= n;
+}
+
+/* Exactly n bytes unless input ends first. Returns the count, or -1. */
+static inline ssize_t fio_read(struct FioReader *r, void *dst, size_t n) {
+    size_t done = 0;
+
+    while (done < n) {
+        size_t avail = r->len - r->pos;
+
+        if (avail == 0) {
+            ssize_t got = fio_fill(r);
+
+            if (got < 0) { return -1; }
+            if (got == 0) { break; }
+            continue;
+        }
+        if (avail > n - done) {
+            avail = n - done;
+        }
+        memcpy((unsigned char *)dst + done, r->buf + r->pos, avail);
+        r->pos += avail;
+        done += avail;
+    }
+    r->scanned = 0;
+    return done;
+}
+
+/*
+ * Release the buffer. On seekable input the offset is moved to just past
+ * what was consumed, so `{ head -n1; cat; } < file` works as expected;
+ * bytes read ahead from a pipe are lost.
+ */
+static inline void fio_close(struct FioReader *r) {
+    if (r->mapped) {
+        lseek(r->fd, r->pos, SEEK_SET);
+        munmap(r->buf, r->cap);
+    } else {
+        if (r->len > r->pos) {
+            lseek(r->fd, -(off_t)(r->len - r->pos), SEEK_CUR);
+        }
+        free(r->buf);
+    }
+    r->buf = NULL;
+}
+
+static inline int fio_writer_open(struct FioWriter *w, int fd) {
+    w->fd = fd;
+    w->len = 0;
+    w->cap = FIO_BUFFER_SIZE;
+    w->buf = fio_alloc(w->cap);
+    return w->buf ? 0 : -1;
+}
+
+static inline int fio_flush(struct FioWriter *w) {
+    int ret = fio_write_all(w->fd, w->buf, w->len);
+
+    w->len = 0;
+    return ret;
+}
+
+static inline int fio_write(struct FioWriter *w, const void *p, size_t n) {
+    if (n > w->cap - w->len && fio_flush(w) < 0) {
+        return -1;
+    }
+    if (n >= w->cap) {
+        return fio_write_all(w->fd, p, n);
+    }
+    memcpy(w->buf + w->len, p, n);
+    w->len += n;
+    return 0;
+}
+
+/*
+ * Room for at least n bytes to be filled in place; fio_commit() then
+ * adds what was actually used. Returns NULL on error.
+ */
+static inline unsigned char *fio_reserve(struct FioWriter *w, size_t n) {
+    if (n > w->cap - w->len && fio_flush(w) < 0) {
+        return NULL;
+    }
+    if (n > w->cap) {
+        unsigned char *bigger = fio_alloc(n);
+
+        if (!bigger) {
+            return NULL;
+        }
+        free(w->buf);
+        w->buf = bigger;
+        w->cap = n;
+    }
+    return w->buf + w->len;
+}
+
+static inline void fio_commit(struct FioWriter *w, size_t n) {
+    w->len += n;
+}
+
+static inline int fio_writer_close(struct FioWriter *w) {
+    int ret = fio_flush(w);
+
+    free(w->buf);
+    w->buf = NULL;
+    return ret;
+}
+
+#endif
@@ -1,17 +1,77 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <regex.h>
-
-#define _GNU_SOURCE
 #include <getopt.h>
 
-static void do_grep(regex_t *pat, FILE *f, int matched);
+#define READ_CHUNK (1024 * 1024)
+#define STDOUT_BUF_SIZE (64 * 1024)
+#define DIRENT_BUF_SIZE (64 * 1024)
+#define BINARY_SNIFF_SIZE 4096
+#define MAX_THREADS 256
+
+struct AhoCorasick;
+struct LazyDFA;
+
+struct Matcher {
+  struct AhoCorasick *ac; /* fixed-string set; re is unused when set */
+  struct LazyDFA *dfa;    /* used instead of re when the pattern allows */
+  regex_t re;
+  int matched;           /* regexec() result that selects a line */
+  const char *literal;   /* every match contains this, or NULL */
+  size_t literal_len;
+};
+
+/* where matching lines go: straight to stdout, or into a per-file buffer */
+struct Output {
+  const char *prefix;  /* prepended to every line, or NULL */
+  int collect;
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+static void compile_matcher(struct Matcher *m, const char *pattern, int flags, int matched);
+static void free_matcher(struct Matcher *m);
+static char *read_patterns(const char *path, char *patterns);
+static int is_literal_set(const char *patterns);
+static struct AhoCorasick *build_aho_corasick(const char *patterns, int ignore_case);
+static const char *scan_fixed(struct Matcher *m, const char *p, const char *end, int final, struct Output *out);
+static struct LazyDFA *dfa_compile(const char *pattern, int icase);
+static void dfa_free(struct LazyDFA *dfa);
+static int dfa_thrashing(struct LazyDFA *dfa);
+static int dfa_match_line(struct LazyDFA *dfa, const char *line, const char *eol);
+static const char *scan_dfa(struct Matcher *m, const char *p, const char *end, int final, struct Output *out);
+static void do_grep(struct Matcher *m, int fd, const char *path, struct Output *out);
+static const char *required_literal(const char *pattern, size_t *len);
+static void extract_literal(struct Matcher *m, const char *pattern, int ignore_case);
+static void grep_tree(const char *pattern, int flags, int matched, char **paths, int npaths, int nthreads);
+
+static int skip_binary = 0;
+static struct AhoCorasick *fixed_set = NULL;
+static int posix_only = 0;
+static const char *index_path = NULL;
 
 static struct option longopts[] = {
   {"ignore-case", no_argument, NULL, 'i'},
   {"invert-match", no_argument, NULL, 'v'},
+  {"recursive", no_argument, NULL, 'r'},
+  {"fixed-strings", no_argument, NULL, 'F'},
+  {"file", required_argument, NULL, 'f'},
+  {"engine", required_argument, NULL, 'E'},
+  {"threads", required_argument, NULL, 'j'},
+  {"index", required_argument, NULL, 'I'},
   {0, 0, 0, 0}
 };
 
@@ -19,8 +79,12 @@ int main(int argc, char *argv[]) {
   int opt;
   int ignore_case = 0;
   int matched = 0;
+  int recursive = 0;
+  int nthreads = 0;
+  int fixed = 0;
+  char *patterns = NULL;
 
-  while ((opt = getopt_long(argc, argv, "iv", longopts, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "ivrj:Ff:", longopts, NULL)) != -1) {
     switch (opt) {
       case 'i':
         ignore_case = REG_ICASE;
@@ -28,51 +92,2416 @@ int main(int argc, char *argv[]) {
       case 'v':
         matched = REG_NOMATCH;
         break;
+      case 'r':
+        recursive = 1;
+        break;
+      case 'j':
+        nthreads = atoi(optarg);
+        break;
+      case 'F':
+        fixed = 1;
+        break;
+      case 'f':
+        patterns = read_patterns(optarg, patterns);
+        break;
+      case 'I':
+        index_path = optarg;
+        recursive = 1;
+        break;
+      case 'E':
+        if (strcmp(optarg, "posix") == 0) {
+          posix_only = 1;
+        } else if (strcmp(optarg, "dfa") != 0) {
+          fprintf(stderr, "unknown engine: %s\n", optarg);
+          exit(1);
+        }
+        break;
     }
   }
 
-  regex_t pat;
-  int err;
+  struct Matcher m;
+  struct Output out = {NULL, 0, NULL, 0, 0};
   int i;
 
-  if (argc < 2) {
-    fputs("no pattern\n", stderr);
-    exit(1);
+  if (!patterns) {
+    if (optind >= argc) {
+      fputs("no pattern\n", stderr);
+      exit(1);
+    }
+    patterns = argv[optind++];
   }
+  /* patterns is now a newline-separated list; optind is the first file */
   int regex_flg = REG_EXTENDED | REG_NOSUB | REG_NEWLINE | ignore_case;
-  err = regcomp(&pat, argv[optind], regex_flg);
-  if (err != 0) {
-    char buf[1024];
+  if (fixed || (strchr(patterns, '\n') && is_literal_set(patterns))) {
+    fixed_set = build_aho_corasick(patterns, ignore_case);
+  } else if (strchr(patterns, '\n')) {
+    /* a regex per line: join them into one alternation */
+    char *alt = malloc(strlen(patterns) * 3 + 3), *q = alt;
+    const char *p;
 
-    regerror(err, &pat, buf, sizeof buf);
-    puts(buf);
-    exit(1);
+    if (!alt) {
+      perror("malloc(3)");
+      exit(1);
+    }
+    *q++ = '(';
+    for (p = patterns; *p; p++) {
+      if (*p == '\n') {
+        if (!p[1]) { break; }
+        memcpy(q, ")|(", 3);
+        q += 3;
+      } else {
+        *q++ = *p;
+      }
+    }
+    *q++ = ')';
+    *q = '\0';
+    patterns = alt;
   }
+  setvbuf(stdout, NULL, _IOFBF, STDOUT_BUF_SIZE);
+  if (recursive) {
+    grep_tree(patterns, regex_flg, matched, argv + optind, argc - optind, nthreads);
+    exit(0);
+  }
+  compile_matcher(&m, patterns, regex_flg, matched);
   if (optind == argc) {
-    do_grep(&pat, stdin, matched);
+    do_grep(&m, STDIN_FILENO, "stdin", &out);
   } else {
-    for (i = optind + 1; i < argc; i++) {
-      FILE *f;
+    for (i = optind; i < argc; i++) {
+      int fd;
 
-      f = fopen(argv[i], "r");
-      if (!f) {
+      fd = open(argv[i], O_RDONLY);
+      if (fd < 0) {
         perror(argv[i]);
         exit(1);
       }
-      do_grep(&pat, f, matched);
-      fclose(f);
+      do_grep(&m, fd, argv[i], &out);
+      close(fd);
     }
   }
-  regfree(&pat);
+  free_matcher(&m);
   exit(0);
 }
 
-static void do_grep(regex_t *pat, FILE *src, int matched) {
-  char buf[4096];
+static void compile_matcher(struct Matcher *m, const char *pattern, int flags, int matched) {
+  int err;
+
+  m->matched = matched;
+  m->ac = fixed_set;
+  m->dfa = NULL;
+  if (m->ac) {
+    m->literal = NULL;
+    return;
+  }
+  err = regcomp(&m->re, pattern, flags);
+  if (err != 0) {
+    char buf[1024];
+
+    regerror(err, &m->re, buf, sizeof buf);
+    puts(buf);
+    exit(1);
+  }
+  extract_literal(m, pattern, flags & REG_ICASE);
+  if (!posix_only) {
+    m->dfa = dfa_compile(pattern, flags & REG_ICASE);
+  }
+}
+
+static void free_matcher(struct Matcher *m) {
+  if (m->dfa) {
+    dfa_free(m->dfa);
+  }
+  if (!m->ac) {
+    regfree(&m->re);
+  }
+}
+
+/* append the lines of path (or stdin for "-") to the newline-separated list */
+static char *read_patterns(const char *path, char *patterns) {
+  size_t len = patterns ? strlen(patterns) : 0, cap = len + 4096;
+  char *buf = malloc(cap);
+  FILE *f;
+  int c;
+
+  if (!buf) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  if (patterns) {
+    memcpy(buf, patterns, len);
+    free(patterns);
+  }
+  f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+  if (!f) {
+    perror(path);
+    exit(1);
+  }
+  while ((c = getc(f)) != EOF) {
+    if (len + 2 >= cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+      if (!buf) {
+        perror("realloc(3)");
+        exit(1);
+      }
+    }
+    buf[len++] = c;
+  }
+  if (f != stdin) {
+    fclose(f);
+  }
+  if (len > 0 && buf[len - 1] != '\n') {
+    buf[len++] = '\n';
+  }
+  buf[len] = '\0';
+  return buf;
+}
+
+static int is_literal_set(const char *patterns) {
+  return strpbrk(patterns, "\\.[]()*+?{}|^$") == NULL;
+}
+
+/*
+ * Find the longest run of ordinary characters that every match of the
+ * ERE must contain. This is deliberately conservative: alternation
+ * anywhere disables it, groups and bracket expressions end the current
+ * run, and a character followed by ?, * or { is dropped from the run.
+ * Nothing inside a group is ever taken, since the group as a whole may
+ * be optional, as in (foo)?bar or (ab)*c.
+ */
+static const char *required_literal(const char *pattern, size_t *len) {
+  static char best[1024], run[1024];
+  size_t best_len = 0, run_len = 0;
+  int depth = 0;
+  const char *p;
+
+  *len = 0;
+  if (strchr(pattern, '|')) {
+    return NULL;
+  }
+  for (p = pattern; *p; p++) {
+    char c = *p;
+
+    if (c == '\\' && p[1] && !isalnum((unsigned char)p[1])) {
+      c = *++p;
+    } else if (c == '\\' || c == '.' || c == '^' || c == '$') {
+      if (c == '\\' && p[1]) {
+        p++;
+      }
+      run_len = 0;
+      continue;
+    } else if (c == '[') {
+      /* skip the bracket expression; ] right after [ or [^ is literal */
+      p++;
+      if (*p == '^') { p++; }
+      if (*p == ']') { p++; }
+      while (*p && *p != ']') {
+        if (*p == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.')) {
+          char close = p[1];
+
+          for (p += 2; *p && !(*p == close && p[1] == ']'); p++)
+            ;
+          if (*p) { p++; }
+        }
+        if (*p) { p++; }
+      }
+      if (!*p) { break; }
+      run_len = 0;
+      continue;
+    } else if (c == '(' || c == ')') {
+      depth += c == '(' ? 1 : depth > 0 ? -1 : 0;
+      run_len = 0;
+      continue;
+    } else if (c == '?' || c == '*' || c == '{') {
+      if (run_len > 0) {
+        run_len--;
+      }
+      if (run_len > best_len) {
+        memcpy(best, run, run_len);
+        best_len = run_len;
+      }
+      if (c == '{') {
+        while (*p && *p != '}') { p++; }
+        if (!*p) { break; }
+      }
+      run_len = 0;
+      continue;
+    } else if (c == '+') {
+      if (run_len > best_len) {
+        memcpy(best, run, run_len);
+        best_len = run_len;
+      }
+      run_len = 0;
+      continue;
+    }
+    if (depth > 0) {
+      run_len = 0;
+      continue;
+    }
+    if (run_len < sizeof run) {
+      run[run_len++] = c;
+    }
+    /* a following quantifier may still take this character away */
+    if (p[1] != '?' && p[1] != '*' && p[1] != '{' && run_len > best_len) {
+      memcpy(best, run, run_len);
+      best_len = run_len;
+    }
+  }
+  *len = best_len;
+  return best_len ? best : NULL;
+}
+
+static void extract_literal(struct Matcher *m, const char *pattern, int ignore_case) {
+  const char *literal;
+  size_t len, i;
+
+  m->literal = NULL;
+  m->literal_len = 0;
+  literal = required_literal(pattern, &len);
+  if (!literal) {
+    return;
+  }
+  if (ignore_case) {
+    for (i = 0; i < len; i++) {
+      if (isalpha((unsigned char)literal[i])) {
+        return;
+      }
+    }
+  }
+  m->literal = literal;
+  m->literal_len = len;
+}
+
+static void out_write(struct Output *out, const char *p, size_t n) {
+  if (!out->collect) {
+    fwrite(p, 1, n, stdout);
+    return;
+  }
+  if (out->len + n > out->cap) {
+    while (out->len + n > out->cap) {
+      out->cap = out->cap ? out->cap * 2 : 4096;
+    }
+    out->buf = realloc(out->buf, out->cap);
+    if (!out->buf) {
+      perror("realloc(3)");
+      exit(1);
+    }
+  }
+  memcpy(out->buf + out->len, p, n);
+  out->len += n;
+}
+
+static void put_lines(struct Output *out, const char *p, const char *end) {
+  if (!out->prefix) {
+    out_write(out, p, end - p);
+    if (end > p && end[-1] != '\n') {
+      out_write(out, "\n", 1);
+    }
+    return;
+  }
+  while (p < end) {
+    const char *eol = memchr(p, '\n', end - p);
+    const char *next = eol ? eol + 1 : end;
+
+    out_write(out, out->prefix, strlen(out->prefix));
+    out_write(out, p, next - p);
+    if (!eol) {
+      out_write(out, "\n", 1);
+    }
+    p = next;
+  }
+}
+
+static int line_matches(struct Matcher *m, const char *line, const char *eol) {
+  regmatch_t range;
+
+  if (m->dfa) {
+    int r = dfa_match_line(m->dfa, line, eol);
+
+    if (r >= 0) {
+      return r;
+    }
+    dfa_free(m->dfa);
+    m->dfa = NULL;
+  }
+  range.rm_so = 0;
+  range.rm_eo = eol - line;
+  return regexec(&m->re, line, 1, &range, REG_STARTEND) == 0;
+}
+
+/*
+ * Process every complete line in [p, end); a trailing line without a
+ * newline is processed only when final is set. Returns the first byte
+ * that was not consumed.
+ *
+ * With a required literal, memmem() jumps straight to the next line that
+ * can match; everything before that line is known not to match and is
+ * either skipped or, under -v, written out in one go.
+ */
+static const char *scan(struct Matcher *m, const char *p, const char *end, int final, struct Output *out) {
+  int invert = m->matched == REG_NOMATCH;
+
+  if (m->ac) {
+    return scan_fixed(m, p, end, final, out);
+  }
+  if (m->dfa && !m->literal) {
+    const char *rest = scan_dfa(m, p, end, final, out);
+
+    if (!dfa_thrashing(m->dfa)) {
+      return rest;
+    }
+    /* carry on from the first unfinished line with regexec() */
+    dfa_free(m->dfa);
+    m->dfa = NULL;
+    p = rest;
+  }
+  while (p < end) {
+    const char *line = p, *eol, *next;
+
+    if (m->literal) {
+      const char *hit = memmem(p, end - p, m->literal, m->literal_len);
+
+      if (!hit) {
+        const char *last = memrchr(p, '\n', end - p);
+        const char *stop = final ? end : (last ? last + 1 : p);
+
+        if (invert) {
+          put_lines(out, p, stop);
+        }
+        return stop;
+      }
+      line = memrchr(p, '\n', hit - p);
+      line = line ? line + 1 : p;
+      if (invert && line > p) {
+        put_lines(out, p, line);
+      }
+    }
+    eol = memchr(line, '\n', end - line);
+    if (!eol) {
+      if (!final) {
+        return line;
+      }
+      eol = end;
+      next = end;
+    } else {
+      next = eol + 1;
+    }
+    if (line_matches(m, line, eol) != invert) {
+      put_lines(out, line, next);
+    }
+    p = next;
+  }
+  return p;
+}
+
+/*
+ * Aho-Corasick automaton for fixed-string sets, stored as a full DFA.
+ *
+ * Bytes are first mapped to equivalence classes (every byte that occurs in
+ * no pattern shares class 0; under -i upper and lower case share a class),
+ * so a state is a row of nclasses 32-bit entries instead of 256 and the
+ * table stays small enough to live in cache. The top bit of an entry marks
+ * a target state that ends some pattern, so the scan loop is one load and
+ * one test per byte. No pattern contains a newline, so every newline leads
+ * back to the root and matches never cross lines.
+ */
+#define AC_MATCH 0x80000000u
+
+struct AhoCorasick {
+  uint8_t classes[256];
+  int nclasses;
+  uint32_t *delta;
+  int match_all; /* an empty pattern matches every line */
+};
+
+static struct AhoCorasick *build_aho_corasick(const char *patterns, int ignore_case) {
+  struct AhoCorasick *ac;
+  uint32_t nstates = 1, cap = 1024, head = 0, tail = 0;
+  uint32_t *fail, *queue;
+  uint8_t *final;
+  const char *p;
+  int c, nc;
+
+  ac = calloc(1, sizeof(struct AhoCorasick));
+  if (!ac) {
+    perror("calloc(3)");
+    exit(1);
+  }
+  nc = 1;
+  for (p = patterns; *p; p++) {
+    c = ignore_case ? tolower((unsigned char)*p) : (unsigned char)*p;
+    if (c != '\n' && !ac->classes[c]) {
+      ac->classes[c] = nc++;
+    }
+  }
+  if (ignore_case) {
+    for (c = 0; c < 256; c++) {
+      ac->classes[c] = ac->classes[tolower(c)];
+    }
+  }
+  ac->nclasses = nc;
+
+  /* trie; 0 means "no edge" since nothing points back at the root yet */
+  ac->delta = calloc(cap * nc, sizeof(uint32_t));
+  final = calloc(cap, 1);
+  if (!ac->delta || !final) {
+    perror("calloc(3)");
+    exit(1);
+  }
+  for (p = patterns; *p; ) {
+    uint32_t s = 0;
+
+    if (*p == '\n') {
+      ac->match_all = 1;
+      p++;
+      continue;
+    }
+    for (; *p && *p != '\n'; p++) {
+      uint32_t *slot = &ac->delta[s * nc + ac->classes[(unsigned char)*p]];
+
+      if (!*slot) {
+        if (nstates == cap) {
+          cap *= 2;
+          ac->delta = realloc(ac->delta, sizeof(uint32_t) * cap * nc);
+          final = realloc(final, cap);
+          if (!ac->delta || !final) {
+            perror("realloc(3)");
+            exit(1);
+          }
+          memset(ac->delta + nstates * nc, 0, sizeof(uint32_t) * (cap - nstates) * nc);
+          memset(final + nstates, 0, cap - nstates);
+          slot = &ac->delta[s * nc + ac->classes[(unsigned char)*p]];
+        }
+        *slot = nstates++;
+      }
+      s = *slot;
+    }
+    final[s] = 1;
+    if (*p) {
+      p++;
+    }
+  }
+
+  /* breadth-first: fill missing edges from the failure state's row */
+  fail = calloc(nstates, sizeof(uint32_t));
+  queue = malloc(sizeof(uint32_t) * nstates);
+  if (!fail || !queue) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  for (c = 0; c < nc; c++) {
+    uint32_t t = ac->delta[c];
+
+    if (t) {
+      queue[tail++] = t;
+    }
+  }
+  while (head < tail) {
+    uint32_t s = queue[head++];
+
+    final[s] |= final[fail[s]];
+    for (c = 0; c < nc; c++) {
+      uint32_t *slot = &ac->delta[s * nc + c];
+      uint32_t f = ac->delta[fail[s] * nc + c] & ~AC_MATCH;
+
+      if (*slot) {
+        fail[*slot] = f;
+        queue[tail++] = *slot;
+      } else {
+        *slot = f;
+      }
+    }
+  }
+  for (head = 0; head < nstates * nc; head++) {
+    if (final[ac->delta[head]]) {
+      ac->delta[head] |= AC_MATCH;
+    }
+  }
+  free(fail);
+  free(queue);
+  free(final);
+  return ac;
+}
+
+static const char *scan_fixed(struct Matcher *m, const char *p, const char *end, int final, struct Output *out) {
+  const struct AhoCorasick *ac = m->ac;
+  const uint32_t *delta = ac->delta;
+  const uint8_t *classes = ac->classes;
+  int nc = ac->nclasses;
+  int invert = m->matched == REG_NOMATCH;
+  const char *clean = p; /* start of lines known not to match */
+  const char *q;
+  uint32_t s = 0;
+
+  if (ac->match_all) {
+    const char *last = memrchr(p, '\n', end - p);
+    const char *stop = final ? end : (last ? last + 1 : p);
+
+    if (!invert) {
+      put_lines(out, p, stop);
+    }
+    return stop;
+  }
+  for (q = p; q < end; q++) {
+    s = delta[(s & ~AC_MATCH) * nc + classes[(unsigned char)*q]];
+    if (s & AC_MATCH) {
+      const char *line = memrchr(clean, '\n', q - clean);
+      const char *eol = memchr(q, '\n', end - q);
+      const char *next;
+
+      line = line ? line + 1 : clean;
+      if (!eol && !final) {
+        if (invert) {
+          put_lines(out, clean, line);
+        }
+        return line;
+      }
+      next = eol ? eol + 1 : end;
+      if (invert) {
+        put_lines(out, clean, line);
+      } else {
+        put_lines(out, line, next);
+      }
+      clean = next;
+      q = next - 1;
+      s = 0;
+    }
+  }
+  if (!final) {
+    const char *last = memrchr(clean, '\n', end - clean);
+
+    end = last ? last + 1 : clean;
+  }
+  if (invert) {
+    put_lines(out, clean, end);
+  }
+  return end;
+}
+
+/*
+ * Lazy DFA for the common ERE subset: literals, ., bracket expressions,
+ * grouping, |, *, +, ?, {m,n}, ^ and $. The pattern is parsed to a tree,
+ * compiled to a Thompson NFA, and DFA states (sets of NFA states) are
+ * built on demand as the input needs them. The cache holds at most
+ * DFA_CACHE_STATES states; when it fills up it is simply thrown away and
+ * rebuilt from the state being left, so memory stays bounded and the scan
+ * stays linear. If the cache is flushed again and again after only a few
+ * bytes the pattern needs more states than fit, and the matcher gives up
+ * and switches to regexec() for the rest of the run. Anything outside
+ * the subset (GNU escapes such as \w or \<, [=a=] and [.a.], unusual
+ * intervals) makes dfa_compile() return NULL and the caller falls back
+ * to regexec().
+ *
+ * Every state implicitly includes the pattern start (unanchored search),
+ * and the scan restarts from the line-start state after each newline, so
+ * a whole buffer is classified line by line in a single pass.
+ */
+#define DFA_MAX_NFA_STATES 8192
+#define DFA_CACHE_STATES 1024
+#define DFA_MAX_REPEAT 255
+#define DFA_MIN_BYTES_PER_FLUSH (1024 * 1024)
+#define DFA_MAX_THRASHING 3
+#define DFA_UNKNOWN -1
+#define DFA_NEWLINE -2
+#define DFA_ACCEPT -3 /* the edge enters an accepting state */
+#define DFA_MAX_SKIP_BYTES 4
+
+enum { NFA_SET, NFA_SPLIT, NFA_BOL, NFA_EOL, NFA_MATCH };
+
+struct NFAState {
+  int type;
+  int out;
+  int out1;
+  int set;
+};
+
+struct DFAState {
+  int next[256];
+  int accept;     /* a match ends here; the line matches */
+  int accept_eol; /* the line matches if it ends here */
+  int *nfa;       /* sorted NFA states (SET, EOL and MATCH only) */
+  int n;
+};
+
+struct LazyDFA {
+  struct NFAState *nfa;
+  int nnfa;
+  uint8_t (*sets)[32];
+  int nsets;
+  int start;
+  struct DFAState *states;
+  int nstates;
+  int *table; /* open addressing: DFA state index + 1, 0 for empty */
+  int bol;    /* line-start state, or -1 after a flush */
+  int empty_ok; /* an empty line matches; set along with bol */
+  int idle;   /* state between matches; same as bol when ^ is unused */
+  int nskip;  /* bytes that leave idle, when few enough to memchr() for */
+  unsigned char skip[DFA_MAX_SKIP_BYTES];
+  int flushes;
+  int thrashing; /* flushes that came too soon after the previous one */
+  size_t scanned;
+  size_t scanned_at_flush;
+  int *mid;   /* closure of the start in the middle of a line */
+  int nmid;
+  int *mark;  /* scratch for closure() */
+  int gen;
+  int *stack;
+  int *work;
+};
+
+enum { N_SET, N_CAT, N_ALT, N_REPEAT, N_BOL, N_EOL, N_EMPTY };
+
+struct Node {
+  int type;
+  int set;
+  int min, max; /* N_REPEAT; max < 0 means unbounded */
+  struct Node *a, *b;
+};
+
+struct Parser {
+  const char *p;
+  int icase;
+  int failed;
+  struct LazyDFA *dfa;
+  struct Node *nodes;
+  int nnodes, cap;
+};
+
+static struct Node *parse_alt(struct Parser *ps);
+
+static struct Node *new_node(struct Parser *ps, int type, struct Node *a, struct Node *b) {
+  struct Node *n;
+
+  if (ps->nnodes == ps->cap) {
+    ps->failed = 1;
+    return NULL;
+  }
+  n = &ps->nodes[ps->nnodes++];
+  n->type = type;
+  n->a = a;
+  n->b = b;
+  n->set = -1;
+  n->min = n->max = 0;
+  return n;
+}
+
+static int new_set(struct Parser *ps) {
+  struct LazyDFA *dfa = ps->dfa;
+
+  dfa->sets = realloc(dfa->sets, sizeof(dfa->sets[0]) * (dfa->nsets + 1));
+  if (!dfa->sets) {
+    perror("realloc(3)");
+    exit(1);
+  }
+  memset(dfa->sets[dfa->nsets], 0, sizeof(dfa->sets[0]));
+  return dfa->nsets++;
+}
+
+static void set_add(struct Parser *ps, int set, int c) {
+  uint8_t *bits = ps->dfa->sets[set];
+
+  bits[c >> 3] |= 1 << (c & 7);
+  if (ps->icase) {
+    bits[tolower(c) >> 3] |= 1 << (tolower(c) & 7);
+    bits[toupper(c) >> 3] |= 1 << (toupper(c) & 7);
+  }
+}
+
+static int char_class(const char *name, size_t len, int c) {
+  static const struct { const char *name; int (*fn)(int); } classes[] = {
+    {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+    {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+    {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+  };
+  size_t i;
+
+  for (i = 0; i < sizeof classes / sizeof classes[0]; i++) {
+    if (strlen(classes[i].name) == len && strncmp(classes[i].name, name, len) == 0) {
+      return c < 0 ? 1 : classes[i].fn(c) != 0;
+    }
+  }
+  return -1;
+}
+
+static struct Node *parse_bracket(struct Parser *ps) {
+  struct Node *n = new_node(ps, N_SET, NULL, NULL);
+  uint8_t bits[32];
+  int negate = 0, first = 1, c;
+
+  if (!n) {
+    return NULL;
+  }
+  n->set = new_set(ps);
+  memset(bits, 0, sizeof bits);
+  if (*ps->p == '^') {
+    negate = 1;
+    ps->p++;
+  }
+  while (*ps->p && (first || *ps->p != ']')) {
+    int lo = (unsigned char)*ps->p++, hi;
+
+    first = 0;
+    if (lo == '[' && *ps->p == ':') {
+      const char *name = ps->p + 1, *close = strstr(name, ":]");
+
+      if (!close || char_class(name, close - name, -1) < 0) {
+        ps->failed = 1;
+        return NULL;
+      }
+      for (c = 0; c < 256; c++) {
+        if (char_class(name, close - name, c)) {
+          bits[c >> 3] |= 1 << (c & 7);
+        }
+      }
+      ps->p = close + 2;
+      continue;
+    }
+    if (lo == '[' && (*ps->p == '=' || *ps->p == '.')) {
+      ps->failed = 1;
+      return NULL;
+    }
+    hi = lo;
+    if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+      hi = (unsigned char)ps->p[1];
+      ps->p += 2;
+      if (hi == '[' || hi < lo) {
+        ps->failed = 1;
+        return NULL;
+      }
+    }
+    for (c = lo; c <= hi; c++) {
+      bits[c >> 3] |= 1 << (c & 7);
+    }
+  }
+  if (*ps->p != ']') {
+    ps->failed = 1;
+    return NULL;
+  }
+  ps->p++;
+  for (c = 0; c < 256; c++) {
+    int in = (bits[c >> 3] >> (c & 7)) & 1;
+
+    if (ps->icase) {
+      in |= (bits[tolower(c) >> 3] >> (tolower(c) & 7)) & 1;
+      in |= (bits[toupper(c) >> 3] >> (toupper(c) & 7)) & 1;
+    }
+    if (in != negate && c != '\n') {
+      ps->dfa->sets[n->set][c >> 3] |= 1 << (c & 7);
+    }
+  }
+  return n;
+}
+
+static struct Node *parse_atom(struct Parser *ps) {
+  struct Node *n;
+  int c = (unsigned char)*ps->p;
+
+  switch (c) {
+    case '(':
+      ps->p++;
+      if (*ps->p == ')') {
+        ps->p++;
+        return new_node(ps, N_EMPTY, NULL, NULL);
+      }
+      n = parse_alt(ps);
+      if (*ps->p != ')') {
+        ps->failed = 1;
+        return NULL;
+      }
+      ps->p++;
+      return n;
+    case '[':
+      ps->p++;
+      return parse_bracket(ps);
+    case '^':
+      ps->p++;
+      return new_node(ps, N_BOL, NULL, NULL);
+    case '$':
+      ps->p++;
+      return new_node(ps, N_EOL, NULL, NULL);
+    case '*': case '+': case '?': case '{': case ')': case '\0':
+      ps->failed = 1;
+      return NULL;
+  }
+  n = new_node(ps, N_SET, NULL, NULL);
+  if (!n) {
+    return NULL;
+  }
+  n->set = new_set(ps);
+  if (c == '.') {
+    for (c = 0; c < 256; c++) {
+      if (c != '\n') {
+        set_add(ps, n->set, c);
+      }
+    }
+    ps->p++;
+    return n;
+  }
+  if (c == '\\') {
+    c = (unsigned char)*++ps->p;
+    if (!c || isalnum(c)) {
+      ps->failed = 1;
+      return NULL;
+    }
+  }
+  set_add(ps, n->set, c);
+  ps->p++;
+  return n;
+}
+
+static struct Node *parse_repeat(struct Parser *ps) {
+  struct Node *n = parse_atom(ps);
 
-  while (fgets(buf, sizeof buf, src)) {
-    if (regexec(pat, buf, 0, NULL, 0) == matched) {
-      fputs(buf, stdout);
+  while (!ps->failed && (*ps->p == '*' || *ps->p == '+' || *ps->p == '?' || *ps->p == '{')) {
+    struct Node *r = new_node(ps, N_REPEAT, n, NULL);
+    char c = *ps->p++;
+
+    if (!r) {
+      return NULL;
+    }
+    if (c == '*') {
+      r->min = 0; r->max = -1;
+    } else if (c == '+') {
+      r->min = 1; r->max = -1;
+    } else if (c == '?') {
+      r->min = 0; r->max = 1;
+    } else {
+      char *q;
+
+      if (!isdigit((unsigned char)*ps->p)) {
+        ps->failed = 1;
+        return NULL;
+      }
+      r->min = strtol(ps->p, &q, 10);
+      r->max = r->min;
+      if (*q == ',') {
+        q++;
+        r->max = isdigit((unsigned char)*q) ? strtol(q, &q, 10) : -1;
+      }
+      if (*q != '}' || r->min > DFA_MAX_REPEAT || r->max > DFA_MAX_REPEAT
+          || (r->max >= 0 && r->max < r->min)) {
+        ps->failed = 1;
+        return NULL;
+      }
+      ps->p = q + 1;
     }
+    n = r;
+  }
+  return n;
+}
+
+static struct Node *parse_cat(struct Parser *ps) {
+  struct Node *n = NULL;
+
+  while (!ps->failed && *ps->p && *ps->p != '|' && *ps->p != ')') {
+    struct Node *r = parse_repeat(ps);
+
+    n = n ? new_node(ps, N_CAT, n, r) : r;
+  }
+  return n ? n : new_node(ps, N_EMPTY, NULL, NULL);
+}
+
+static struct Node *parse_alt(struct Parser *ps) {
+  struct Node *n = parse_cat(ps);
+
+  while (!ps->failed && *ps->p == '|') {
+    ps->p++;
+    n = new_node(ps, N_ALT, n, parse_cat(ps));
+  }
+  return n;
+}
+
+static int nfa_state(struct LazyDFA *dfa, int type, int out, int out1, int set) {
+  struct NFAState *s;
+
+  if (dfa->nnfa == DFA_MAX_NFA_STATES) {
+    return -1;
+  }
+  s = &dfa->nfa[dfa->nnfa];
+  s->type = type;
+  s->out = out;
+  s->out1 = out1;
+  s->set = set;
+  return dfa->nnfa++;
+}
+
+/* Thompson construction, back to front: returns the entry state for n */
+static int compile_node(struct LazyDFA *dfa, struct Node *n, int next) {
+  int i, s, t;
+
+  if (next < 0) {
+    return -1;
+  }
+  switch (n->type) {
+    case N_SET:
+      return nfa_state(dfa, NFA_SET, next, -1, n->set);
+    case N_BOL:
+      return nfa_state(dfa, NFA_BOL, next, -1, -1);
+    case N_EOL:
+      return nfa_state(dfa, NFA_EOL, next, -1, -1);
+    case N_EMPTY:
+      return next;
+    case N_CAT:
+      return compile_node(dfa, n->a, compile_node(dfa, n->b, next));
+    case N_ALT:
+      s = compile_node(dfa, n->a, next);
+      t = compile_node(dfa, n->b, next);
+      return s < 0 || t < 0 ? -1 : nfa_state(dfa, NFA_SPLIT, s, t, -1);
+  }
+  /* N_REPEAT: min mandatory copies, then optional copies or a loop */
+  t = next;
+  if (n->max < 0) {
+    s = nfa_state(dfa, NFA_SPLIT, -1, next, -1);
+    if (s < 0 || (dfa->nfa[s].out = compile_node(dfa, n->a, s)) < 0) {
+      return -1;
+    }
+    t = s;
+  } else {
+    for (i = n->min; i < n->max; i++) {
+      s = compile_node(dfa, n->a, t);
+      t = s < 0 ? -1 : nfa_state(dfa, NFA_SPLIT, s, next, -1);
+      if (t < 0) {
+        return -1;
+      }
+    }
+  }
+  for (i = 0; i < n->min; i++) {
+    t = compile_node(dfa, n->a, t);
+  }
+  return t;
+}
+
+static int compare_int(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * Follow epsilon edges from seeds[0..n). ^ can be crossed only at the
+ * start of a line and $ only at its end. The result (into out) is
+ * sorted and holds only the states that matter for later steps.
+ */
+static int closure(struct LazyDFA *dfa, const int *seeds, int n, int at_bol, int at_eol, int *out) {
+  int sp = 0, nout = 0, i;
+
+  dfa->gen++;
+  for (i = 0; i < n; i++) {
+    dfa->stack[sp++] = seeds[i];
+  }
+  while (sp > 0) {
+    int s = dfa->stack[--sp];
+    struct NFAState *st;
+
+    if (dfa->mark[s] == dfa->gen) {
+      continue;
+    }
+    dfa->mark[s] = dfa->gen;
+    st = &dfa->nfa[s];
+    switch (st->type) {
+      case NFA_SPLIT:
+        dfa->stack[sp++] = st->out1;
+        dfa->stack[sp++] = st->out;
+        break;
+      case NFA_BOL:
+        if (at_bol) {
+          dfa->stack[sp++] = st->out;
+        }
+        break;
+      case NFA_EOL:
+        out[nout++] = s;
+        if (at_eol) {
+          dfa->stack[sp++] = st->out;
+        }
+        break;
+      default:
+        out[nout++] = s;
+    }
+  }
+  qsort(out, nout, sizeof(int), compare_int);
+  return nout;
+}
+
+static int contains_match(struct LazyDFA *dfa, const int *list, int n) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (dfa->nfa[list[i]].type == NFA_MATCH) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void dfa_flush(struct LazyDFA *dfa) {
+  int i;
+
+  for (i = 0; i < dfa->nstates; i++) {
+    free(dfa->states[i].nfa);
+  }
+  dfa->nstates = 0;
+  dfa->bol = -1;
+  dfa->idle = -1;
+  dfa->flushes++;
+  if (dfa->scanned - dfa->scanned_at_flush < DFA_MIN_BYTES_PER_FLUSH) {
+    dfa->thrashing++;
+  }
+  dfa->scanned_at_flush = dfa->scanned;
+  memset(dfa->table, 0, sizeof(int) * DFA_CACHE_STATES * 2);
+}
+
+static unsigned hash_list(const int *list, int n) {
+  unsigned h = 2166136261u;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    h = (h ^ (unsigned)list[i]) * 16777619u;
+  }
+  return h;
+}
+
+/*
+ * Find or add the state for list; flushes the cache when it is full.
+ * accept_eol assumes the line is not empty: the same list is reached
+ * at line start and after other bytes (as in $^), so a ^ behind a $
+ * is left to dfa->empty_ok.
+ */
+static int dfa_intern(struct LazyDFA *dfa, const int *list, int n) {
+  unsigned h = hash_list(list, n), mask = DFA_CACHE_STATES * 2 - 1, i;
+  struct DFAState *st;
+  int *eol;
+  int neol;
+
+  for (i = h & mask; dfa->table[i]; i = (i + 1) & mask) {
+    st = &dfa->states[dfa->table[i] - 1];
+    if (st->n == n && memcmp(st->nfa, list, sizeof(int) * n) == 0) {
+      return dfa->table[i] - 1;
+    }
+  }
+  if (dfa->nstates == DFA_CACHE_STATES) {
+    dfa_flush(dfa);
+    for (i = h & mask; dfa->table[i]; i = (i + 1) & mask)
+      ;
+  }
+  st = &dfa->states[dfa->nstates];
+  st->n = n;
+  st->nfa = malloc(sizeof(int) * (n + 1));
+  if (!st->nfa) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  memcpy(st->nfa, list, sizeof(int) * n);
+  memset(st->next, 0xff, sizeof st->next); /* DFA_UNKNOWN */
+  st->next['\n'] = DFA_NEWLINE;
+  st->accept = contains_match(dfa, list, n);
+  eol = malloc(sizeof(int) * dfa->nnfa);
+  if (!eol) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  neol = closure(dfa, list, n, 0, 1, eol);
+  st->accept_eol = contains_match(dfa, eol, neol);
+  free(eol);
+  dfa->table[i] = dfa->nstates + 1;
+  return dfa->nstates++;
+}
+
+static int dfa_bol(struct LazyDFA *dfa) {
+  if (dfa->bol < 0) {
+    int n = closure(dfa, &dfa->start, 1, 1, 0, dfa->work);
+    int *eol = dfa->work + dfa->nnfa;
+
+    dfa->bol = dfa_intern(dfa, dfa->work, n);
+    /* at the end of an empty line, ^ and $ both hold */
+    n = closure(dfa, dfa->states[dfa->bol].nfa, dfa->states[dfa->bol].n, 1, 1, eol);
+    dfa->empty_ok = contains_match(dfa, eol, n);
+  }
+  return dfa->bol;
+}
+
+/* the slow path: the successor of s on byte c, or DFA_ACCEPT */
+static int dfa_step(struct LazyDFA *dfa, int s, unsigned char c) {
+  struct DFAState *st = &dfa->states[s];
+  int *seeds = dfa->work + dfa->nnfa;
+  int nseeds = 0, n, i, t, flushes;
+
+  for (i = 0; i < st->n; i++) {
+    struct NFAState *ns = &dfa->nfa[st->nfa[i]];
+
+    if (ns->type == NFA_SET && (dfa->sets[ns->set][c >> 3] >> (c & 7)) & 1) {
+      seeds[nseeds++] = ns->out;
+    }
+  }
+  for (i = 0; i < dfa->nmid; i++) {
+    seeds[nseeds++] = dfa->mid[i];
+  }
+  n = closure(dfa, seeds, nseeds, 0, 0, dfa->work);
+  flushes = dfa->flushes;
+  t = dfa_intern(dfa, dfa->work, n);
+  if (dfa->states[t].accept) {
+    t = DFA_ACCEPT;
+  }
+  if (dfa->flushes == flushes) {
+    st->next[c] = t;
+  }
+  return t;
+}
+
+static struct LazyDFA *dfa_compile(const char *pattern, int icase) {
+  struct LazyDFA *dfa;
+  struct Parser ps;
+  struct Node *root;
+  int match;
+
+  dfa = calloc(1, sizeof(struct LazyDFA));
+  if (!dfa) {
+    perror("calloc(3)");
+    exit(1);
+  }
+  ps.p = pattern;
+  ps.icase = icase;
+  ps.failed = 0;
+  ps.dfa = dfa;
+  ps.cap = strlen(pattern) * 2 + 2;
+  ps.nnodes = 0;
+  ps.nodes = malloc(sizeof(struct Node) * ps.cap);
+  dfa->nfa = malloc(sizeof(struct NFAState) * DFA_MAX_NFA_STATES);
+  if (!ps.nodes || !dfa->nfa) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  root = parse_alt(&ps);
+  if (!ps.failed && *ps.p == '\0' && root) {
+    match = nfa_state(dfa, NFA_MATCH, -1, -1, -1);
+    dfa->start = compile_node(dfa, root, match);
+  } else {
+    dfa->start = -1;
+  }
+  free(ps.nodes);
+  if (dfa->start < 0) {
+    free(dfa->nfa);
+    free(dfa->sets);
+    free(dfa);
+    return NULL;
+  }
+  dfa->mark = calloc(dfa->nnfa, sizeof(int));
+  dfa->stack = malloc(sizeof(int) * (dfa->nnfa * 4 + 4));
+  dfa->work = malloc(sizeof(int) * (dfa->nnfa * 3 + 3));
+  dfa->mid = malloc(sizeof(int) * (dfa->nnfa + 1));
+  dfa->states = malloc(sizeof(struct DFAState) * DFA_CACHE_STATES);
+  dfa->table = calloc(DFA_CACHE_STATES * 2, sizeof(int));
+  if (!dfa->mark || !dfa->stack || !dfa->work || !dfa->mid || !dfa->states || !dfa->table) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  dfa->nmid = closure(dfa, &dfa->start, 1, 0, 0, dfa->mid);
+  dfa->bol = -1;
+  dfa->idle = -1;
+  return dfa;
+}
+
+static void dfa_free(struct LazyDFA *dfa) {
+  dfa_flush(dfa);
+  free(dfa->nfa);
+  free(dfa->sets);
+  free(dfa->mark);
+  free(dfa->stack);
+  free(dfa->work);
+  free(dfa->mid);
+  free(dfa->states);
+  free(dfa->table);
+  free(dfa);
+}
+
+static int dfa_thrashing(struct LazyDFA *dfa) {
+  return dfa->thrashing >= DFA_MAX_THRASHING;
+}
+
+/* 1 or 0, or -1 once the DFA has given up */
+static int dfa_match_line(struct LazyDFA *dfa, const char *line, const char *eol) {
+  int s = dfa_bol(dfa);
+
+  if (dfa_thrashing(dfa)) {
+    return -1;
+  }
+  dfa->scanned += eol - line;
+  if (dfa->states[s].accept) {
+    return 1;
+  }
+  if (line == eol) {
+    return dfa->empty_ok;
+  }
+  for (; line < eol; line++) {
+    int t = dfa->states[s].next[(unsigned char)*line];
+
+    if (t == DFA_UNKNOWN) {
+      t = dfa_step(dfa, s, *line);
+    }
+    if (t == DFA_ACCEPT) {
+      return 1;
+    }
+    s = t;
+  }
+  return dfa->states[s].accept_eol;
+}
+
+/*
+ * Work out which bytes move the scan out of the idle state. When that is
+ * only a handful and idle is also the line-start state, everything up to
+ * the next such byte can be skipped with memchr(), newlines included.
+ */
+static int dfa_prepare_skip(struct LazyDFA *dfa) {
+  int flushes = dfa->flushes;
+  int c, idle;
+
+  if (dfa->idle >= 0) {
+    return dfa->idle;
+  }
+  memcpy(dfa->work, dfa->mid, sizeof(int) * dfa->nmid);
+  idle = dfa_intern(dfa, dfa->work, dfa->nmid);
+  dfa->nskip = 0;
+  if (idle != dfa_bol(dfa) || dfa->empty_ok || dfa->states[idle].accept || dfa->states[idle].accept_eol) {
+    dfa->idle = idle;
+    return idle;
+  }
+  for (c = 0; c < 256; c++) {
+    int t;
+
+    if (c == '\n') {
+      continue;
+    }
+    t = dfa->states[idle].next[c];
+    if (t == DFA_UNKNOWN) {
+      t = dfa_step(dfa, idle, c);
+    }
+    if (dfa->flushes != flushes) {
+      return dfa_prepare_skip(dfa);
+    }
+    if (t != idle) {
+      if (dfa->nskip == DFA_MAX_SKIP_BYTES) {
+        dfa->nskip = 0;
+        break;
+      }
+      dfa->skip[dfa->nskip++] = c;
+    }
+  }
+  dfa->idle = idle;
+  return idle;
+}
+
+/* same contract as scan(), but one pass over the buffer with no per-line calls */
+static const char *scan_dfa(struct Matcher *m, const char *p, const char *end, int final, struct Output *out) {
+  struct LazyDFA *dfa = m->dfa;
+  int invert = m->matched == REG_NOMATCH;
+  const char *clean = p; /* start of lines known not to match */
+  const char *line = p;
+  const char *q;
+  const struct DFAState *states = dfa->states;
+  const char *skip_pos[DFA_MAX_SKIP_BYTES];
+  int idle = dfa_prepare_skip(dfa);
+  int s = dfa_bol(dfa);
+  int k;
+
+  for (k = 0; k < DFA_MAX_SKIP_BYTES; k++) {
+    skip_pos[k] = NULL;
+  }
+
+  if (states[s].accept) {
+    /* the empty pattern (or similar) matches every line */
+    const char *last = memrchr(p, '\n', end - p);
+    const char *stop = final ? end : (last ? last + 1 : p);
+
+    if (!invert) {
+      put_lines(out, p, stop);
+    }
+    return stop;
+  }
+  for (q = p; q < end; q++) {
+    int t;
+    const char *next;
+
+    if (s == idle && dfa->nskip) {
+      const char *x = end, *nl;
+
+      for (k = 0; k < dfa->nskip; k++) {
+        if (skip_pos[k] < q) {
+          skip_pos[k] = memchr(q, dfa->skip[k], end - q);
+          if (!skip_pos[k]) {
+            skip_pos[k] = end;
+          }
+        }
+        if (skip_pos[k] < x) {
+          x = skip_pos[k];
+        }
+      }
+      /* [line, q) was scanned already and holds no newline */
+      nl = x > q ? memrchr(q, '\n', x - q) : NULL;
+      if (nl) {
+        dfa->scanned += nl + 1 - line;
+        line = nl + 1;
+      }
+      q = x;
+      if (q == end) {
+        break;
+      }
+    }
+    t = states[s].next[(unsigned char)*q];
+    if (t >= 0) {
+      s = t;
+      continue;
+    }
+    if (t == DFA_UNKNOWN) {
+      int flushes = dfa->flushes;
+
+      t = dfa_step(dfa, s, *q);
+      if (dfa->flushes != flushes) {
+        idle = dfa_prepare_skip(dfa);
+      }
+      if (t >= 0) {
+        s = t;
+        continue;
+      }
+    }
+    if (t == DFA_NEWLINE) {
+      if (!(q == line ? dfa->empty_ok : dfa->states[s].accept_eol)) {
+        dfa->scanned += q + 1 - line;
+        line = q + 1;
+        s = dfa_bol(dfa);
+        if (dfa_thrashing(dfa)) {
+          break;
+        }
+        continue;
+      }
+      next = q + 1;
+    } else {
+      next = memchr(q, '\n', end - q);
+      if (!next) {
+        if (!final) {
+          break;
+        }
+        next = end;
+      } else {
+        next++;
+      }
+    }
+    if (invert) {
+      put_lines(out, clean, line);
+    } else {
+      put_lines(out, line, next);
+    }
+    dfa->scanned += next - line;
+    clean = line = next;
+    q = next - 1;
+    s = dfa_bol(dfa);
+    if (dfa_thrashing(dfa)) {
+      break;
+    }
+  }
+  if (!final || dfa_thrashing(dfa)) {
+    if (invert) {
+      put_lines(out, clean, line);
+    }
+    return line;
+  }
+  /* end of input ends the last line too */
+  if (line < end && dfa->states[s].accept_eol) {
+    if (invert) {
+      put_lines(out, clean, line);
+    } else {
+      put_lines(out, line, end);
+    }
+  } else if (invert) {
+    put_lines(out, clean, end);
+  }
+  return end;
+}
+
+static int looks_binary(const char *p, size_t len) {
+  return memchr(p, '\0', len < BINARY_SNIFF_SIZE ? len : BINARY_SNIFF_SIZE) != NULL;
+}
+
+static void do_grep(struct Matcher *m, int fd, const char *path, struct Output *out) {
+  struct stat st;
+  char *buf;
+  size_t size, len = 0;
+  int first = 1;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (map != MAP_FAILED) {
+      madvise(map, st.st_size, MADV_SEQUENTIAL);
+      if (!skip_binary || !looks_binary(map, st.st_size)) {
+        scan(m, map, (char *)map + st.st_size, 1, out);
+      }
+      munmap(map, st.st_size);
+      return;
+    }
+  }
+
+  /* pipes and friends: large reads, carrying the partial last line over */
+  size = READ_CHUNK;
+  buf = malloc(size);
+  if (!buf) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  while (1) {
+    const char *rest;
+    ssize_t n;
+
+    if (len == size) {
+      size *= 2;
+      buf = realloc(buf, size);
+      if (!buf) {
+        perror("realloc(3)");
+        exit(1);
+      }
+    }
+    n = read(fd, buf + len, size - len);
+    if (n < 0) {
+      perror(path);
+      exit(1);
+    }
+    if (n == 0) {
+      scan(m, buf, buf + len, 1, out);
+      break;
+    }
+    if (first && skip_binary && looks_binary(buf + len, n)) {
+      break;
+    }
+    first = 0;
+    len += n;
+    /* a long line arrives in many reads; scan it once, when it is complete */
+    if (!memchr(buf + len - n, '\n', n)) {
+      continue;
+    }
+    rest = scan(m, buf, buf + len, 0, out);
+    len -= rest - buf;
+    memmove(buf, rest, len);
+  }
+  free(buf);
+}
+
+/*
+ * Recursive mode.
+ *
+ * The main thread walks the trees with openat(2)/getdents64(2), sorting
+ * each directory, and numbers every regular file in that order. Files are
+ * dealt round-robin onto per-worker deques; a worker takes from the front
+ * of its own deque and steals from the back of the others' when it runs
+ * dry. Each file's output is collected in memory and printed once every
+ * file numbered before it has been printed, so the result does not depend
+ * on scheduling.
+ */
+
+struct Job {
+  char *path;
+  char *prefix; /* "path:" */
+  struct Output out;
+  int done;
+};
+
+struct Deque {
+  pthread_mutex_t lock;
+  struct Job **items;
+  size_t head;
+  size_t tail;
+  size_t cap;
+};
+
+struct Worker {
+  pthread_t thread;
+  struct Matcher m;
+  int id;
+};
+
+static struct Deque deques[MAX_THREADS];
+static struct Worker workers[MAX_THREADS];
+static int n_workers;
+
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_cond = PTHREAD_COND_INITIALIZER;
+static long pending = 0;
+static int walk_done = 0;
+
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct Job **jobs = NULL;
+static size_t n_jobs = 0, jobs_cap = 0, next_print = 0;
+
+static void deque_push(struct Deque *d, struct Job *job) {
+  pthread_mutex_lock(&d->lock);
+  if (d->tail - d->head == d->cap) {
+    size_t i, cap = d->cap ? d->cap * 2 : 64;
+    struct Job **items = malloc(sizeof(struct Job *) * cap);
+
+    if (!items) {
+      perror("malloc(3)");
+      exit(1);
+    }
+    for (i = d->head; i < d->tail; i++) {
+      items[i - d->head] = d->items[i % d->cap];
+    }
+    free(d->items);
+    d->items = items;
+    d->tail -= d->head;
+    d->head = 0;
+    d->cap = cap;
+  }
+  d->items[d->tail++ % d->cap] = job;
+  pthread_mutex_unlock(&d->lock);
+}
+
+static struct Job *deque_take(struct Deque *d, int steal) {
+  struct Job *job = NULL;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->head < d->tail) {
+    job = steal ? d->items[--d->tail % d->cap] : d->items[d->head++ % d->cap];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return job;
+}
+
+static struct Job *next_job(int id) {
+  while (1) {
+    struct Job *job;
+    int i;
+
+    job = deque_take(&deques[id], 0);
+    for (i = 1; !job && i < n_workers; i++) {
+      job = deque_take(&deques[(id + i) % n_workers], 1);
+    }
+    pthread_mutex_lock(&pending_lock);
+    if (job) {
+      pending--;
+      pthread_mutex_unlock(&pending_lock);
+      return job;
+    }
+    while (pending == 0 && !walk_done) {
+      pthread_cond_wait(&pending_cond, &pending_lock);
+    }
+    if (pending == 0 && walk_done) {
+      pthread_mutex_unlock(&pending_lock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&pending_lock);
+  }
+}
+
+static void flush_finished(void) {
+  while (next_print < n_jobs && jobs[next_print]->done) {
+    struct Job *job = jobs[next_print++];
+
+    fwrite(job->out.buf, 1, job->out.len, stdout);
+    free(job->out.buf);
+    free(job->prefix);
+    free(job->path);
+    free(job);
+  }
+}
+
+static void *worker_main(void *arg) {
+  struct Worker *w = arg;
+  struct Job *job;
+
+  while ((job = next_job(w->id)) != NULL) {
+    int fd = open(job->path, O_RDONLY | O_NOCTTY);
+
+    if (fd < 0) {
+      perror(job->path);
+    } else {
+      do_grep(&w->m, fd, job->path, &job->out);
+      close(fd);
+    }
+    pthread_mutex_lock(&print_lock);
+    job->done = 1;
+    flush_finished();
+    pthread_mutex_unlock(&print_lock);
+  }
+  return NULL;
+}
+
+static void add_job(const char *path) {
+  static int next_worker = 0;
+  struct Job *job;
+  size_t len = strlen(path);
+
+  job = calloc(1, sizeof(struct Job));
+  if (!job || !(job->path = strdup(path)) || !(job->prefix = malloc(len + 2))) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  memcpy(job->prefix, path, len);
+  job->prefix[len] = ':';
+  job->prefix[len + 1] = '\0';
+  job->out.prefix = job->prefix;
+  job->out.collect = 1;
+
+  pthread_mutex_lock(&print_lock);
+  if (n_jobs == jobs_cap) {
+    jobs_cap = jobs_cap ? jobs_cap * 2 : 1024;
+    jobs = realloc(jobs, sizeof(struct Job *) * jobs_cap);
+    if (!jobs) {
+      perror("realloc(3)");
+      exit(1);
+    }
+  }
+  jobs[n_jobs++] = job;
+  pthread_mutex_unlock(&print_lock);
+
+  deque_push(&deques[next_worker], job);
+  next_worker = (next_worker + 1) % n_workers;
+
+  pthread_mutex_lock(&pending_lock);
+  pending++;
+  pthread_cond_signal(&pending_cond);
+  pthread_mutex_unlock(&pending_lock);
+}
+
+static void queue_file(int dirfd, const char *name, const char *path) {
+  (void)dirfd;
+  (void)name;
+  add_job(path);
+}
+
+/* called by walk() for every regular file */
+static void (*visit_file)(int dirfd, const char *name, const char *path) = queue_file;
+
+struct Entry {
+  char *name;
+  unsigned char type;
+};
+
+static int compare_entry(const void *a, const void *b) {
+  return strcmp(((const struct Entry *)a)->name, ((const struct Entry *)b)->name);
+}
+
+static void walk(int fd, const char *path) {
+  static char dirent_buf[DIRENT_BUF_SIZE];
+  struct Entry *ents = NULL;
+  size_t n = 0, cap = 0, i;
+  char *names = NULL;
+  size_t names_len = 0, names_cap = 0;
+
+  while (1) {
+    ssize_t nread = getdents64(fd, dirent_buf, sizeof dirent_buf);
+    ssize_t off;
+
+    if (nread < 0) {
+      perror(path);
+      break;
+    }
+    if (nread == 0) {
+      break;
+    }
+    for (off = 0; off < nread; ) {
+      struct dirent64 *d = (struct dirent64 *)(dirent_buf + off);
+      size_t len = strlen(d->d_name) + 1;
+
+      off += d->d_reclen;
+      if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+        continue;
+      }
+      if (n == cap) {
+        cap = cap ? cap * 2 : 64;
+        ents = realloc(ents, sizeof(struct Entry) * cap);
+      }
+      if (names_len + len > names_cap) {
+        names_cap = names_cap ? names_cap * 2 : 4096;
+        while (names_len + len > names_cap) {
+          names_cap *= 2;
+        }
+        names = realloc(names, names_cap);
+      }
+      if (!ents || !names) {
+        perror("realloc(3)");
+        exit(1);
+      }
+      memcpy(names + names_len, d->d_name, len);
+      ents[n].name = (char *)names_len; /* rebased below, names may move */
+      ents[n].type = d->d_type;
+      names_len += len;
+      n++;
+    }
+  }
+  for (i = 0; i < n; i++) {
+    ents[i].name = names + (size_t)ents[i].name;
+  }
+  qsort(ents, n, sizeof(struct Entry), compare_entry);
+
+  for (i = 0; i < n; i++) {
+    char child[PATH_MAX];
+    unsigned char type = ents[i].type;
+
+    snprintf(child, sizeof child, "%s%s%s", path,
+             path[strlen(path) - 1] == '/' ? "" : "/", ents[i].name);
+    if (type == DT_UNKNOWN) {
+      struct stat st;
+
+      if (fstatat(fd, ents[i].name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+        perror(child);
+        continue;
+      }
+      type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+    if (type == DT_DIR) {
+      int sub = openat(fd, ents[i].name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+
+      if (sub < 0) {
+        perror(child);
+        continue;
+      }
+      walk(sub, child);
+      close(sub);
+    } else if (type == DT_REG) {
+      visit_file(fd, ents[i].name, child);
+    }
+  }
+  free(ents);
+  free(names);
+}
+
+/*
+ * Trigram index (--index=FILE).
+ *
+ * The file is a header followed by four arrays, all meant to be used in
+ * place through mmap(2):
+ *
+ *   IndexFile[nfiles]         walk order, so ids are also output order
+ *   IndexTrigram[ntrigrams]   sorted by trigram
+ *   uint32_t postings[]       file ids per trigram, ascending
+ *   char paths[]              NUL-terminated paths
+ *
+ * Trigrams are case-folded so one index serves -i as well. Every run
+ * walks the trees and compares mtime and size with the index; only new
+ * or changed files are read, on n_workers threads, and the postings of
+ * unchanged files are carried over. When nothing changed the existing
+ * file is used as is. The query takes the trigrams of the pattern's
+ * required literal (or, for -F/-f sets, of each fixed string), intersects
+ * their posting lists and queues only the surviving files for the normal
+ * matcher. Patterns without such a literal, and -v, search every file.
+ */
+#define INDEX_MAGIC "GRPIDX01"
+#define INDEX_BINARY 1     /* skipped, as -r does */
+#define INDEX_UNREADABLE 2 /* always searched, so the error is reported */
+#define TRIGRAM_BITS (1 << 24)
+
+struct IndexHeader {
+  char magic[8];
+  uint64_t nfiles;
+  uint64_t ntrigrams;
+  uint64_t npostings;
+  uint64_t paths_size;
+};
+
+struct IndexFile {
+  uint64_t path;
+  int64_t mtime; /* nanoseconds */
+  int64_t size;
+  uint64_t flags;
+};
+
+struct IndexTrigram {
+  uint32_t trigram;
+  uint32_t count;
+  uint64_t offset;
+};
+
+struct Index {
+  void *map;
+  size_t map_size;
+  uint64_t nfiles;
+  uint64_t ntrigrams;
+  struct IndexFile *files;
+  struct IndexTrigram *trigrams;
+  uint32_t *postings;
+  char *paths;
+};
+
+struct IndexEntry {
+  char *path;
+  int64_t mtime;
+  int64_t size;
+  uint64_t flags;
+  int64_t old_id;
+};
+
+struct PairVec {
+  uint64_t *v; /* trigram << 32 | file id */
+  size_t len;
+  size_t cap;
+};
+
+static struct IndexEntry *entries = NULL;
+static size_t n_entries = 0, entries_cap = 0;
+
+static void collect_file(int dirfd, const char *name, const char *path) {
+  struct stat st;
+
+  if (fstatat(dirfd, name, &st, 0) < 0) {
+    perror(path);
+    return;
+  }
+  if (n_entries == entries_cap) {
+    entries_cap = entries_cap ? entries_cap * 2 : 1024;
+    entries = realloc(entries, sizeof(struct IndexEntry) * entries_cap);
+    if (!entries) {
+      perror("realloc(3)");
+      exit(1);
+    }
+  }
+  entries[n_entries].path = strdup(path);
+  entries[n_entries].mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  entries[n_entries].size = st.st_size;
+  entries[n_entries].flags = 0;
+  entries[n_entries].old_id = -1;
+  if (!entries[n_entries].path) {
+    perror("strdup(3)");
+    exit(1);
+  }
+  n_entries++;
+}
+
+static void pair_push(struct PairVec *pv, uint64_t pair) {
+  if (pv->len == pv->cap) {
+    pv->cap = pv->cap ? pv->cap * 2 : 4096;
+    pv->v = realloc(pv->v, sizeof(uint64_t) * pv->cap);
+    if (!pv->v) {
+      perror("realloc(3)");
+      exit(1);
+    }
+  }
+  pv->v[pv->len++] = pair;
+}
+
+static uint32_t trigram_at(const char *p) {
+  return (uint32_t)tolower((unsigned char)p[0]) << 16
+       | (uint32_t)tolower((unsigned char)p[1]) << 8
+       | (uint32_t)tolower((unsigned char)p[2]);
+}
+
+static int index_load(const char *path, struct Index *ix) {
+  struct IndexHeader *h;
+  struct stat st;
+  size_t need;
+  int fd;
+
+  memset(ix, 0, sizeof(struct Index));
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct IndexHeader)) {
+    close(fd);
+    return -1;
+  }
+  ix->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ix->map == MAP_FAILED) {
+    return -1;
+  }
+  ix->map_size = st.st_size;
+  h = ix->map;
+  need = sizeof(struct IndexHeader) + h->nfiles * sizeof(struct IndexFile)
+       + h->ntrigrams * sizeof(struct IndexTrigram) + h->npostings * sizeof(uint32_t)
+       + h->paths_size;
+  if (memcmp(h->magic, INDEX_MAGIC, 8) != 0 || need != ix->map_size) {
+    munmap(ix->map, ix->map_size);
+    ix->map = NULL;
+    return -1;
+  }
+  ix->nfiles = h->nfiles;
+  ix->ntrigrams = h->ntrigrams;
+  ix->files = (struct IndexFile *)(h + 1);
+  ix->trigrams = (struct IndexTrigram *)(ix->files + h->nfiles);
+  ix->postings = (uint32_t *)(ix->trigrams + h->ntrigrams);
+  ix->paths = (char *)(ix->postings + h->npostings);
+  return 0;
+}
+
+static void index_unload(struct Index *ix) {
+  if (ix->map) {
+    munmap(ix->map, ix->map_size);
+  }
+  ix->map = NULL;
+}
+
+struct IndexBuilder {
+  pthread_t thread;
+  struct PairVec pairs;
+};
+
+static size_t *to_scan;
+static size_t n_to_scan;
+static size_t next_scan = 0;
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void index_one(struct IndexEntry *e, uint32_t id, uint8_t *seen, uint32_t *found, struct PairVec *pv) {
+  size_t nfound = 0, i;
+  const char *p, *end;
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open(e->path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    e->flags = INDEX_UNREADABLE;
+    return;
+  }
+  /*
+   * Map what the open file holds now, not what the walk saw: a file that
+   * shrank in between would fault past its end. The entry then records
+   * the content that was indexed.
+   */
+  e->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+  e->size = st.st_size;
+  if (e->size < 3) {
+    close(fd);
+    return;
+  }
+  map = mmap(NULL, e->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    e->flags = INDEX_UNREADABLE;
+    return;
+  }
+  madvise(map, e->size, MADV_SEQUENTIAL);
+  if (looks_binary(map, e->size)) {
+    e->flags = INDEX_BINARY;
+    munmap(map, e->size);
+    return;
+  }
+  end = (const char *)map + e->size - 2;
+  for (p = map; p < end; p++) {
+    uint32_t t = trigram_at(p);
+
+    if (!(seen[t >> 3] & (1 << (t & 7)))) {
+      seen[t >> 3] |= 1 << (t & 7);
+      found[nfound++] = t;
+    }
+  }
+  munmap(map, e->size);
+  for (i = 0; i < nfound; i++) {
+    seen[found[i] >> 3] &= ~(1 << (found[i] & 7));
+    pair_push(pv, (uint64_t)found[i] << 32 | id);
+  }
+}
+
+static void *index_builder_main(void *arg) {
+  struct IndexBuilder *b = arg;
+  uint8_t *seen = calloc(TRIGRAM_BITS / 8, 1);
+  uint32_t *found = malloc(sizeof(uint32_t) * TRIGRAM_BITS);
+
+  if (!seen || !found) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  while (1) {
+    size_t i;
+
+    pthread_mutex_lock(&scan_lock);
+    i = next_scan++;
+    pthread_mutex_unlock(&scan_lock);
+    if (i >= n_to_scan) {
+      break;
+    }
+    index_one(&entries[to_scan[i]], to_scan[i], seen, found, &b->pairs);
+  }
+  free(seen);
+  free(found);
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+static uint64_t hash_path(const char *s) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  for (; *s; s++) {
+    h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/* match the walk against the old index; returns the number of differences */
+static size_t index_diff(struct Index *old) {
+  size_t size = 16, i, changed = 0, reused = 0;
+  int64_t *table;
+
+  while (size < old->nfiles * 2) {
+    size *= 2;
+  }
+  table = malloc(sizeof(int64_t) * size);
+  if (!table) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  memset(table, 0xff, sizeof(int64_t) * size);
+  for (i = 0; i < old->nfiles; i++) {
+    uint64_t h = hash_path(old->paths + old->files[i].path) & (size - 1);
+
+    while (table[h] >= 0) {
+      h = (h + 1) & (size - 1);
+    }
+    table[h] = i;
+  }
+  for (i = 0; i < n_entries; i++) {
+    struct IndexEntry *e = &entries[i];
+    uint64_t h = hash_path(e->path) & (size - 1);
+
+    for (; table[h] >= 0; h = (h + 1) & (size - 1)) {
+      struct IndexFile *f = &old->files[table[h]];
+
+      if (strcmp(old->paths + f->path, e->path) == 0) {
+        if (f->mtime == e->mtime && f->size == e->size && !(f->flags & INDEX_UNREADABLE)) {
+          e->old_id = table[h];
+          e->flags = f->flags;
+          reused++;
+        }
+        break;
+      }
+    }
+    if (e->old_id != (int64_t)i) {
+      changed++;
+    }
+  }
+  free(table);
+  return changed + (old->nfiles - reused);
+}
+
+static void index_write(const char *path, struct PairVec *pv) {
+  struct IndexHeader h;
+  char tmp[PATH_MAX];
+  uint64_t paths_size = 0, i, j, ntrigrams = 0;
+  FILE *f;
+
+  snprintf(tmp, sizeof tmp, "%s.tmp.%d", path, (int)getpid());
+  f = fopen(tmp, "w");
+  if (!f) {
+    perror(tmp);
+    exit(1);
+  }
+  for (i = 0; i < pv->len; i++) {
+    if (i == 0 || pv->v[i] >> 32 != pv->v[i - 1] >> 32) {
+      ntrigrams++;
+    }
+  }
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, INDEX_MAGIC, 8);
+  h.nfiles = n_entries;
+  h.ntrigrams = ntrigrams;
+  h.npostings = pv->len;
+  for (i = 0; i < n_entries; i++) {
+    paths_size += strlen(entries[i].path) + 1;
+  }
+  h.paths_size = paths_size;
+  fwrite(&h, sizeof h, 1, f);
+
+  paths_size = 0;
+  for (i = 0; i < n_entries; i++) {
+    struct IndexFile file;
+
+    file.path = paths_size;
+    file.mtime = entries[i].mtime;
+    file.size = entries[i].size;
+    file.flags = entries[i].flags;
+    fwrite(&file, sizeof file, 1, f);
+    paths_size += strlen(entries[i].path) + 1;
+  }
+  for (i = 0; i < pv->len; i = j) {
+    struct IndexTrigram t;
+
+    for (j = i; j < pv->len && pv->v[j] >> 32 == pv->v[i] >> 32; j++)
+      ;
+    t.trigram = pv->v[i] >> 32;
+    t.count = j - i;
+    t.offset = i;
+    fwrite(&t, sizeof t, 1, f);
+  }
+  for (i = 0; i < pv->len; i++) {
+    uint32_t id = (uint32_t)pv->v[i];
+
+    fwrite(&id, sizeof id, 1, f);
+  }
+  for (i = 0; i < n_entries; i++) {
+    fwrite(entries[i].path, strlen(entries[i].path) + 1, 1, f);
+  }
+  if (fflush(f) != 0 || ferror(f) || fclose(f) != 0) {
+    perror(tmp);
+    unlink(tmp);
+    exit(1);
+  }
+  if (rename(tmp, path) < 0) {
+    perror(path);
+    unlink(tmp);
+    exit(1);
+  }
+}
+
+static void index_update(const char *path, struct Index *ix) {
+  struct IndexBuilder builders[MAX_THREADS];
+  struct PairVec all = {NULL, 0, 0};
+  struct Index old;
+  int64_t *remap;
+  size_t i, j, k;
+  int have_old, n;
+
+  have_old = index_load(path, &old) == 0;
+  if (have_old && index_diff(&old) == 0) {
+    *ix = old;
+    return;
+  }
+
+  /* carry over the postings of unchanged files under their new ids */
+  if (have_old) {
+    remap = malloc(sizeof(int64_t) * (old.nfiles + 1));
+    if (!remap) {
+      perror("malloc(3)");
+      exit(1);
+    }
+    memset(remap, 0xff, sizeof(int64_t) * (old.nfiles + 1));
+    for (i = 0; i < n_entries; i++) {
+      if (entries[i].old_id >= 0) {
+        remap[entries[i].old_id] = i;
+      }
+    }
+    for (i = 0; i < old.ntrigrams; i++) {
+      struct IndexTrigram *t = &old.trigrams[i];
+
+      for (j = 0; j < t->count; j++) {
+        int64_t id = remap[old.postings[t->offset + j]];
+
+        if (id >= 0) {
+          pair_push(&all, (uint64_t)t->trigram << 32 | id);
+        }
+      }
+    }
+    free(remap);
+    index_unload(&old);
+  }
+
+  to_scan = malloc(sizeof(size_t) * (n_entries + 1));
+  if (!to_scan) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  n_to_scan = 0;
+  for (i = 0; i < n_entries; i++) {
+    if (entries[i].old_id < 0) {
+      to_scan[n_to_scan++] = i;
+    }
+  }
+  n = n_workers < (int)n_to_scan ? n_workers : (int)n_to_scan;
+  for (k = 0; k < (size_t)n; k++) {
+    memset(&builders[k].pairs, 0, sizeof(struct PairVec));
+    if (pthread_create(&builders[k].thread, NULL, index_builder_main, &builders[k]) != 0) {
+      fputs("pthread_create(3) failed\n", stderr);
+      exit(1);
+    }
+  }
+  for (k = 0; k < (size_t)n; k++) {
+    pthread_join(builders[k].thread, NULL);
+    for (i = 0; i < builders[k].pairs.len; i++) {
+      pair_push(&all, builders[k].pairs.v[i]);
+    }
+    free(builders[k].pairs.v);
+  }
+  free(to_scan);
+
+  qsort(all.v, all.len, sizeof(uint64_t), compare_u64);
+  index_write(path, &all);
+  free(all.v);
+  if (index_load(path, ix) < 0) {
+    fprintf(stderr, "%s: cannot read back the index\n", path);
+    exit(1);
+  }
+}
+
+static struct IndexTrigram *index_lookup(struct Index *ix, uint32_t trigram) {
+  size_t lo = 0, hi = ix->ntrigrams;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+
+    if (ix->trigrams[mid].trigram < trigram) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo < ix->ntrigrams && ix->trigrams[lo].trigram == trigram ? &ix->trigrams[lo] : NULL;
+}
+
+/*
+ * Mark the files containing every trigram of literal. Returns 0 when the
+ * literal is too short to say anything, in which case nothing is marked.
+ */
+static int index_mark(struct Index *ix, const char *literal, size_t len, uint8_t *marks) {
+  uint32_t *cand = NULL;
+  size_t ncand = 0, i, j, k;
+
+  if (len < 3) {
+    return 0;
+  }
+  for (i = 0; i + 2 < len; i++) {
+    struct IndexTrigram *t = index_lookup(ix, trigram_at(literal + i));
+    const uint32_t *list;
+
+    if (!t) {
+      free(cand);
+      return 1;
+    }
+    list = ix->postings + t->offset;
+    if (!cand) {
+      cand = malloc(sizeof(uint32_t) * (t->count + 1));
+      if (!cand) {
+        perror("malloc(3)");
+        exit(1);
+      }
+      memcpy(cand, list, sizeof(uint32_t) * t->count);
+      ncand = t->count;
+      continue;
+    }
+    /* both lists are ascending: merge-intersect in place */
+    for (j = k = 0; j < ncand; j++) {
+      uint64_t lo = 0, hi = t->count;
+
+      while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+
+        if (list[mid] < cand[j]) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      if (lo < t->count && list[lo] == cand[j]) {
+        cand[k++] = cand[j];
+      }
+    }
+    ncand = k;
+  }
+  for (i = 0; i < ncand; i++) {
+    marks[cand[i]] = 1;
+  }
+  free(cand);
+  return 1;
+}
+
+static void index_query(struct Index *ix, const char *pattern, int matched) {
+  uint8_t *marks = calloc(ix->nfiles + 1, 1);
+  int everything = matched == REG_NOMATCH;
+  uint64_t i;
+
+  if (!marks) {
+    perror("calloc(3)");
+    exit(1);
+  }
+  if (!everything && fixed_set) {
+    const char *p = pattern;
+
+    while (*p && !everything) {
+      const char *eol = strchr(p, '\n');
+      size_t len = eol ? (size_t)(eol - p) : strlen(p);
+
+      everything = !index_mark(ix, p, len, marks);
+      p += len + (eol ? 1 : 0);
+    }
+  } else if (!everything) {
+    /* only a literal outside any group, so an optional group never narrows */
+    size_t len;
+    const char *literal = required_literal(pattern, &len);
+
+    everything = !literal || !index_mark(ix, literal, len, marks);
+  }
+  for (i = 0; i < ix->nfiles; i++) {
+    struct IndexFile *f = &ix->files[i];
+
+    if (f->flags & INDEX_BINARY) {
+      continue;
+    }
+    if (everything || marks[i] || (f->flags & INDEX_UNREADABLE)) {
+      add_job(ix->paths + f->path);
+    }
+  }
+  free(marks);
+}
+
+static void grep_tree(const char *pattern, int flags, int matched, char **paths, int npaths, int nthreads) {
+  static char *cwd[] = {"."};
+  int i;
+
+  if (nthreads <= 0) {
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (nthreads <= 0) {
+    nthreads = 1;
+  }
+  if (nthreads > MAX_THREADS) {
+    nthreads = MAX_THREADS;
+  }
+  if (npaths == 0) {
+    paths = cwd;
+    npaths = 1;
+  }
+  skip_binary = 1;
+  n_workers = nthreads;
+  if (index_path) {
+    visit_file = collect_file;
+  }
+  /* glibc serializes regexec() on a shared regex_t, so each worker compiles its own */
+  for (i = 0; i < n_workers; i++) {
+    pthread_mutex_init(&deques[i].lock, NULL);
+    workers[i].id = i;
+    compile_matcher(&workers[i].m, pattern, flags, matched);
+  }
+  for (i = 0; i < n_workers; i++) {
+    if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+      fputs("pthread_create(3) failed\n", stderr);
+      exit(1);
+    }
+  }
+
+  for (i = 0; i < npaths; i++) {
+    struct stat st;
+    int fd;
+
+    if (stat(paths[i], &st) < 0) {
+      perror(paths[i]);
+      continue;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+      visit_file(AT_FDCWD, paths[i], paths[i]);
+      continue;
+    }
+    fd = open(paths[i], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      perror(paths[i]);
+      continue;
+    }
+    walk(fd, paths[i]);
+    close(fd);
+  }
+  if (index_path) {
+    struct Index ix;
+
+    index_update(index_path, &ix);
+    index_query(&ix, pattern, matched);
+    index_unload(&ix);
+  }
+
+  pthread_mutex_lock(&pending_lock);
+  walk_done = 1;
+  pthread_cond_broadcast(&pending_cond);
+  pthread_mutex_unlock(&pending_lock);
+  for (i = 0; i < n_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+    free_matcher(&workers[i].m);
   }
+  fflush(stdout);
 }
@@ -1,64 +1,269 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
-
-#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include "fastio.h"
 
-static long do_head(FILE *f, long nlines);
+static long do_head(int fd, const char *path, long count);
+static void do_tail(int fd, const char *path, long count);
 
 #define DEFAULT_N_LINES 10
+#define TAIL_BLOCK_SIZE (64 * 1024)
 
 static struct option longopts[] = {
     {"lines", required_argument, NULL, 'n'},
+    {"bytes", required_argument, NULL, 'c'},
+    {"tail",  no_argument,       NULL, 't'},
     {"help",  no_argument,       NULL, 'h'},
     {0, 0, 0, 0}
 };
 
+static struct FioWriter out;
+static int count_bytes = 0;
+
 int main(int argc, char *argv[]) {
     int opt;
-    long nlines = DEFAULT_N_LINES;
+    int tail = 0;
+    long count = DEFAULT_N_LINES;
 
     // parse option
-    while ((opt = getopt_long(argc, argv, "n:", longopts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "n:c:t", longopts, NULL)) != -1) {
         switch (opt) {
             case 'n':
-                nlines = atoi(optarg);
+                count = atol(optarg);
+                count_bytes = 0;
+                break;
+            case 'c':
+                count = atol(optarg);
+                count_bytes = 1;
+                break;
+            case 't':
+                tail = 1;
                 break;
             case 'h':
-                fprintf(stdout, "Usage: %s [-n LINES] [FILE ...]\n", argv[0]);
+                fprintf(stdout, "Usage: %s [-t] [-n LINES | -c BYTES] [FILE ...]\n", argv[0]);
                 exit(0);
             case '?':
-                fprintf(stderr, "Usage: %s [-n LINES] [FILE ...]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-t] [-n LINES | -c BYTES] [FILE ...]\n", argv[0]);
                 exit(1);
         }
     }
+    if (count < 0) {
+        count = 0;
+    }
 
+    if (fio_writer_open(&out, STDOUT_FILENO) < 0) {
+        perror("stdout");
+        exit(1);
+    }
     if (optind == argc) {
-        do_head(stdin, nlines);
+        if (tail) {
+            do_tail(STDIN_FILENO, "stdin", count);
+        } else {
+            do_head(STDIN_FILENO, "stdin", count);
+        }
     } else {
         int i;
 
         for (i = optind; i < argc; i++) {
-            FILE *f;
+            int fd;
 
-            f = fopen(argv[i], "r");
-            if (!f) {
+            fd = open(argv[i], O_RDONLY);
+            if (fd < 0) {
                 perror(argv[i]);
                 exit(1);
             }
-            nlines = do_head(f, nlines);
-            fclose(f);
+            if (tail) {
+                do_tail(fd, argv[i], count);
+            } else {
+                count = do_head(fd, argv[i], count);
+            }
+            close(fd);
         }
     }
+    if (fio_writer_close(&out) < 0) { exit(1); }
     exit(0);
 }
 
-static long do_head(FILE *f, long nlines) {
-    int c;
+static void put(const void *p, size_t n) {
+    if (fio_write(&out, p, n) < 0) { exit(1); }
+}
+
+/*
+ * Copy blocks until count lines (or bytes) have gone out, finding line
+ * ends with memchr. Whatever was read past the stopping point is given
+ * back, so seekable input is left positioned right after it. Returns
+ * the count still outstanding, which carries over to the next file.
+ */
+static long do_head(int fd, const char *path, long count) {
+    struct FioReader in;
+    const unsigned char *p = NULL;
+    size_t n = 0;
+    int ret = 0;
+
+    if (fio_open(&in, fd) < 0) {
+        perror(path);
+        exit(1);
+    }
+    while (count > 0 && (ret = fio_block(&in, &p, &n)) > 0) {
+        const unsigned char *q = p, *end = p + n;
+
+        if (count_bytes) {
+            if ((size_t)count < n) {
+                q = p + count;
+            } else {
+                q = end;
+            }
+            count -= q - p;
+        } else {
+            while (count > 0 && (q = memchr(q, '\n', end - q)) != NULL) {
+                q++;
+                count--;
+            }
+            if (!q) {
+                q = end;
+            }
+        }
+        put(p, q - p);
+        fio_unread(&in, end - q);
+    }
+    if (ret < 0) {
+        perror(path);
+        exit(1);
+    }
+    fio_close(&in);
+    return count;
+}
+
+/*
+ * Offset in p[0..n) where the last count lines start. A newline at the
+ * very end terminates the last line rather than starting an empty one.
+ * *remaining is what is still missing when p holds fewer lines.
+ */
+static size_t last_lines(const unsigned char *p, size_t n, long count, long *remaining, int at_end) {
+    size_t end = n;
+
+    if (at_end && end > 0 && p[end - 1] == '\n') {
+        end--;
+    }
+    while (count > 0) {
+        const unsigned char *q = memrchr(p, '\n', end);
+
+        if (!q) {
+            break;
+        }
+        if (--count == 0) {
+            *remaining = 0;
+            return q - p + 1;
+        }
+        end = q - p;
+    }
+    *remaining = count;
+    return 0;
+}
+
+/*
+ * Regular files are searched backwards with pread(2) in fixed blocks, so
+ * only the tail of the file is ever read. Anything else is streamed
+ * through a buffer that is trimmed to the wanted tail whenever it grows.
+ */
+static void do_tail(int fd, const char *path, long count) {
+    struct FioReader in;
+    const unsigned char *p = NULL;
+    unsigned char *keep = NULL;
+    size_t n = 0, kept = 0, cap = 0, limit = TAIL_BLOCK_SIZE, start;
+    struct stat st;
+    long remaining;
+    int ret;
+
+    if (fstat(fd, &st) < 0) {
+        perror(path);
+        exit(1);
+    }
+    if (S_ISREG(st.st_mode) && lseek(fd, 0, SEEK_CUR) >= 0) {
+        static unsigned char buf[TAIL_BLOCK_SIZE];
+        off_t off = st.st_size, from = 0;
+
+        if (count_bytes) {
+            from = st.st_size > count ? st.st_size - count : 0;
+        } else if (count == 0) {
+            from = st.st_size;
+        } else {
+            remaining = count;
+            while (off > 0) {
+                size_t len = off > TAIL_BLOCK_SIZE ? TAIL_BLOCK_SIZE : off;
+
+                off -= len;
+                if (pread(fd, buf, len, off) != (ssize_t)len) {
+                    perror(path);
+                    exit(1);
+                }
+                start = last_lines(buf, len, remaining, &remaining, off + (off_t)len == st.st_size);
+                if (remaining == 0) {
+                    from = off + start;
+                    break;
+                }
+            }
+        }
+        if (lseek(fd, from, SEEK_SET) < 0) {
+            perror(path);
+            exit(1);
+        }
+    } else {
+        if (fio_open(&in, fd) < 0) {
+            perror(path);
+            exit(1);
+        }
+        while ((ret = fio_block(&in, &p, &n)) > 0) {
+            if (kept + n > cap) {
+                cap = (kept + n) * 2;
+                keep = realloc(keep, cap);
+                if (!keep) {
+                    perror("realloc(3)");
+                    exit(1);
+                }
+            }
+            memcpy(keep + kept, p, n);
+            kept += n;
+            if (kept > limit) {
+                /* one extra line: a trailing '\n' may not be the last one */
+                start = count_bytes ? (kept > (size_t)count ? kept - count : 0)
+                                    : last_lines(keep, kept, count + 1, &remaining, 0);
+                memmove(keep, keep + start, kept - start);
+                kept -= start;
+                limit = kept * 2 > TAIL_BLOCK_SIZE ? kept * 2 : TAIL_BLOCK_SIZE;
+            }
+        }
+        if (ret < 0) {
+            perror(path);
+            exit(1);
+        }
+        fio_close(&in);
+        if (count_bytes) {
+            start = kept > (size_t)count ? kept - count : 0;
+        } else if (count == 0) {
+            start = kept;
+        } else {
+            start = last_lines(keep, kept, count, &remaining, 1);
+        }
+        put(keep + start, kept - start);
+        free(keep);
+        return;
+    }
 
-    while (nlines > 0 && (c = getc(f)) != EOF) {
-        if (putchar(c) < 0) { exit(1); }
-        if (c == '\n') { nlines--; }
+    if (fio_open(&in, fd) < 0) {
+        perror(path);
+        exit(1);
+    }
+    while ((ret = fio_block(&in, &p, &n)) > 0) {
+        put(p, n);
+    }
+    if (ret < 0) {
+        perror(path);
+        exit(1);
     }
-    return nlines;
+    fio_close(&in);
 }
@@ -16,17 +16,43 @@
 #include <grp.h>
 #include <pwd.h>
 #include <regex.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <sys/wait.h>
+#include "fastio.h"
+#include "event.h"
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SYS_SDT_H 1
+#endif
+#endif
+
+/*
+ * USDT probes at request phase boundaries (provider "httpd"). Without
+ * <sys/sdt.h> they compile to nothing; with it each one is a single nop
+ * until perf or bpftrace attaches.
+ */
+#ifdef HAVE_SYS_SDT_H
+#define TRACE_PROBE(name) DTRACE_PROBE(httpd, name)
+#define TRACE_PROBE1(name, a) DTRACE_PROBE1(httpd, name, a)
+#else
+#define TRACE_PROBE(name)
+#define TRACE_PROBE1(name, a)
+#endif
 
 static void log_exit(char *fmt, ...);
 static void* xmalloc(size_t size);
 static void install_signal_handlers(void);
-static void service(FILE *in, FILE *out, char *docroot);
+static void service(struct FioReader *in, FILE *out, char *docroot);
 struct HTTPRequest;
 static void free_request(struct HTTPRequest *req);
-static struct HTTPRequest *read_request(FILE *in);
+static struct HTTPRequest *read_request(struct FioReader *in);
 static void respond_to(struct HTTPRequest *req, FILE *out, char *docroot);
 #define MAX_REQUEST_BODY_LENGTH 1024 * 1024
 #define LINE_BUF_SIZE 1024
+#define MAX_REQUEST_LINE_LENGTH (64 * 1024)
 #define BLOCK_BUF_SIZE 1024
 #define HTTP_MINOR_VERSION 1
 #define TIME_BUF_SIZE 64
@@ -58,13 +84,62 @@ struct FileInfo {
   int ok;
 };
 
-#define USAGE "Usage: %s [--port=n] [--chroot --user=u --group=g] [--debug] <docroot>\n"
+#define USAGE "Usage: %s [--port=n] [--chroot --user=u --group=g] [--rate=n] [--prefix-rate=n] [--bandwidth=n] [--trace=file [--trace-sample=n]] [--debug] <docroot>\n"
 
 static void setup_environment(char *docroot, char *user, char *group);
 static int listen_socket(char *port);
 static void server_main(int server, char *docroot);
 static void become_daemon(void);
 
+/*
+ * Per-client rate limiting.
+ *
+ * Every client address (and its /24 or /64 prefix) owns an entry in a
+ * hash table that lives in a MAP_SHARED mapping created before the first
+ * fork(), so the accepting parent and every child see the same budget.
+ * Slots are claimed and buckets are updated with compare-and-swap only;
+ * no process ever holds a lock on the table. A slot whose buckets have
+ * refilled completely is idle and holds no state worth keeping, so a new
+ * key may take it over once its probe window has no empty slot left.
+ */
+#define RATE_TABLE_SIZE 8192 /* must be a power of two */
+#define RATE_TABLE_PROBES 16
+#define RATE_REQUEST_COST 1000 /* one request in milli-requests */
+#define RATE_MAX_ELAPSED_MS 3600000
+
+struct RateEntry {
+  uint64_t key;
+  uint64_t requests; /* token bucket: last refill (ms) << 32 | tokens */
+  uint64_t bytes;
+};
+
+static void setup_rate_limit(void);
+static int rate_admit(struct sockaddr_storage *addr);
+static void rate_charge_bytes(long size);
+static int64_t bucket_refill(uint64_t bucket, uint32_t now, long per_sec);
+
+static struct RateEntry *rate_table = NULL;
+static struct RateEntry *client_rate = NULL;
+static unsigned long rate_table_full = 0; /* requests refused for want of a slot */
+static long ip_rate = 0;
+static long prefix_rate = 0;
+static long bandwidth = 0;
+
+static const char too_many_requests[] =
+  "HTTP/1.1 429 Too Many Requests\r\n"
+  "Retry-After: 1\r\n"
+  "Content-Length: 0\r\n"
+  "Connection: close\r\n"
+  "\r\n";
+
+static void setup_trace(char *path);
+static long trace_begin(void);
+static void trace_end(const char *name, long start);
+
+static int trace_fd = -1;
+static long trace_sample = 1;
+static int trace_this = 0;
+
 static int debug_mode = 0;
 
 static struct option longopts[] = {
@@ -73,6 +148,11 @@ static struct option longopts[] = {
   {"user",   required_argument, NULL, 'u'},
   {"group",  required_argument, NULL, 'g'},
   {"port",   required_argument, NULL, 'p'},
+  {"rate",        required_argument, NULL, 'r'},
+  {"prefix-rate", required_argument, NULL, 'R'},
+  {"bandwidth",   required_argument, NULL, 'b'},
+  {"trace",        required_argument, NULL, 't'},
+  {"trace-sample", required_argument, NULL, 's'},
   {"help",   no_argument,       NULL, 'h'},
   {0, 0, 0, 0}
 };
@@ -84,6 +164,7 @@ int main(int argc, char *argv[]) {
   int do_chroot = 0;
   char *user = NULL;
   char *group = NULL;
+  char *trace_path = NULL;
   int opt;
 
   while ((opt = getopt_long(argc, argv, "p:h:", longopts, NULL)) != -1) {
@@ -102,6 +183,21 @@ int main(int argc, char *argv[]) {
       case 'p':
         port = optarg;
         break;
+      case 'r':
+        ip_rate = atol(optarg);
+        break;
+      case 'R':
+        prefix_rate = atol(optarg);
+        break;
+      case 'b':
+        bandwidth = atol(optarg);
+        break;
+      case 't':
+        trace_path = optarg;
+        break;
+      case 's':
+        trace_sample = atol(optarg);
+        break;
       case 'h':
         fprintf(stdout, USAGE, argv[0]);
         exit(0);
@@ -116,11 +212,15 @@ int main(int argc, char *argv[]) {
   }
   docroot = argv[optind];
 
+  if (trace_path) {
+    setup_trace(trace_path);
+  }
   if (do_chroot) {
     setup_environment(docroot, user, group);
     docroot = "";
   }
   install_signal_handlers();
+  setup_rate_limit();
   server = listen_socket(port);
   if (!debug_mode) {
     openlog(SERVER_NAME, LOG_PID|LOG_NDELAY, LOG_DAEMON);
@@ -165,20 +265,46 @@ static void trap_signal(int signal, sighandler_t handler) {
   }
 }
 
-static void signal_exit(int signal) {
-  log_exit("exit by signal %d", signal);
+/*
+ * A peer that goes away makes write(2) fail with EPIPE instead of killing
+ * the child, which then finishes as usual. Everything else is left to the
+ * event loop in server_main(), which is set up only after become_daemon()
+ * forks, as a signalfd(2) reports to the process that registered it.
+ */
+static void install_signal_handlers(void) {
+  trap_signal(SIGPIPE, SIG_IGN);
 }
 
-static void install_signal_handlers(void) {
-  trap_signal(SIGPIPE, signal_exit);
+static void signal_exit(struct EvLoop *loop, const struct signalfd_siginfo *si, void *arg) {
+  (void)loop;
+  (void)arg;
+  log_exit("exit by signal %d", (int)si->ssi_signo);
+}
+
+/* SIGCHLD is merged while pending, so reap every child that is done */
+static void reap_children(struct EvLoop *loop, const struct signalfd_siginfo *si, void *arg) {
+  (void)loop;
+  (void)si;
+  (void)arg;
+  while (waitpid(-1, NULL, WNOHANG) > 0)
+    ;
 }
 
-static void service(FILE *in, FILE *out, char *docroot) {
+static void service(struct FioReader *in, FILE *out, char *docroot) {
   struct HTTPRequest *req;
+  long request_start, t;
 
+  TRACE_PROBE(request__start);
+  request_start = trace_begin();
+  TRACE_PROBE(read_request__start);
+  t = trace_begin();
   req = read_request(in);
+  trace_end("read_request", t);
+  TRACE_PROBE1(read_request__done, req->path);
   respond_to(req, out, docroot);
   free_request(req);
+  trace_end("request", request_start);
+  TRACE_PROBE(request__done);
 }
 
 static void free_request(struct HTTPRequest *req) {
@@ -205,11 +331,32 @@ static void upcase(char *str) {
   }
 }
 
-static void read_request_line(struct HTTPRequest *req, FILE *in) {
-  char buf[LINE_BUF_SIZE];
+/* next line as a NUL-terminated copy, or NULL at end of input */
+static char *read_line(struct FioReader *in) {
+  const unsigned char *line;
+  size_t len;
+  char *buf;
+  int ret;
+
+  ret = fio_getline(in, &line, &len);
+  if (ret < 0) {
+    log_exit("failed to read request: %s", strerror(errno));
+  }
+  if (ret == 0) {
+    return NULL;
+  }
+  buf = xmalloc(len + 1);
+  memcpy(buf, line, len);
+  buf[len] = '\0';
+  return buf;
+}
+
+static void read_request_line(struct HTTPRequest *req, struct FioReader *in) {
+  char *buf;
   char *path, *p;
 
-  if(!fgets(buf, LINE_BUF_SIZE, in)) {
+  buf = read_line(in);
+  if (!buf) {
     log_exit("no request line");
   }
   p = strchr(buf, ' ');
@@ -235,17 +382,20 @@ static void read_request_line(struct HTTPRequest *req, FILE *in) {
   }
   p += strlen("HTTP/1.");
   req->protocol_minor_version = atoi(p);
+  free(buf);
 }
 
-static struct HTTPHeaderField *read_header_field(FILE *in) {
+static struct HTTPHeaderField *read_header_field(struct FioReader *in) {
   struct HTTPHeaderField *h;
-  char buf[LINE_BUF_SIZE];
+  char *buf;
   char *p;
 
-  if (!fgets(buf, LINE_BUF_SIZE, in)) {
-    log_exit("failed to request header field: %s", strerror(errno));
+  buf = read_line(in);
+  if (!buf) {
+    log_exit("failed to request header field: unexpected end of request");
   }
   if ((buf[0] == '\n') || (strcmp(buf, "\r\n") == 0)) {
+    free(buf);
     return NULL;
   }
 
@@ -260,7 +410,8 @@ static struct HTTPHeaderField *read_header_field(FILE *in) {
 
   p += strspn(p, " \t");
   h->value = xmalloc(strlen(p) + 1);
-  strcpy(h->value, buf);
+  strcpy(h->value, p);
+  free(buf);
 
   return h;
 }
@@ -291,7 +442,7 @@ static long content_length(struct HTTPRequest *req) {
   return length;
 }
 
-static struct HTTPRequest *read_request(FILE *in) {
+static struct HTTPRequest *read_request(struct FioReader *in) {
   struct HTTPRequest *req;
   struct HTTPHeaderField *h;
 
@@ -308,7 +459,7 @@ static struct HTTPRequest *read_request(FILE *in) {
       log_exit("request body too long");
     }
     req->body = xmalloc(req->length);
-    if (fread(req->body, req->length, 1, in) < 1) {
+    if (fio_read(in, req->body, req->length) != req->length) {
       log_exit("failed to read request body");
     }
   } else {
@@ -429,22 +580,36 @@ static char *guess_content_type(struct FileInfo *info) {
 
 static void do_file_response(struct HTTPRequest *req, FILE *out, char *docroot) {
   struct FileInfo *info;
+  char *content_type;
+  long t;
 
+  TRACE_PROBE(fileinfo__start);
+  t = trace_begin();
   info = get_fileinfo(docroot, req->path);
+  trace_end("get_fileinfo", t);
+  TRACE_PROBE1(fileinfo__done, info->ok);
   if (!info->ok) {
     free_fileinfo(info);
     not_found(req, out);
     return;
   }
+  rate_charge_bytes(info->size);
   output_common_header_fields(req, out, "200 OK");
   fprintf(out, "Content-Length: %ld\r\n", info->size);
-  fprintf(out, "Content-Type: %s\r\n", guess_content_type(info));
+  TRACE_PROBE(content_type__start);
+  t = trace_begin();
+  content_type = guess_content_type(info);
+  trace_end("guess_content_type", t);
+  TRACE_PROBE(content_type__done);
+  fprintf(out, "Content-Type: %s\r\n", content_type);
   fprintf(out, "\r\n");
   if (strcmp(req->method, "HEAD") != 0) {
     int fd;
     char buf[BLOCK_BUF_SIZE];
     ssize_t n;
 
+    TRACE_PROBE1(body__start, info->size);
+    t = trace_begin();
     fd = open(info->path, O_RDONLY);
     if (fd < 0) {
       log_exit("failed to open %s: %s", info->path, strerror(errno));
@@ -464,6 +629,10 @@ static void do_file_response(struct HTTPRequest *req, FILE *out, char *docroot)
     close(fd);
   }
   fflush(out);
+  if (strcmp(req->method, "HEAD") != 0) {
+    trace_end("body", t);
+    TRACE_PROBE(body__done);
+  }
   free_fileinfo(info);
 }
 
@@ -542,30 +711,345 @@ static int listen_socket(char *port) {
   return -1; /* NOT REACH */
 }
 
+struct Server {
+  int sock;
+  char *docroot;
+};
+
+static void accept_client(struct EvLoop *loop, struct EvSource *src, uint32_t events) {
+  struct Server *srv = src->arg;
+  struct sockaddr_storage addr;
+  socklen_t addrlen  = sizeof addr;
+  int sock;
+  int pid;
+
+  (void)events;
+  sock = accept(srv->sock, (struct sockaddr*)&addr, &addrlen);
+  if (sock < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED) {
+      return;
+    }
+    log_exit("accept(2) failed: %s", strerror(errno));
+  }
+  if (!rate_admit(&addr)) {
+    /* answer without forking or touching the docroot */
+    write(sock, too_many_requests, sizeof too_many_requests - 1);
+    shutdown(sock, SHUT_WR);
+    close(sock);
+    return;
+  }
+  if (trace_fd >= 0) {
+    static unsigned long n_accepted = 0;
+
+    trace_this = (n_accepted++ % trace_sample) == 0;
+  }
+  pid = fork();
+  if (pid < 0) {
+    exit(3);
+  }
+  if (pid == 0) { /* child */
+    struct FioReader in;
+    FILE *out;
+
+    ev_forked(loop);
+    close(srv->sock);
+    out = fdopen(sock, "w");
+    if (fio_open(&in, sock) < 0) {
+      log_exit("failed to set up request buffer");
+    }
+    in.max_line = MAX_REQUEST_LINE_LENGTH;
+    service(&in, out, srv->docroot);
+    exit(0);
+  }
+  close(sock);
+}
+
+/*
+ * Connections and signals share one epoll loop (event.h): SIGCHLD reaps
+ * finished children, SIGINT and SIGTERM end the server. accept(2) is
+ * never interrupted, so there is nothing to retry.
+ */
 static void server_main(int server, char *docroot) {
-  while (1) {
-    struct sockaddr_storage addr;
-    socklen_t addrlen  = sizeof addr;
-    int sock;
-    int pid;
+  static struct EvLoop loop;
+  static struct EvSource listener;
+  static struct Server srv;
+
+  srv.sock = server;
+  srv.docroot = docroot;
+  ev_init(&loop);
+  ev_signal(&loop, SIGCHLD, reap_children, NULL);
+  ev_signal(&loop, SIGINT, signal_exit, NULL);
+  ev_signal(&loop, SIGTERM, signal_exit, NULL);
+  ev_add(&loop, &listener, server, EPOLLIN, accept_client, &srv);
+  ev_run(&loop);
+}
 
-    sock = accept(server, (struct sockaddr*)&addr, &addrlen);
-    if (sock < 0) {
-      log_exit("accept(2) failed: %s", strerror(errno));
+static void setup_rate_limit(void) {
+  void *p;
+
+  if (!ip_rate && !prefix_rate && !bandwidth) {
+    return;
+  }
+  if (ip_rate < 0 || prefix_rate < 0 || bandwidth < 0) {
+    log_exit("negative rate limit");
+  }
+  p = mmap(NULL, sizeof(struct RateEntry) * RATE_TABLE_SIZE,
+           PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    log_exit("mmap(2) failed: %s", strerror(errno));
+  }
+  rate_table = p;
+}
+
+static uint32_t rate_clock(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static uint64_t rate_hash(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  return key;
+}
+
+/* every bucket this entry's kind of key uses is full again */
+static int rate_idle(struct RateEntry *e, uint64_t key, uint32_t now) {
+  int prefix = (key >> 48) & 0xff;
+
+  if (prefix == 24 || prefix == 64) {
+    return bucket_refill(e->requests, now, prefix_rate * RATE_REQUEST_COST) >= 0;
+  }
+  return (!ip_rate || bucket_refill(e->requests, now, ip_rate * RATE_REQUEST_COST) >= 0) &&
+         (!bandwidth || bucket_refill(e->bytes, now, bandwidth) >= 0);
+}
+
+/*
+ * Find or claim the slot for key, or take over an idle one. NULL when
+ * every slot in the probe window is in use by an active client.
+ */
+static struct RateEntry *rate_entry(uint64_t key) {
+  uint64_t h = rate_hash(key);
+  uint32_t now = rate_clock();
+  struct RateEntry *idle = NULL;
+  uint64_t idle_key = 0;
+  int i;
+
+  for (i = 0; i < RATE_TABLE_PROBES; i++) {
+    struct RateEntry *e = &rate_table[(h + i) & (RATE_TABLE_SIZE - 1)];
+    uint64_t k = __atomic_load_n(&e->key, __ATOMIC_ACQUIRE);
+
+    if (k == 0) {
+      if (__atomic_compare_exchange_n(&e->key, &k, key, 0,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return e;
+      }
+    }
+    if (k == key) {
+      return e;
     }
-    pid = fork();
-    if (pid < 0) {
-      exit(3);
+    if (!idle && rate_idle(e, k, now)) {
+      idle = e;
+      idle_key = k;
     }
-    if (pid == 0) { /* child */
-      FILE *in = fdopen(sock, "r");
-      FILE *out = fdopen(sock, "w");
+  }
+  /* full buckets and fresh ones (0) are worth the same, so reset to fresh */
+  if (idle && __atomic_compare_exchange_n(&idle->key, &idle_key, key, 0,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n(&idle->requests, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&idle->bytes, 0, __ATOMIC_RELAXED);
+    return idle;
+  }
+  return NULL;
+}
 
-      service(in, out, docroot);
-      exit(0);
+/*
+ * Refill the bucket for the time elapsed since its last update and take
+ * cost tokens from it. Without allow_debt the bucket is left untouched
+ * and 0 is returned when it holds fewer than cost tokens; with allow_debt
+ * the balance may go negative, which blocks later requests until it is
+ * paid back. A negative cost with allow_debt returns tokens.
+ */
+static int bucket_take(uint64_t *bucket, uint32_t now, long per_sec, long cost, int allow_debt) {
+  uint64_t old, new;
+  int64_t burst = per_sec > INT32_MAX ? INT32_MAX : per_sec;
+  int64_t tokens;
+
+  old = __atomic_load_n(bucket, __ATOMIC_RELAXED);
+  do {
+    tokens = burst + bucket_refill(old, now, per_sec);
+    if (!allow_debt && tokens < cost) {
+      return 0;
     }
-    close(sock);
+    tokens -= cost;
+    if (tokens > burst) { /* a refund (negative cost) never overfills */
+      tokens = burst;
+    } else if (tokens < INT32_MIN) {
+      tokens = INT32_MIN;
+    }
+    new = ((uint64_t)now << 32) | (uint32_t)(int32_t)tokens;
+  } while (!__atomic_compare_exchange_n(bucket, &old, new, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return 1;
+}
+
+/*
+ * Tokens in the bucket at now, relative to a full one: 0 when full,
+ * negative by the amount still missing.
+ */
+static int64_t bucket_refill(uint64_t bucket, uint32_t now, long per_sec) {
+  int64_t burst = per_sec > INT32_MAX ? INT32_MAX : per_sec;
+  uint32_t elapsed = now - (uint32_t)(bucket >> 32);
+  int64_t tokens;
+
+  if (bucket == 0) { /* fresh slot starts full */
+    return 0;
+  }
+  tokens = (int32_t)(uint32_t)bucket;
+  if (elapsed > RATE_MAX_ELAPSED_MS) {
+    elapsed = RATE_MAX_ELAPSED_MS;
+  }
+  tokens += (int64_t)elapsed * per_sec / 1000;
+  return tokens > burst ? 0 : tokens - burst;
+}
+
+/* Key layout: family (8 bits) | prefix length (8 bits) | address (48 bits) */
+static uint64_t rate_key(struct sockaddr_storage *addr, int prefix) {
+  uint64_t bits = 0;
+
+  if (addr->ss_family == AF_INET) {
+    struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+    uint32_t a = ntohl(sin->sin_addr.s_addr);
+
+    bits = prefix ? (a & 0xffffff00) : a;
+    return (4ULL << 56) | ((uint64_t)(prefix ? 24 : 32) << 48) | bits;
+  }
+  if (addr->ss_family == AF_INET6) {
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)addr;
+    int i, n = prefix ? 8 : 16;
+
+    bits = 0xcbf29ce484222325ULL;
+    for (i = 0; i < n; i++) {
+      bits ^= sin6->sin6_addr.s6_addr[i];
+      bits *= 0x100000001b3ULL;
+    }
+    return (6ULL << 56) | ((uint64_t)(prefix ? 64 : 128) << 48) | (bits & 0xffffffffffffULL);
+  }
+  return 0;
+}
+
+/*
+ * Every slot in the probe window belongs to a client that is still
+ * spending its budget. Refuse rather than admit without a limit, and
+ * report the count at 1, 2, 4, ... refusals.
+ */
+static int rate_no_slot(void) {
+  rate_table_full++;
+  if ((rate_table_full & (rate_table_full - 1)) == 0) {
+    if (debug_mode) {
+      fprintf(stderr, "rate table full: %lu requests refused\n", rate_table_full);
+    } else {
+      syslog(LOG_WARNING, "rate table full: %lu requests refused", rate_table_full);
+    }
+  }
+  return 0;
+}
+
+static int rate_admit(struct sockaddr_storage *addr) {
+  struct RateEntry *e;
+  uint32_t now;
+  uint64_t key;
+
+  client_rate = NULL;
+  if (!rate_table) {
+    return 1;
+  }
+  now = rate_clock();
+  key = rate_key(addr, 0);
+  if (!key) {
+    return 1;
+  }
+  e = rate_entry(key);
+  if (!e) {
+    return rate_no_slot();
+  }
+  client_rate = e;
+  /* cost 0: only checks that no debt is left, nothing to give back */
+  if (bandwidth && !bucket_take(&e->bytes, now, bandwidth, 0, 0)) {
+    return 0;
+  }
+  if (ip_rate && !bucket_take(&e->requests, now, ip_rate * RATE_REQUEST_COST, RATE_REQUEST_COST, 0)) {
+    return 0;
+  }
+  if (prefix_rate) {
+    struct RateEntry *p = rate_entry(rate_key(addr, 1));
+
+    if (!p || !bucket_take(&p->requests, now, prefix_rate * RATE_REQUEST_COST, RATE_REQUEST_COST, 0)) {
+      /* refused for the prefix: give the address its token back */
+      if (ip_rate) {
+        bucket_take(&e->requests, now, ip_rate * RATE_REQUEST_COST, -RATE_REQUEST_COST, 1);
+      }
+      return p ? 0 : rate_no_slot();
+    }
+  }
+  return 1;
+}
+
+/* called in the child; client_rate was looked up by the parent before fork() */
+static void rate_charge_bytes(long size) {
+  if (!client_rate || !bandwidth) {
+    return;
+  }
+  bucket_take(&client_rate->bytes, rate_clock(), bandwidth, size, 1);
+}
+
+/*
+ * Chrome trace-event output. The file is opened with O_APPEND before any
+ * fork() and every span is emitted with a single write(2), so children
+ * never interleave partial events. The array is left unterminated, which
+ * chrome://tracing and Perfetto both accept.
+ */
+static void setup_trace(char *path) {
+  static const char header[] = "[\n";
+
+  if (trace_sample < 1) {
+    log_exit("--trace-sample must be positive");
+  }
+  trace_fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0644);
+  if (trace_fd < 0) {
+    log_exit("failed to open %s: %s", path, strerror(errno));
+  }
+  write(trace_fd, header, sizeof header - 1);
+}
+
+static long trace_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static long trace_begin(void) {
+  if (!trace_this) {
+    return 0;
+  }
+  return trace_now();
+}
+
+static void trace_end(const char *name, long start) {
+  char buf[LINE_BUF_SIZE];
+  int n;
+
+  if (!trace_this) {
+    return;
   }
+  n = snprintf(buf, sizeof buf,
+               "{\"name\":\"%s\",\"cat\":\"httpd\",\"ph\":\"X\","
+               "\"ts\":%ld,\"dur\":%ld,\"pid\":%d,\"tid\":%d},\n",
+               name, start, trace_now() - start, (int)getpid(), (int)getpid());
+  write(trace_fd, buf, n);
 }
 
 static void become_daemon(void) {
@@ -1,15 +1,510 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "walk.h"
+
+#define HEAD_SIZE (4 * 1024)
+#define BUFFER_SIZE (1024 * 1024)
+
+/* one path to a regular file; the paths of one inode end up adjacent */
+struct File {
+  char *path;
+  uint64_t size;
+  uint64_t dev;
+  uint64_t ino;
+  uint32_t mode;
+  uint32_t uid;
+  uint32_t gid;
+  uint32_t nlink;
+  uint64_t head;  /* hash of the first HEAD_SIZE bytes */
+  uint64_t full;  /* hash of the whole file */
+  long dup_of;    /* index of an identical inode's first path, or -1 */
+};
+
+static void dedup(char **dirs, int ndirs);
+
+static int opt_dry_run = 0;
+static int nthreads;
+static int errors = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct File *files = NULL;
+static size_t nfiles = 0, files_cap = 0;
+
+static struct option longopts[] = {
+  {"dedup", no_argument, NULL, 'D'},
+  {"dry-run", no_argument, NULL, 'n'},
+  {"threads", required_argument, NULL, 'j'},
+  {0, 0, 0, 0}
+};
 
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
+  int opt, opt_dedup = 0;
+
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt_long(argc, argv, "nj:", longopts, NULL)) != -1) {
+    switch (opt) {
+      case 'D':
+        opt_dedup = 1;
+        break;
+      case 'n':
+        opt_dry_run = 1;
+        break;
+      case 'j':
+        nthreads = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s src dst\n       %s --dedup [-n] [-j threads] dir...\n", argv[0], argv[0]);
+        exit(1);
+    }
+  }
+  if (opt_dedup) {
+    if (optind == argc) {
+      fprintf(stderr, "%s: no directories\n", argv[0]);
+      exit(1);
+    }
+    dedup(argv + optind, argc - optind);
+    exit(errors ? 1 : 0);
+  }
+
+  if (argc - optind != 2) {
     fprintf(stderr, "%s: wrong arguments\n", argv[0]);
     exit(1);
   }
-  if (link(argv[1], argv[2]) < 0) {
-    perror(argv[1]);
+  if (link(argv[optind], argv[optind + 1]) < 0) {
+    perror(argv[optind]);
     exit(1);
   }
   exit(0);
 }
+
+static void error(const char *path) {
+  fprintf(stderr, "%s: %s\n", path, strerror(errno));
+  __atomic_store_n(&errors, 1, __ATOMIC_RELAXED);
+}
+
+static void collect(struct Walker *w, struct WalkDir *dir, struct WalkEntry *ents, size_t n) {
+  size_t i;
+
+  (void)w;
+  pthread_mutex_lock(&lock);
+  for (i = 0; i < n; i++) {
+    struct WalkEntry *e = &ents[i];
+    struct File *f;
+    size_t dlen, nlen;
+
+    if (e->type != DT_REG || !e->stat_ok || e->st.size == 0) {
+      continue;
+    }
+    if (nfiles == files_cap) {
+      files_cap = files_cap ? files_cap * 2 : 4096;
+      files = realloc(files, sizeof(struct File) * files_cap);
+      if (!files) {
+        perror("realloc(3)");
+        exit(1);
+      }
+    }
+    f = &files[nfiles++];
+    memset(f, 0, sizeof(struct File));
+    dlen = strlen(dir->path);
+    nlen = strlen(e->name);
+    f->path = malloc(dlen + nlen + 2);
+    if (!f->path) {
+      perror("malloc(3)");
+      exit(1);
+    }
+    memcpy(f->path, dir->path, dlen);
+    f->path[dlen] = '/';
+    memcpy(f->path + dlen + 1, e->name, nlen + 1);
+    f->size = e->st.size;
+    f->dev = e->st.dev;
+    f->ino = e->st.ino;
+    f->mode = e->st.mode;
+    f->uid = e->st.uid;
+    f->gid = e->st.gid;
+    f->nlink = e->st.nlink;
+    f->dup_of = -1;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Files can only be linked together when they are on one device, and
+ * should only be when mode and owner agree too; with the size that is
+ * the candidate key. level 1 and 2 add the head and full hashes.
+ */
+static int sort_level;
+
+static int file_cmp(const void *a, const void *b) {
+  const struct File *x = a, *y = b;
+
+#define CMP(field) if (x->field != y->field) { return x->field < y->field ? -1 : 1; }
+  CMP(dev) CMP(size) CMP(mode) CMP(uid) CMP(gid)
+  if (sort_level >= 1) { CMP(head) }
+  if (sort_level >= 2) { CMP(full) }
+  CMP(ino)
+#undef CMP
+  return strcmp(x->path, y->path);
+}
+
+static int same_key(const struct File *x, const struct File *y) {
+  return x->dev == y->dev && x->size == y->size && x->mode == y->mode && x->uid == y->uid &&
+         x->gid == y->gid && (sort_level < 1 || x->head == y->head) &&
+         (sort_level < 2 || x->full == y->full);
+}
+
+/* 8 bytes at a time through a multiply and xor-shift; not cryptographic */
+static uint64_t hash_block(uint64_t h, const unsigned char *p, size_t n) {
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    uint64_t v;
+
+    memcpy(&v, p + i, 8);
+    h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+  }
+  for (; i < n; i++) {
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static int hash_file(struct File *f, int full, unsigned char *buf) {
+  uint64_t h = f->size;
+  int fd = open(f->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+  if (fd < 0) {
+    error(f->path);
+    return -1;
+  }
+  if (full) {
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  }
+  while (1) {
+    ssize_t n = read(fd, buf, full ? BUFFER_SIZE : HEAD_SIZE);
+
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error(f->path);
+      close(fd);
+      return -1;
+    }
+    if (n == 0) {
+      break;
+    }
+    h = hash_block(h, buf, n);
+    if (!full) {
+      break;
+    }
+  }
+  close(fd);
+  if (full) {
+    f->full = h;
+  } else {
+    f->head = h;
+  }
+  return 0;
+}
+
+static int files_equal(const char *a, const char *b, unsigned char *buf) {
+  int fa = open(a, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  int fb = open(b, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  int equal = 0;
+
+  if (fa < 0 || fb < 0) {
+    error(fa < 0 ? a : b);
+  } else {
+    while (1) {
+      ssize_t na = read(fa, buf, BUFFER_SIZE / 2), nb, got;
+
+      if (na < 0) {
+        error(a);
+        break;
+      }
+      for (got = 0; got < na; got += nb) {
+        nb = read(fb, buf + BUFFER_SIZE / 2 + got, na - got);
+        if (nb <= 0) {
+          break;
+        }
+      }
+      if (got != na || memcmp(buf, buf + BUFFER_SIZE / 2, na) != 0) {
+        break;
+      }
+      if (na == 0) {
+        equal = 1;
+        break;
+      }
+    }
+  }
+  if (fa >= 0) {
+    close(fa);
+  }
+  if (fb >= 0) {
+    close(fb);
+  }
+  return equal;
+}
+
+/*
+ * The work of one pass: a list of file indices (inode leaders) to hash,
+ * or of group starts to verify, shared by the threads in order.
+ */
+enum { PASS_HEAD, PASS_FULL, PASS_VERIFY };
+
+static int pass;
+static size_t *work;
+static size_t nwork, next_work;
+
+/*
+ * Every inode in the group from start that is byte-identical to the
+ * group's first is marked as its duplicate. A hash collision just
+ * fails the comparison.
+ */
+static void verify_group(size_t start, unsigned char *buf) {
+  size_t i;
+
+  for (i = start + 1; i < nfiles && same_key(&files[i], &files[start]); i++) {
+    if (files[i].ino != files[i - 1].ino && files_equal(files[start].path, files[i].path, buf)) {
+      files[i].dup_of = start;
+    }
+  }
+}
+
+static void *worker(void *arg) {
+  unsigned char *buf = malloc(BUFFER_SIZE);
+
+  (void)arg;
+  if (!buf) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  while (1) {
+    size_t i;
+
+    pthread_mutex_lock(&lock);
+    i = next_work++;
+    pthread_mutex_unlock(&lock);
+    if (i >= nwork) {
+      break;
+    }
+    if (pass == PASS_VERIFY) {
+      verify_group(work[i], buf);
+    } else {
+      hash_file(&files[work[i]], pass == PASS_FULL, buf);
+    }
+  }
+  free(buf);
+  return NULL;
+}
+
+static void run_pass(int p) {
+  pthread_t threads[WALK_MAX_THREADS];
+  int i, nt = nwork < (size_t)nthreads ? (int)nwork : nthreads;
+
+  pass = p;
+  next_work = 0;
+  if (nt <= 1) {
+    worker(NULL);
+    return;
+  }
+  for (i = 0; i < nt; i++) {
+    if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+      fputs("pthread_create(3) failed\n", stderr);
+      exit(1);
+    }
+  }
+  for (i = 0; i < nt; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+/*
+ * Collect the work for the next pass: with the files sorted at the
+ * current level, every group holding two or more inodes. For a hash
+ * pass that is each inode's first path, for the verify pass each group.
+ */
+static void plan(int p) {
+  size_t i, j;
+
+  qsort(files, nfiles, sizeof(struct File), file_cmp);
+  nwork = 0;
+  for (i = 0; i < nfiles; i = j) {
+    size_t inodes = 1;
+
+    for (j = i + 1; j < nfiles && same_key(&files[j], &files[i]); j++) {
+      inodes += files[j].ino != files[j - 1].ino;
+    }
+    if (inodes < 2 || (p == PASS_FULL && files[i].size <= HEAD_SIZE)) {
+      continue;
+    }
+    if (p == PASS_VERIFY) {
+      work[nwork++] = i;
+      continue;
+    }
+    for (; i < j; i++) {
+      if (i == 0 || files[i].ino != files[i - 1].ino || files[i].dev != files[i - 1].dev) {
+        work[nwork++] = i;
+      }
+    }
+  }
+}
+
+/* copy a hash from each inode's first path to its other paths */
+static void spread_hashes(void) {
+  size_t i;
+
+  for (i = 1; i < nfiles; i++) {
+    if (files[i].ino == files[i - 1].ino && files[i].dev == files[i - 1].dev) {
+      files[i].head = files[i - 1].head;
+      files[i].full = files[i - 1].full;
+    }
+    if (files[i].size <= HEAD_SIZE) {
+      files[i].full = files[i].head;
+    }
+  }
+  if (nfiles > 0 && files[0].size <= HEAD_SIZE) {
+    files[0].full = files[0].head;
+  }
+}
+
+/*
+ * Replace path with a hard link to target: link under a temporary name
+ * in the same directory, then rename(2) over it, so path never stops
+ * existing. Returns 1 when path already is target's inode; rename(2)
+ * would do nothing then and leave the temporary link behind.
+ */
+static int replace_with_link(const char *target, const char *path) {
+  size_t len = strlen(path);
+  char *tmp;
+  const char *slash = strrchr(path, '/');
+  struct stat ts, ps;
+  int i, ret = -1;
+
+  if (stat(target, &ts) == 0 && lstat(path, &ps) == 0 &&
+      ts.st_dev == ps.st_dev && ts.st_ino == ps.st_ino) {
+    return 1;
+  }
+  tmp = malloc(len + 32);
+  if (!tmp) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  for (i = 0; i < 100; i++) {
+    int dlen = slash ? (int)(slash - path + 1) : 0;
+
+    snprintf(tmp, len + 32, "%.*s.ln-dedup.%d.%d", dlen, path, (int)getpid(), i);
+    if (linkat(AT_FDCWD, target, AT_FDCWD, tmp, 0) == 0) {
+      ret = 0;
+      break;
+    }
+    if (errno != EEXIST) {
+      break;
+    }
+  }
+  if (ret < 0) {
+    error(path);
+  } else if (renameat(AT_FDCWD, tmp, AT_FDCWD, path) < 0) {
+    error(path);
+    unlink(tmp);
+    ret = -1;
+  } else if (unlink(tmp) == 0) {
+    ret = 1; /* path turned into target's inode meanwhile; rename was a no-op */
+  }
+  free(tmp);
+  return ret;
+}
+
+/*
+ * --dedup: walk the directories (walk.h), group regular files by device,
+ * size, mode and owner, then narrow the groups by a hash of the first
+ * block and then of the whole file, both on a pool of threads. Only the
+ * survivors are compared byte for byte; every duplicate inode then has
+ * all of its paths replaced by links to the group's first file. With -n
+ * the links are only reported.
+ */
+static void dedup(char **dirs, int ndirs) {
+  static struct WalkOps ops;
+  uint64_t reclaimed = 0;
+  unsigned long linked = 0;
+  size_t i, j;
+
+  ops.stat_mask = STATX_SIZE | STATX_INO | STATX_NLINK | STATX_MODE | STATX_UID | STATX_GID;
+  ops.dir = collect;
+  if (walk_run(&ops, dirs, ndirs, nthreads)) {
+    errors = 1;
+  }
+  work = malloc(sizeof(size_t) * (nfiles + 1));
+  if (!work) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  /* overlapping roots (e and e/sub) collect a path twice; keep one */
+  sort_level = 0;
+  qsort(files, nfiles, sizeof(struct File), file_cmp);
+  for (i = j = 0; i < nfiles; i++) {
+    if (j > 0 && files[i].ino == files[j - 1].ino && files[i].dev == files[j - 1].dev &&
+        strcmp(files[i].path, files[j - 1].path) == 0) {
+      free(files[i].path);
+      continue;
+    }
+    files[j++] = files[i];
+  }
+  nfiles = j;
+
+  /* each plan() sorts, which keeps the paths of an inode adjacent */
+  plan(PASS_HEAD);
+  run_pass(PASS_HEAD);
+  spread_hashes();
+  sort_level = 1;
+  plan(PASS_FULL);
+  run_pass(PASS_FULL);
+  spread_hashes();
+  sort_level = 2;
+  plan(PASS_VERIFY);
+  run_pass(PASS_VERIFY);
+
+  for (i = 0; i < nfiles; i = j) {
+    long target = files[i].dup_of;
+    unsigned long paths = 1;
+
+    for (j = i + 1; j < nfiles && files[j].ino == files[i].ino && files[j].dev == files[i].dev; j++) {
+      paths++;
+    }
+    if (target < 0) {
+      continue;
+    }
+    /* the blocks are only freed when every link to the inode was replaced;
+       a path reached through differently spelled roots may count twice */
+    if (paths >= files[i].nlink) {
+      reclaimed += files[i].size;
+    }
+    for (; i < j; i++) {
+      if (opt_dry_run) {
+        printf("%s\t%s\n", files[i].path, files[target].path);
+        linked++;
+      } else if (replace_with_link(files[target].path, files[i].path) == 0) {
+        linked++;
+      }
+    }
+  }
+  printf("%s %lu files, %llu bytes %s\n", opt_dry_run ? "would link" : "linked", linked,
+         (unsigned long long)reclaimed, opt_dry_run ? "reclaimable" : "reclaimed");
+
+  for (i = 0; i < nfiles; i++) {
+    free(files[i].path);
+  }
+  free(files);
+  free(work);
+}
@@ -1,35 +1,814 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pwd.h>
+#include <grp.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <dirent.h>
+#include <getopt.h>
+#include "fastio.h"
+#include "walk.h"
 
-static void do_ls(char *path);
+#define DIRENT_BUF_SIZE (1024 * 1024)
+#define MAX_THREADS 64
+#define STAT_BATCH 256
+#define PARALLEL_STAT_MIN 1024 /* fewer entries are stat'ed inline */
+#define ID_CACHE_SIZE 256      /* must be a power of two */
+
+struct Entry {
+  char *name;
+  unsigned char type;
+};
+
+/* what -l prints, filled in by statx(2) */
+struct Meta {
+  int ok;
+  uint16_t mode;
+  uint32_t nlink;
+  uint32_t uid;
+  uint32_t gid;
+  uint64_t size;
+  int64_t mtime;
+  char *link;
+};
+
+/*
+ * Sorting moves these 16-byte keys rather than the entries; the name
+ * prefix decides most comparisons without touching the names at all.
+ */
+struct SortKey {
+  uint64_t prefix;
+  size_t index;
+};
+
+struct Listing {
+  int dirfd;
+  struct Entry *ents;
+  size_t n;
+  size_t cap;
+  char *names;
+  size_t names_len;
+  size_t names_cap;
+  struct Meta *meta;
+  size_t *order;
+};
+
+/* output being collected for one directory of a -R listing */
+struct Text {
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+/*
+ * One per directory in -R and --du mode. The walker visits directories
+ * in any order on any thread; the nodes keep the sorted tree so the
+ * output can be printed in order once the walk is over.
+ */
+struct Node {
+  struct Node *parent;
+  struct Node **children;
+  size_t nchildren;
+  struct Text text;
+  char *path;
+  uint64_t blocks;  /* --du: 512-byte blocks below and including this directory */
+  uint64_t entries; /* --du: entries below this directory */
+};
+
+static void do_ls(char *path, int header);
+static void do_tree(char **paths, int npaths);
+static int read_dir(int fd, const char *path, struct Listing *l);
+static void stat_entries(struct Listing *l);
+static void sort_entries(struct Listing *l);
+static void print_listing(struct Listing *l, struct Text *t);
+static void free_listing(struct Listing *l);
+
+static int opt_all = 0;
+static int opt_long = 0;
+static int opt_classify = 0;
+static int opt_unsorted = 0;
+static int opt_recursive = 0;
+static int opt_du = 0;
+static int nthreads = 1;
+static struct FioWriter out;
+
+static struct option longopts[] = {
+  {"du", no_argument, NULL, 'D'},
+  {0, 0, 0, 0}
+};
 
 int main(int argc, char *argv[]) {
-  int i;
+  int opt, i;
 
-  if (argc < 2) {
+  while ((opt = getopt_long(argc, argv, "alFRU", longopts, NULL)) != -1) {
+    switch (opt) {
+      case 'a':
+        opt_all = 1;
+        break;
+      case 'l':
+        opt_long = 1;
+        break;
+      case 'F':
+        opt_classify = 1;
+        break;
+      case 'U':
+        opt_unsorted = 1;
+        break;
+      case 'R':
+        opt_recursive = 1;
+        break;
+      case 'D':
+        opt_du = 1;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-alFRU] [--du] <path>...\n", argv[0]);
+        exit(1);
+    }
+  }
+  if (optind == argc) {
     fprintf(stderr, "%s: no arguments\n", argv[0]);
     exit(1);
   }
-  for (i = 1; i < argc; i++) {
-    do_ls(argv[i]);
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  if (nthreads > MAX_THREADS) {
+    nthreads = MAX_THREADS;
+  }
+  if (fio_writer_open(&out, STDOUT_FILENO) < 0) {
+    perror("stdout");
+    exit(1);
+  }
+  if (opt_recursive || opt_du) {
+    do_tree(argv + optind, argc - optind);
+  } else {
+    for (i = optind; i < argc; i++) {
+      if (i > optind) {
+        fio_write(&out, "\n", 1);
+      }
+      do_ls(argv[i], argc - optind > 1);
+    }
+  }
+  if (fio_writer_close(&out) < 0) {
+    exit(1);
   }
   exit(0);
 }
 
-static void do_ls(char *path) {
-  DIR *d;
-  struct dirent *ent;
+static void do_ls(char *path, int header) {
+  struct Listing l;
+  int fd;
 
-  d = opendir(path);
-  if (!d) {
+  memset(&l, 0, sizeof l);
+  fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0 && errno == ENOTDIR) {
+    /* a plain file lists as itself */
+    l.dirfd = AT_FDCWD;
+    l.ents = malloc(sizeof(struct Entry));
+    if (!l.ents) {
+      perror("malloc(3)");
+      exit(1);
+    }
+    l.ents[0].name = path;
+    l.ents[0].type = DT_UNKNOWN;
+    l.n = 1;
+  } else if (fd < 0) {
     perror(path);
     exit(1);
+  } else {
+    l.dirfd = fd;
+    if (read_dir(fd, path, &l) < 0) {
+      exit(1);
+    }
+    if (header) {
+      fio_write(&out, path, strlen(path));
+      fio_write(&out, ":\n", 2);
+    }
+  }
+  if (opt_long) {
+    stat_entries(&l);
+  }
+  sort_entries(&l);
+  print_listing(&l, NULL);
+  if (l.names == NULL) {
+    l.ents[0].name = NULL; /* points into argv */
+  }
+  free_listing(&l);
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+/* all entries in one pass of getdents64(2) over a large buffer */
+static int read_dir(int fd, const char *path, struct Listing *l) {
+  static char dirent_buf[DIRENT_BUF_SIZE];
+  size_t i;
+
+  while (1) {
+    ssize_t nread = getdents64(fd, dirent_buf, sizeof dirent_buf);
+    ssize_t off;
+
+    if (nread < 0) {
+      perror(path);
+      return -1;
+    }
+    if (nread == 0) {
+      break;
+    }
+    for (off = 0; off < nread; ) {
+      struct dirent64 *d = (struct dirent64 *)(dirent_buf + off);
+      size_t len = strlen(d->d_name) + 1;
+
+      off += d->d_reclen;
+      if (!opt_all && d->d_name[0] == '.') {
+        continue;
+      }
+      if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 64;
+        l->ents = realloc(l->ents, sizeof(struct Entry) * l->cap);
+      }
+      if (l->names_len + len > l->names_cap) {
+        l->names_cap = l->names_cap ? l->names_cap * 2 : 4096;
+        while (l->names_len + len > l->names_cap) {
+          l->names_cap *= 2;
+        }
+        l->names = realloc(l->names, l->names_cap);
+      }
+      if (!l->ents || !l->names) {
+        perror("realloc(3)");
+        exit(1);
+      }
+      memcpy(l->names + l->names_len, d->d_name, len);
+      l->ents[l->n].name = (char *)l->names_len; /* rebased below, names may move */
+      l->ents[l->n].type = d->d_type;
+      l->names_len += len;
+      l->n++;
+    }
+  }
+  for (i = 0; i < l->n; i++) {
+    l->ents[i].name = l->names + (size_t)l->ents[i].name;
+  }
+  return 0;
+}
+
+static void stat_one(struct Listing *l, size_t i) {
+  struct Meta *m = &l->meta[i];
+  struct statx stx;
+
+  if (statx(l->dirfd, l->ents[i].name, AT_SYMLINK_NOFOLLOW,
+            STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID |
+            STATX_SIZE | STATX_MTIME, &stx) < 0) {
+    m->ok = 0;
+    return;
+  }
+  m->ok = 1;
+  m->mode = stx.stx_mode;
+  m->nlink = stx.stx_nlink;
+  m->uid = stx.stx_uid;
+  m->gid = stx.stx_gid;
+  m->size = stx.stx_size;
+  m->mtime = stx.stx_mtime.tv_sec;
+  m->link = NULL;
+  if (S_ISLNK(m->mode)) {
+    char buf[PATH_MAX];
+    ssize_t n = readlinkat(l->dirfd, l->ents[i].name, buf, sizeof buf - 1);
+
+    if (n >= 0) {
+      buf[n] = '\0';
+      m->link = strdup(buf);
+    }
+  }
+}
+
+struct StatPool {
+  struct Listing *l;
+  size_t next;
+  pthread_mutex_t lock;
+};
+
+static void *stat_worker(void *arg) {
+  struct StatPool *pool = arg;
+
+  while (1) {
+    size_t start, end, i;
+
+    pthread_mutex_lock(&pool->lock);
+    start = pool->next;
+    pool->next += STAT_BATCH;
+    pthread_mutex_unlock(&pool->lock);
+    if (start >= pool->l->n) {
+      return NULL;
+    }
+    end = start + STAT_BATCH < pool->l->n ? start + STAT_BATCH : pool->l->n;
+    for (i = start; i < end; i++) {
+      stat_one(pool->l, i);
+    }
+  }
+}
+
+/*
+ * statx(2) asks only for the fields -l prints. Big directories are
+ * handed out to a thread pool in batches, so the metadata lookups of
+ * different inodes overlap instead of queueing one after another.
+ */
+static void stat_entries(struct Listing *l) {
+  pthread_t threads[MAX_THREADS];
+  struct StatPool pool;
+  int n, i;
+
+  l->meta = calloc(l->n + 1, sizeof(struct Meta));
+  if (!l->meta) {
+    perror("calloc(3)");
+    exit(1);
+  }
+  if (l->n < PARALLEL_STAT_MIN || nthreads == 1) {
+    size_t j;
+
+    for (j = 0; j < l->n; j++) {
+      stat_one(l, j);
+    }
+    return;
+  }
+  pool.l = l;
+  pool.next = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+  n = nthreads;
+  for (i = 0; i < n; i++) {
+    if (pthread_create(&threads[i], NULL, stat_worker, &pool) != 0) {
+      fputs("pthread_create(3) failed\n", stderr);
+      exit(1);
+    }
+  }
+  for (i = 0; i < n; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&pool.lock);
+}
+
+static uint64_t name_prefix(const char *name) {
+  uint64_t key = 0;
+  int i;
+
+  /* big-endian, so integer order is byte order; the NUL pads short names */
+  for (i = 0; i < 8 && name[i]; i++) {
+    key |= (uint64_t)(unsigned char)name[i] << (56 - 8 * i);
+  }
+  return key;
+}
+
+static int compare_key(const void *a, const void *b, void *ents) {
+  const struct SortKey *x = a, *y = b;
+
+  if (x->prefix != y->prefix) {
+    return x->prefix < y->prefix ? -1 : 1;
+  }
+  return strcmp(((struct Entry *)ents)[x->index].name, ((struct Entry *)ents)[y->index].name);
+}
+
+static void sort_entries(struct Listing *l) {
+  struct SortKey *keys;
+  size_t i;
+
+  l->order = malloc(sizeof(size_t) * (l->n + 1));
+  if (!l->order) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  if (opt_unsorted) {
+    for (i = 0; i < l->n; i++) {
+      l->order[i] = i;
+    }
+    return;
+  }
+  keys = malloc(sizeof(struct SortKey) * (l->n + 1));
+  if (!keys) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  for (i = 0; i < l->n; i++) {
+    keys[i].prefix = name_prefix(l->ents[i].name);
+    keys[i].index = i;
+  }
+  qsort_r(keys, l->n, sizeof(struct SortKey), compare_key, l->ents);
+  for (i = 0; i < l->n; i++) {
+    l->order[i] = keys[i].index;
+  }
+  free(keys);
+}
+
+struct IdName {
+  int used;
+  uint32_t id;
+  char name[64];
+};
+
+/* getpwuid(3)/getgrgid(3) once per distinct id; -R calls this from workers */
+static const char *id_name(uint32_t id, int group) {
+  static struct IdName cache[2][ID_CACHE_SIZE];
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  struct IdName *slot;
+  uint32_t h;
+
+  pthread_mutex_lock(&lock);
+  for (h = id * 2654435761u; ; h++) {
+    slot = &cache[group][h & (ID_CACHE_SIZE - 1)];
+    if (!slot->used || slot->id == id) {
+      break;
+    }
+  }
+  if (!slot->used) {
+    struct passwd *pw;
+    struct group *gr;
+
+    slot->used = 1;
+    slot->id = id;
+    if (!group && (pw = getpwuid(id)) != NULL) {
+      snprintf(slot->name, sizeof slot->name, "%s", pw->pw_name);
+    } else if (group && (gr = getgrgid(id)) != NULL) {
+      snprintf(slot->name, sizeof slot->name, "%s", gr->gr_name);
+    } else {
+      snprintf(slot->name, sizeof slot->name, "%u", id);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return slot->name;
+}
+
+static void mode_string(uint16_t mode, char *s) {
+  static const char rwx[] = "rwxrwxrwx";
+  int i;
+
+  s[0] = S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : S_ISCHR(mode) ? 'c' :
+         S_ISBLK(mode) ? 'b' : S_ISFIFO(mode) ? 'p' : S_ISSOCK(mode) ? 's' : '-';
+  for (i = 0; i < 9; i++) {
+    s[i + 1] = mode & (0400 >> i) ? rwx[i] : '-';
+  }
+  if (mode & S_ISUID) { s[3] = mode & S_IXUSR ? 's' : 'S'; }
+  if (mode & S_ISGID) { s[6] = mode & S_IXGRP ? 's' : 'S'; }
+  if (mode & S_ISVTX) { s[9] = mode & S_IXOTH ? 't' : 'T'; }
+  s[10] = '\0';
+}
+
+/* -F suffix from d_type; only entries the kernel did not type get a stat */
+static char classify(struct Listing *l, size_t i) {
+  unsigned char type = l->ents[i].type;
+
+  if (l->meta && l->meta[i].ok) {
+    type = IFTODT(l->meta[i].mode);
+  } else if (type == DT_UNKNOWN) {
+    struct stat st;
+
+    if (fstatat(l->dirfd, l->ents[i].name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+      return 0;
+    }
+    type = IFTODT(st.st_mode);
+  }
+  switch (type) {
+    case DT_DIR:  return '/';
+    case DT_LNK:  return '@';
+    case DT_FIFO: return '|';
+    case DT_SOCK: return '=';
+    default:      return 0;
+  }
+}
+
+static int digits(uint64_t n) {
+  int d = 1;
+
+  while (n >= 10) {
+    n /= 10;
+    d++;
+  }
+  return d;
+}
+
+static void put(struct Text *t, const void *p, size_t n) {
+  if (!t) {
+    if (fio_write(&out, p, n) < 0) {
+      exit(1);
+    }
+    return;
+  }
+  if (t->len + n > t->cap) {
+    t->cap = t->cap ? t->cap * 2 : 4096;
+    while (t->len + n > t->cap) {
+      t->cap *= 2;
+    }
+    t->buf = realloc(t->buf, t->cap);
+    if (!t->buf) {
+      perror("realloc(3)");
+      exit(1);
+    }
+  }
+  memcpy(t->buf + t->len, p, n);
+  t->len += n;
+}
+
+static void print_listing(struct Listing *l, struct Text *t) {
+  int w_nlink = 1, w_user = 1, w_group = 1, w_size = 1;
+  time_t now = time(NULL);
+  size_t k;
+
+  if (opt_long) {
+    for (k = 0; k < l->n; k++) {
+      struct Meta *m = &l->meta[k];
+      int w;
+
+      if (!m->ok) {
+        continue;
+      }
+      if ((w = digits(m->nlink)) > w_nlink) { w_nlink = w; }
+      if ((w = digits(m->size)) > w_size) { w_size = w; }
+      if ((w = strlen(id_name(m->uid, 0))) > w_user) { w_user = w; }
+      if ((w = strlen(id_name(m->gid, 1))) > w_group) { w_group = w; }
+    }
+  }
+  for (k = 0; k < l->n; k++) {
+    size_t i = l->order[k];
+    const char *name = l->ents[i].name;
+    char suffix = opt_classify ? classify(l, i) : 0;
+
+    if (opt_long) {
+      struct Meta *m = &l->meta[i];
+      char line[256], mode[11], date[32];
+      time_t mtime;
+      struct tm tm;
+      int n;
+
+      if (!m->ok) {
+        fprintf(stderr, "%s: cannot stat\n", name);
+        continue;
+      }
+      mode_string(m->mode, mode);
+      mtime = m->mtime;
+      localtime_r(&mtime, &tm);
+      /* like ls(1): the year replaces the time for files older than six months */
+      if (now - mtime > 182 * 24 * 3600 || mtime > now) {
+        strftime(date, sizeof date, "%b %e  %Y", &tm);
+      } else {
+        strftime(date, sizeof date, "%b %e %H:%M", &tm);
+      }
+      n = snprintf(line, sizeof line, "%s %*u %-*s %-*s %*llu %s ",
+                   mode, w_nlink, m->nlink, w_user, id_name(m->uid, 0),
+                   w_group, id_name(m->gid, 1), w_size, (unsigned long long)m->size, date);
+      put(t, line, n < (int)sizeof line ? n : (int)sizeof line - 1);
+    }
+    put(t, name, strlen(name));
+    if (suffix) {
+      put(t, &suffix, 1);
+    }
+    if (opt_long && l->meta[i].link) {
+      put(t, " -> ", 4);
+      put(t, l->meta[i].link, strlen(l->meta[i].link));
+    }
+    put(t, "\n", 1);
+  }
+}
+
+static void free_listing(struct Listing *l) {
+  size_t i;
+
+  if (l->meta) {
+    for (i = 0; i < l->n; i++) {
+      free(l->meta[i].link);
+    }
+  }
+  free(l->meta);
+  free(l->order);
+  free(l->ents);
+  free(l->names);
+}
+
+static struct Node *new_node(struct Node *parent, const char *path) {
+  struct Node *node = calloc(1, sizeof(struct Node));
+
+  if (!node || (opt_du && !(node->path = strdup(path)))) {
+    perror("calloc(3)");
+    exit(1);
+  }
+  node->parent = parent;
+  return node;
+}
+
+static struct Node **root_nodes;
+
+/*
+ * Runs on a walker thread for every directory. -R renders the listing
+ * into the node's text right away; --du adds up the entries and their
+ * blocks, counting a file with several links only the first time its
+ * (dev, ino) is seen.
+ */
+static void tree_dir(struct Walker *w, struct WalkDir *dir, struct WalkEntry *ents, size_t n) {
+  struct Node *node = dir->data;
+  struct Listing l;
+  size_t *src;
+  size_t i, k;
+
+  if (!node) {
+    struct stat st;
+
+    node = dir->data = root_nodes[dir->root] = new_node(NULL, dir->path);
+    if (opt_du && fstat(dir->fd, &st) == 0) {
+      node->blocks = st.st_blocks;
+    }
   }
+  if (opt_du) {
+    for (i = 0; i < n; i++) {
+      struct WalkEntry *e = &ents[i];
 
-  while (ent = readdir(d)) {
-    printf("%s\n", ent->d_name);
+      node->entries++;
+      if (!e->stat_ok || e->sub) {
+        continue;
+      }
+      if (e->st.nlink > 1 && walk_seen(w, e->st.dev, e->st.ino)) {
+        continue;
+      }
+      node->blocks += e->st.blocks;
+    }
+  }
+
+  memset(&l, 0, sizeof l);
+  l.dirfd = dir->fd;
+  l.ents = malloc(sizeof(struct Entry) * (n + 1));
+  src = malloc(sizeof(size_t) * (n + 1)); /* listing index -> ents index */
+  if (opt_long) {
+    l.meta = calloc(n + 1, sizeof(struct Meta));
+  }
+  if (!l.ents || !src || (opt_long && !l.meta)) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  for (i = 0; i < n; i++) {
+    if (!opt_all && ents[i].name[0] == '.') {
+      if (!opt_du) {
+        ents[i].descend = 0; /* like ls -R, hidden directories stay closed */
+      }
+      continue;
+    }
+    src[l.n] = i;
+    l.ents[l.n].name = (char *)ents[i].name;
+    l.ents[l.n].type = ents[i].type;
+    if (opt_long && ents[i].stat_ok) {
+      struct Meta *m = &l.meta[l.n];
+      const struct WalkStat *st = &ents[i].st;
+
+      m->ok = 1;
+      m->mode = st->mode;
+      m->nlink = st->nlink;
+      m->uid = st->uid;
+      m->gid = st->gid;
+      m->size = st->size;
+      m->mtime = st->mtime;
+      if (S_ISLNK(st->mode)) {
+        char buf[PATH_MAX];
+        ssize_t len = readlinkat(dir->fd, ents[i].name, buf, sizeof buf - 1);
+
+        if (len >= 0) {
+          buf[len] = '\0';
+          m->link = strdup(buf);
+        }
+      }
+    }
+    l.n++;
+  }
+  sort_entries(&l);
+  if (opt_recursive) {
+    put(&node->text, dir->path, strlen(dir->path));
+    put(&node->text, ":\n", 2);
+    print_listing(&l, &node->text);
+  }
+
+  /* subdirectories in listing order, then the hidden ones --du walks */
+  node->children = malloc(sizeof(struct Node *) * (n + 1));
+  if (!node->children) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  for (k = 0; k <= l.n; k++) {
+    for (i = k < l.n ? src[l.order[k]] : 0; i < n; i++) {
+      if (ents[i].sub && ents[i].descend && !ents[i].sub->data) {
+        struct Node *child = new_node(node, ents[i].sub->path);
+
+        if (opt_du && ents[i].stat_ok) {
+          child->blocks = ents[i].st.blocks;
+        }
+        ents[i].sub->data = child;
+        node->children[node->nchildren++] = child;
+      }
+      if (k < l.n) {
+        break;
+      }
+    }
+  }
+  free(src);
+  free_listing(&l);
+}
+
+/* post-order: fold a finished directory's totals into its parent */
+static void tree_leave(struct Walker *w, struct WalkDir *dir) {
+  struct Node *node = dir->data;
+
+  (void)w;
+  if (node && node->parent) {
+    __atomic_add_fetch(&node->parent->blocks, node->blocks, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&node->parent->entries, node->entries, __ATOMIC_RELAXED);
+  }
+}
+
+static void print_tree(struct Node *node, int *first) {
+  size_t i;
+
+  if (opt_recursive) {
+    if (!*first) {
+      fio_write(&out, "\n", 1);
+    }
+    *first = 0;
+    fio_write(&out, node->text.buf, node->text.len);
+    free(node->text.buf);
+  }
+  for (i = 0; i < node->nchildren; i++) {
+    print_tree(node->children[i], first);
+  }
+  if (opt_du) {
+    char line[64];
+    int n = snprintf(line, sizeof line, "%llu\t%llu\t",
+                     (unsigned long long)(node->blocks / 2), (unsigned long long)node->entries);
+
+    fio_write(&out, line, n);
+    fio_write(&out, node->path, strlen(node->path));
+    fio_write(&out, "\n", 1);
+    free(node->path);
+  }
+  free(node->children);
+  free(node);
+}
+
+/*
+ * -R and --du. Directories are read by the parallel walker (walk.h);
+ * plain files among the arguments are listed up front. --du prints, in
+ * post-order like du(1), the KiB allocated and the number of entries
+ * below each directory.
+ */
+static void do_tree(char **paths, int npaths) {
+  static struct WalkOps ops;
+  char **dirs;
+  int ndirs = 0, i, first = 1, errors;
+
+  dirs = malloc(sizeof(char *) * npaths);
+  root_nodes = calloc(npaths, sizeof(struct Node *));
+  if (!dirs || !root_nodes) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  for (i = 0; i < npaths; i++) {
+    struct stat st;
+
+    if (stat(paths[i], &st) < 0) {
+      perror(paths[i]);
+      exit(1);
+    }
+    if (S_ISDIR(st.st_mode)) {
+      dirs[ndirs++] = paths[i];
+    } else if (opt_du) {
+      char line[64];
+      int n = snprintf(line, sizeof line, "%llu\t0\t", (unsigned long long)st.st_blocks / 2);
+
+      fio_write(&out, line, n);
+      fio_write(&out, paths[i], strlen(paths[i]));
+      fio_write(&out, "\n", 1);
+    } else {
+      do_ls(paths[i], 0);
+      first = 0;
+    }
+  }
+
+  ops.dir = tree_dir;
+  ops.leave = tree_leave;
+  if (opt_long) {
+    ops.stat_mask |= STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_SIZE | STATX_MTIME;
+  }
+  if (opt_du) {
+    ops.stat_mask |= STATX_NLINK | STATX_INO | STATX_BLOCKS;
+  }
+  errors = walk_run(&ops, dirs, ndirs, nthreads);
+  for (i = 0; i < ndirs; i++) {
+    if (root_nodes[i]) {
+      print_tree(root_nodes[i], &first);
+    }
+  }
+  free(root_nodes);
+  free(dirs);
+  if (errors) {
+    fio_writer_close(&out);
+    exit(1);
   }
-  closedir(d);
 }
@@ -1,20 +1,476 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/stat.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "fastio.h"
+
+#define MAX_THREADS 64
+#define NONE UINT32_MAX
+
+/*
+ * One path component in the trie of everything requested. Children are
+ * a singly linked list; (parent, name) pairs are found through a hash
+ * table, so each directory is created once however many paths share it.
+ */
+struct Node {
+  uint32_t parent;
+  uint32_t first_child;
+  uint32_t next_sibling;
+  uint32_t name;    /* offset into names */
+  uint32_t hash;
+  int requested;    /* named in full by an argument or manifest line */
+  int fd;           /* opened by the parent, closed once the children exist */
+};
+
+static void do_plain(char **paths, int n);
+static void add_path(const char *path, size_t len);
+static void create_all(void);
+
+static int opt_parents = 0;
+static int opt_mode_set = 0;
+static mode_t opt_mode = 0777;
+static mode_t umask_bits;
+static mode_t parent_mode; /* for directories created along the way, as u+wx */
+static int nthreads;
+static int errors = 0;
+
+static struct Node *nodes = NULL;
+static uint32_t nnodes = 0, nodes_cap = 0;
+static char *names = NULL;
+static size_t names_len = 0, names_cap = 0;
+static uint32_t *table = NULL; /* node indices, NONE when free */
+static size_t table_cap = 0;
+
+static struct option longopts[] = {
+  {"parents", no_argument, NULL, 'p'},
+  {"mode", required_argument, NULL, 'm'},
+  {"from-file", required_argument, NULL, 'F'},
+  {"null", no_argument, NULL, '0'},
+  {"threads", required_argument, NULL, 'j'},
+  {0, 0, 0, 0}
+};
+
+#define USAGE "Usage: %s [-p] [-m mode] [--from-file=FILE [-0]] [-j threads] [dir...]\n"
 
 int main(int argc, char *argv[]) {
-  int i;
+  const char *manifest = NULL;
+  int opt, delim = '\n', i;
 
-  if (argc < 2) {
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt_long(argc, argv, "pm:0j:", longopts, NULL)) != -1) {
+    switch (opt) {
+      case 'p':
+        opt_parents = 1;
+        break;
+      case 'm': {
+        char *end;
+
+        opt_mode = strtol(optarg, &end, 8);
+        if (*end || opt_mode > 07777) {
+          fprintf(stderr, "invalid mode: %s\n", optarg);
+          exit(1);
+        }
+        opt_mode_set = 1;
+        break;
+      }
+      case 'F':
+        manifest = optarg;
+        opt_parents = 1;
+        break;
+      case '0':
+        delim = '\0';
+        break;
+      case 'j':
+        nthreads = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, USAGE, argv[0]);
+        exit(1);
+    }
+  }
+  if (optind == argc && !manifest) {
     fprintf(stderr, "%s: no arguments\n", argv[0]);
+    exit(1);
+  }
+  if (!opt_parents) {
+    do_plain(argv + optind, argc - optind);
+    exit(errors ? 1 : 0);
+  }
+
+  umask_bits = umask(0);
+  umask(umask_bits);
+  parent_mode = (0777 & ~umask_bits) | 0300;
+  for (i = optind; i < argc; i++) {
+    add_path(argv[i], strlen(argv[i]));
+  }
+  if (manifest) {
+    struct FioReader in;
+    const unsigned char *line;
+    size_t len;
+    int fd = strcmp(manifest, "-") == 0 ? STDIN_FILENO : open(manifest, O_RDONLY);
+    int ret;
+
+    if (fd < 0 || fio_open(&in, fd) < 0) {
+      perror(manifest);
+      exit(1);
+    }
+    while ((ret = fio_getdelim(&in, delim, &line, &len)) > 0) {
+      if (len > 0 && line[len - 1] == delim) {
+        len--;
+      }
+      add_path((const char *)line, len);
+    }
+    if (ret < 0) {
+      perror(manifest);
+      exit(1);
+    }
+    fio_close(&in);
+    if (fd != STDIN_FILENO) {
+      close(fd);
+    }
+  }
+  create_all();
+  exit(errors ? 1 : 0);
+}
+
+static void do_plain(char **paths, int n) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (mkdir(paths[i], opt_mode) < 0) {
+      perror(paths[i]);
+      errors = 1;
+    } else if (opt_mode_set && chmod(paths[i], opt_mode) < 0) {
+      perror(paths[i]);
+      errors = 1;
+    }
+  }
+}
+
+static uint32_t hash_name(uint32_t parent, const char *s, size_t len) {
+  uint32_t h = 2166136261u ^ parent;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  }
+  return h;
+}
+
+static void grow_table(void) {
+  size_t cap = table_cap ? table_cap * 2 : 4096, i, h;
+  uint32_t *t = malloc(sizeof(uint32_t) * cap);
+
+  if (!t) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  memset(t, 0xff, sizeof(uint32_t) * cap);
+  for (i = 0; i < table_cap; i++) {
+    if (table[i] != NONE) {
+      for (h = nodes[table[i]].hash & (cap - 1); t[h] != NONE; h = (h + 1) & (cap - 1))
+        ;
+      t[h] = table[i];
+    }
+  }
+  free(table);
+  table = t;
+  table_cap = cap;
+}
+
+static uint32_t new_node(uint32_t parent, const char *name, size_t len, uint32_t hash) {
+  struct Node *n;
+
+  if (nnodes == nodes_cap) {
+    nodes_cap = nodes_cap ? nodes_cap * 2 : 1024;
+    nodes = realloc(nodes, sizeof(struct Node) * nodes_cap);
+    if (!nodes) {
+      perror("realloc(3)");
+      exit(1);
+    }
+  }
+  if (names_len + len + 1 > names_cap) {
+    names_cap = names_cap ? names_cap * 2 : 64 * 1024;
+    while (names_len + len + 1 > names_cap) {
+      names_cap *= 2;
+    }
+    names = realloc(names, names_cap);
+    if (!names) {
+      perror("realloc(3)");
+      exit(1);
+    }
+  }
+  n = &nodes[nnodes];
+  memset(n, 0, sizeof(struct Node));
+  n->parent = parent;
+  n->first_child = NONE;
+  n->next_sibling = NONE;
+  n->name = names_len;
+  n->hash = hash;
+  n->fd = -1;
+  memcpy(names + names_len, name, len);
+  names[names_len + len] = '\0';
+  names_len += len + 1;
+  if (parent != NONE) {
+    n->next_sibling = nodes[parent].first_child;
+    nodes[parent].first_child = nnodes;
+  }
+  return nnodes++;
+}
+
+static uint32_t child(uint32_t parent, const char *name, size_t len) {
+  uint32_t hash = hash_name(parent, name, len);
+  size_t h;
+
+  if ((nnodes + 1) * 2 > table_cap) {
+    grow_table();
+  }
+  for (h = hash & (table_cap - 1); table[h] != NONE; h = (h + 1) & (table_cap - 1)) {
+    struct Node *n = &nodes[table[h]];
+
+    if (n->hash == hash && n->parent == parent &&
+        strncmp(names + n->name, name, len) == 0 && names[n->name + len] == '\0') {
+      return table[h];
+    }
   }
+  table[h] = new_node(parent, name, len, hash);
+  return table[h];
+}
+
+/*
+ * Node 0 stands for the current directory and node 1 for "/"; every
+ * path is split into components under one of them. Empty and "."
+ * components are dropped.
+ */
+static void add_path(const char *path, size_t len) {
+  const char *p = path, *end = path + len;
+  uint32_t node;
+
+  if (len == 0) {
+    return;
+  }
+  if (nnodes == 0) {
+    new_node(NONE, ".", 1, 0);
+    new_node(NONE, "/", 1, 0);
+  }
+  node = path[0] == '/' ? 1 : 0;
+  while (p < end) {
+    const char *slash = memchr(p, '/', end - p);
+    size_t n = (slash ? slash : end) - p;
+
+    if (n > 0 && !(n == 1 && p[0] == '.')) {
+      node = child(node, p, n);
+    }
+    p += n + 1;
+  }
+  nodes[node].requested = 1;
+}
+
+/* the path of a node, for messages and when its parent's fd is gone */
+static char *node_path(uint32_t i) {
+  size_t len = 0, pos;
+  uint32_t j;
+  char *path;
+
+  for (j = i; nodes[j].parent != NONE; j = nodes[j].parent) {
+    len += strlen(names + nodes[j].name) + 1;
+  }
+  path = malloc(len + 2);
+  if (!path) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  pos = len + 1;
+  path[pos] = '\0';
+  for (j = i; nodes[j].parent != NONE; j = nodes[j].parent) {
+    size_t n = strlen(names + nodes[j].name);
+
+    pos -= n;
+    memcpy(path + pos, names + nodes[j].name, n);
+    path[--pos] = '/';
+  }
+  if (j == 1) {
+    return len == 0 ? strcpy(path, "/") : memmove(path, path + 1, len + 1);
+  }
+  return len == 0 ? strcpy(path, ".") : memmove(path, path + 2, len);
+}
+
+static void node_error(uint32_t i) {
+  int err = errno;
+  char *path = node_path(i);
+
+  fprintf(stderr, "%s: %s\n", path, strerror(err));
+  free(path);
+  __atomic_store_n(&errors, 1, __ATOMIC_RELAXED);
+}
+
+/* the work queue: directories whose fd is open and children not yet made */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static uint32_t *stack = NULL;
+static size_t stack_len = 0, stack_cap = 0;
+static int busy = 0;
+static long open_fds = 0, max_fds = 1024;
+
+static void push(uint32_t i) {
+  pthread_mutex_lock(&lock);
+  if (stack_len == stack_cap) {
+    stack_cap = stack_cap ? stack_cap * 2 : 1024;
+    stack = realloc(stack, sizeof(uint32_t) * stack_cap);
+    if (!stack) {
+      perror("realloc(3)");
+      exit(1);
+    }
+  }
+  stack[stack_len++] = i;
+  pthread_cond_signal(&cond);
+  pthread_mutex_unlock(&lock);
+}
+
+static void close_node(uint32_t i) {
+  if (nodes[i].fd >= 0 && nodes[i].fd != AT_FDCWD) {
+    close(nodes[i].fd);
+    __atomic_sub_fetch(&open_fds, 1, __ATOMIC_RELAXED);
+  }
+  nodes[i].fd = -1;
+}
 
-  for (i = 1; i < argc; i++) {
-    if (mkdir(argv[i], 0777) < 0) {
-      perror(argv[i]);
+/*
+ * Create every child of node i with mkdirat(2) on i's fd. Children that
+ * have children of their own are opened here, through the same fd, and
+ * queued, so i's fd is done with when this returns. Past the fd budget
+ * a child's fd is not kept, and the child is opened again by path when
+ * its turn comes.
+ */
+static void make_children(uint32_t i) {
+  int fd = nodes[i].fd;
+  uint32_t c;
+
+  for (c = nodes[i].first_child; c != NONE; c = nodes[c].next_sibling) {
+    const char *name = names + nodes[c].name;
+    mode_t mode = nodes[c].requested ? opt_mode : 0777;
+
+    if (mkdirat(fd, name, mode) == 0) {
+      if (nodes[c].requested ? opt_mode_set : (umask_bits & 0300) != 0) {
+        if (fchmodat(fd, name, nodes[c].requested ? opt_mode : parent_mode, 0) < 0) {
+          node_error(c);
+        }
+      }
+    } else if (errno == EEXIST) {
+      struct stat st;
+
+      if (nodes[c].first_child == NONE && (fstatat(fd, name, &st, 0) < 0 || !S_ISDIR(st.st_mode))) {
+        errno = ENOTDIR;
+        node_error(c);
+      }
+    } else {
+      node_error(c);
+      continue;
+    }
+    if (nodes[c].first_child == NONE) {
+      continue;
+    }
+    if (__atomic_add_fetch(&open_fds, 1, __ATOMIC_RELAXED) > max_fds) {
+      __atomic_sub_fetch(&open_fds, 1, __ATOMIC_RELAXED);
+    } else if ((nodes[c].fd = openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+      __atomic_sub_fetch(&open_fds, 1, __ATOMIC_RELAXED);
+      node_error(c);
+      continue;
+    }
+    push(c);
+  }
+  close_node(i);
+}
+
+static void *worker(void *arg) {
+  (void)arg;
+  while (1) {
+    uint32_t i;
+
+    pthread_mutex_lock(&lock);
+    while (stack_len == 0 && busy > 0) {
+      pthread_cond_wait(&cond, &lock);
+    }
+    if (stack_len == 0) {
+      pthread_cond_broadcast(&cond);
+      pthread_mutex_unlock(&lock);
+      return NULL;
+    }
+    i = stack[--stack_len];
+    busy++;
+    pthread_mutex_unlock(&lock);
+
+    if (nodes[i].fd == -1) {
+      char *path = node_path(i);
+
+      nodes[i].fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+      free(path);
+      if (nodes[i].fd < 0) {
+        node_error(i);
+      } else {
+        __atomic_add_fetch(&open_fds, 1, __ATOMIC_RELAXED);
+      }
+    }
+    if (nodes[i].fd != -1) {
+      make_children(i);
+    }
+
+    pthread_mutex_lock(&lock);
+    busy--;
+    if (busy == 0 && stack_len == 0) {
+      pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+/*
+ * Build the trie top-down on a pool of threads: independent subtrees
+ * are created concurrently, and no ancestor is looked up or checked
+ * more than once.
+ */
+static void create_all(void) {
+  pthread_t threads[MAX_THREADS];
+  struct rlimit rl;
+  int i;
+
+  if (nnodes == 0) {
+    return;
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  if (nthreads > MAX_THREADS) {
+    nthreads = MAX_THREADS;
+  }
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+    max_fds = rl.rlim_cur / 2;
+  }
+  nodes[0].fd = AT_FDCWD;
+  nodes[1].fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (nodes[1].fd < 0) {
+    perror("/");
+    exit(1);
+  }
+  open_fds = 1;
+  push(0);
+  push(1);
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+      fputs("pthread_create(3) failed\n", stderr);
       exit(1);
     }
   }
-  exit(0);
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
 }
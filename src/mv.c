@@ -1,16 +1,580 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "walk.h"
+
+#define BUFFER_SIZE (1024 * 1024)
+#define KERNEL_CHUNK (1024 * 1024 * 1024)
+
+struct CopyJob {
+  char *src;
+  char *dst;
+  uint64_t size;
+};
+
+struct DirMeta {
+  char *dst;
+  struct stat st;
+};
+
+static void move_file(const char *src, const char *dst);
+static void move_tree(const char *src, const char *dst);
+static int copy_file(const char *src, const char *dst, char *buf);
+static int copy_special(int dirfd, const char *src_path, const char *name, const char *dst);
+
+static int nthreads;
+static int errors = 0;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct CopyJob *jobs = NULL;
+static size_t njobs = 0, jobs_cap = 0, next_job = 0;
+static struct DirMeta **dirs = NULL; /* in post-order */
+static size_t ndirs = 0, dirs_cap = 0;
+
+static struct option longopts[] = {
+  {"threads", required_argument, NULL, 'j'},
+  {0, 0, 0, 0}
+};
 
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
+  struct stat st;
+  int opt;
+
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt_long(argc, argv, "j:", longopts, NULL)) != -1) {
+    switch (opt) {
+      case 'j':
+        nthreads = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-j threads] src dst\n", argv[0]);
+        exit(1);
+    }
+  }
+  if (argc - optind != 2) {
     fprintf(stderr, "%s: wrong arguments\n", argv[0]);
     exit(1);
   }
 
-  if (rename(argv[1], argv[2]) < 0) {
-    perror(argv[1]);
+  if (rename(argv[optind], argv[optind + 1]) == 0) {
+    exit(0);
+  }
+  if (errno != EXDEV) {
+    perror(argv[optind]);
+    exit(1);
+  }
+  if (lstat(argv[optind], &st) < 0) {
+    perror(argv[optind]);
     exit(1);
   }
-  exit(0);
+  if (S_ISDIR(st.st_mode)) {
+    move_tree(argv[optind], argv[optind + 1]);
+  } else {
+    move_file(argv[optind], argv[optind + 1]);
+  }
+  exit(errors ? 1 : 0);
+}
+
+static void error(const char *path) {
+  fprintf(stderr, "%s: %s\n", path, strerror(errno));
+  __atomic_store_n(&errors, 1, __ATOMIC_RELAXED);
+}
+
+static void *xmalloc(size_t size) {
+  void *p = malloc(size);
+
+  if (!p) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  return p;
+}
+
+static char *join(const char *dir, const char *name) {
+  size_t dlen = strlen(dir), nlen = strlen(name);
+  char *path = xmalloc(dlen + nlen + 2);
+
+  memcpy(path, dir, dlen);
+  path[dlen] = '/';
+  memcpy(path + dlen + 1, name, nlen + 1);
+  return path;
+}
+
+static char *parent_of(const char *path) {
+  const char *slash = strrchr(path, '/');
+
+  if (!slash) {
+    return strdup(".");
+  }
+  if (slash == path) {
+    return strdup("/");
+  }
+  return strndup(path, slash - path);
+}
+
+static int fsync_path(const char *path) {
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  int ret;
+
+  if (fd < 0) {
+    return -1;
+  }
+  ret = fsync(fd);
+  close(fd);
+  return ret;
+}
+
+/*
+ * Ownership first, since chown(2) may clear set-id bits; failing to
+ * give files away is not an error for an unprivileged user.
+ */
+static int copy_attrs(int fd, const struct stat *st) {
+  struct timespec times[2];
+
+  if (fchown(fd, st->st_uid, st->st_gid) < 0 && errno != EPERM) {
+    return -1;
+  }
+  if (fchmod(fd, st->st_mode & 07777) < 0) {
+    return -1;
+  }
+  times[0] = st->st_atim;
+  times[1] = st->st_mtim;
+  return futimens(fd, times);
+}
+
+/*
+ * Copy [off, end) to the same offsets in out: copy_file_range(2), which
+ * stays in the kernel (and may offload to the device), until it refuses
+ * the pair, then pread/pwrite. Stops early if the file shrank.
+ */
+static int copy_extent(int in, int out, off_t off, off_t end, char *buf, int *use_kernel) {
+  while (off < end) {
+    size_t want = end - off;
+    ssize_t n, done, w;
+
+    if (*use_kernel) {
+      loff_t in_off = off, out_off = off;
+
+      n = copy_file_range(in, &in_off, out, &out_off, want < KERNEL_CHUNK ? want : KERNEL_CHUNK, 0);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        *use_kernel = 0;
+        continue;
+      }
+      if (n == 0) {
+        return 0;
+      }
+      off += n;
+      continue;
+    }
+    n = pread(in, buf, want < BUFFER_SIZE ? want : BUFFER_SIZE, off);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (n == 0) {
+      return 0;
+    }
+    for (done = 0; done < n; done += w) {
+      w = pwrite(out, buf + done, n - done, off + done);
+      if (w < 0) {
+        if (errno == EINTR) {
+          w = 0;
+          continue;
+        }
+        return -1;
+      }
+    }
+    off += n;
+  }
+  return 0;
+}
+
+/*
+ * Reflink the whole file when the filesystem can share extents. Else
+ * copy only the data extents that SEEK_DATA/SEEK_HOLE report and set
+ * the size at the end, so holes stay holes; a filesystem without
+ * SEEK_DATA is copied as one extent.
+ */
+static int copy_data(int in, int out, char *buf) {
+  struct stat st;
+  off_t off = 0;
+  int use_kernel = 1;
+
+  if (ioctl(out, FICLONE, in) == 0) {
+    return 0;
+  }
+  if (fstat(in, &st) < 0) {
+    return -1;
+  }
+  posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+  while (off < st.st_size) {
+    off_t data = lseek(in, off, SEEK_DATA), hole;
+
+    if (data < 0 && errno == ENXIO) {
+      break; /* only a hole is left */
+    }
+    if (data < 0) {
+      data = off;
+      hole = st.st_size;
+    } else if ((hole = lseek(in, data, SEEK_HOLE)) < 0) {
+      hole = st.st_size;
+    }
+    if (copy_extent(in, out, data, hole, buf, &use_kernel) < 0) {
+      return -1;
+    }
+    off = hole;
+  }
+  return ftruncate(out, st.st_size);
+}
+
+/* copy src to the new file dst with its attributes; 0 once it is fsync'd */
+static int copy_file(const char *src, const char *dst, char *buf) {
+  struct stat st;
+  int in, out;
+
+  in = open(src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (in < 0) {
+    error(src);
+    return -1;
+  }
+  out = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (out < 0) {
+    error(dst);
+    close(in);
+    return -1;
+  }
+  if (fstat(in, &st) < 0 || copy_data(in, out, buf) < 0) {
+    error(src);
+  } else if (copy_attrs(out, &st) < 0 || fsync(out) < 0) {
+    error(dst);
+  } else {
+    close(in);
+    if (close(out) < 0) {
+      error(dst);
+      unlink(dst);
+      return -1;
+    }
+    return 0;
+  }
+  close(in);
+  close(out);
+  unlink(dst);
+  return -1;
+}
+
+/* a symlink, fifo, socket or device node, recreated as dst */
+static int copy_special(int dirfd, const char *src_path, const char *name, const char *dst) {
+  struct timespec times[2];
+  struct stat st;
+
+  if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) < 0) {
+    error(src_path);
+    return -1;
+  }
+  if (S_ISLNK(st.st_mode)) {
+    char target[PATH_MAX];
+    ssize_t n = readlinkat(dirfd, name, target, sizeof target - 1);
+
+    if (n < 0) {
+      error(src_path);
+      return -1;
+    }
+    target[n] = '\0';
+    if (symlink(target, dst) < 0) {
+      error(dst);
+      return -1;
+    }
+  } else if (mknod(dst, st.st_mode & ~07777, st.st_rdev) < 0) {
+    error(dst);
+    return -1;
+  }
+  if (lchown(dst, st.st_uid, st.st_gid) < 0 && errno != EPERM) {
+    error(dst);
+  }
+  if (!S_ISLNK(st.st_mode)) {
+    chmod(dst, st.st_mode & 07777);
+  }
+  times[0] = st.st_atim;
+  times[1] = st.st_mtim;
+  utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW);
+  return 0;
+}
+
+/*
+ * A single non-directory: copied next to dst under a temporary name and
+ * renamed over it, so an existing dst is replaced atomically as by
+ * rename(2). Symlinks and special files are recreated instead.
+ */
+static void move_file(const char *src, const char *dst) {
+  struct stat st;
+  char *buf, *tmp;
+  int fd;
+
+  if (lstat(src, &st) < 0) {
+    error(src);
+    return;
+  }
+  tmp = xmalloc(strlen(dst) + 16);
+  sprintf(tmp, "%s.mvXXXXXX", dst);
+  fd = mkstemp(tmp);
+  if (fd < 0) {
+    error(dst);
+    free(tmp);
+    return;
+  }
+  close(fd);
+  unlink(tmp);
+
+  if (S_ISREG(st.st_mode)) {
+    buf = xmalloc(BUFFER_SIZE);
+    fd = copy_file(src, tmp, buf);
+    free(buf);
+  } else {
+    fd = copy_special(AT_FDCWD, src, src, tmp);
+  }
+  if (fd == 0) {
+    char *parent = parent_of(dst);
+
+    if (rename(tmp, dst) < 0) {
+      error(dst);
+      unlink(tmp);
+    } else if (fsync_path(parent) < 0) {
+      error(dst);
+    } else if (unlink(src) < 0) {
+      error(src);
+    }
+    free(parent);
+  }
+  free(tmp);
+}
+
+static void add_job(char *src, char *dst, uint64_t size) {
+  pthread_mutex_lock(&lock);
+  if (njobs == jobs_cap) {
+    jobs_cap = jobs_cap ? jobs_cap * 2 : 1024;
+    jobs = realloc(jobs, sizeof(struct CopyJob) * jobs_cap);
+    if (!jobs) {
+      perror("realloc(3)");
+      exit(1);
+    }
+  }
+  jobs[njobs].src = src;
+  jobs[njobs].dst = dst;
+  jobs[njobs].size = size;
+  njobs++;
+  pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Walk phase: the destination directories are created as their parents
+ * are read, before the walker descends into them, and everything but
+ * regular files is recreated on the spot. Regular files become jobs for
+ * the copy phase; directory attributes are applied last, because
+ * creating the entries would change their times.
+ */
+static void copy_dir(struct Walker *w, struct WalkDir *dir, struct WalkEntry *ents, size_t n) {
+  struct DirMeta *meta = dir->data;
+  size_t i;
+
+  if (!meta) {
+    meta = xmalloc(sizeof(struct DirMeta));
+    meta->dst = strdup(w->ops->arg);
+    dir->data = meta;
+  }
+  if (fstat(dir->fd, &meta->st) < 0) {
+    error(dir->path);
+  }
+  for (i = 0; i < n; i++) {
+    struct WalkEntry *e = &ents[i];
+    char *dst = join(meta->dst, e->name);
+
+    if (e->type == DT_DIR) {
+      struct DirMeta *sub;
+
+      if (mkdir(dst, 0700) < 0) {
+        error(dst);
+        free(dst);
+        e->descend = 0;
+        continue;
+      }
+      sub = xmalloc(sizeof(struct DirMeta));
+      sub->dst = dst;
+      memset(&sub->st, 0, sizeof sub->st);
+      e->sub->data = sub;
+    } else if (e->type == DT_REG) {
+      add_job(join(dir->path, e->name), dst, e->stat_ok ? e->st.size : 0);
+    } else {
+      char *src = join(dir->path, e->name);
+
+      copy_special(dir->fd, src, e->name, dst);
+      free(src);
+      free(dst);
+    }
+  }
+}
+
+static void copy_leave(struct Walker *w, struct WalkDir *dir) {
+  (void)w;
+  if (!dir->data) {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  if (ndirs == dirs_cap) {
+    dirs_cap = dirs_cap ? dirs_cap * 2 : 256;
+    dirs = realloc(dirs, sizeof(struct DirMeta *) * dirs_cap);
+    if (!dirs) {
+      perror("realloc(3)");
+      exit(1);
+    }
+  }
+  dirs[ndirs++] = dir->data;
+  pthread_mutex_unlock(&lock);
+}
+
+/* largest first, so one big file does not trail behind the rest */
+static int job_cmp(const void *a, const void *b) {
+  const struct CopyJob *x = a, *y = b;
+
+  return x->size < y->size ? 1 : x->size > y->size ? -1 : 0;
+}
+
+static void *copy_worker(void *arg) {
+  char *buf = xmalloc(BUFFER_SIZE);
+
+  (void)arg;
+  while (1) {
+    size_t i;
+
+    pthread_mutex_lock(&lock);
+    i = next_job++;
+    pthread_mutex_unlock(&lock);
+    if (i >= njobs) {
+      break;
+    }
+    copy_file(jobs[i].src, jobs[i].dst, buf);
+    free(jobs[i].src);
+    free(jobs[i].dst);
+  }
+  free(buf);
+  return NULL;
+}
+
+static void remove_dir(struct Walker *w, struct WalkDir *dir, struct WalkEntry *ents, size_t n) {
+  size_t i;
+
+  (void)w;
+  for (i = 0; i < n; i++) {
+    if (ents[i].type != DT_DIR && unlinkat(dir->fd, ents[i].name, 0) < 0) {
+      char *path = join(dir->path, ents[i].name);
+
+      error(path);
+      free(path);
+    }
+  }
+}
+
+static void remove_leave(struct Walker *w, struct WalkDir *dir) {
+  int ret;
+
+  (void)w;
+  if (dir->parent && dir->parent->fd >= 0) {
+    ret = unlinkat(dir->parent->fd, dir->name, AT_REMOVEDIR);
+  } else {
+    ret = rmdir(dir->path);
+  }
+  if (ret < 0) {
+    error(dir->path);
+  }
+}
+
+/*
+ * A directory across filesystems: walk the source (walk.h) creating the
+ * skeleton, copy the files on a pool of threads, fix up and fsync the
+ * directories, and only when all of that succeeded remove the source.
+ */
+static void move_tree(const char *src, const char *dst) {
+  static struct WalkOps copy_ops, remove_ops;
+  pthread_t threads[WALK_MAX_THREADS];
+  char *roots[1], *parent;
+  size_t i;
+  int nt;
+
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  if (nthreads > WALK_MAX_THREADS) {
+    nthreads = WALK_MAX_THREADS;
+  }
+  /* like rename(2), replace an empty directory; rmdir(2) fails otherwise */
+  if (mkdir(dst, 0700) < 0 && (errno != EEXIST || rmdir(dst) < 0 || mkdir(dst, 0700) < 0)) {
+    error(dst);
+    return;
+  }
+  roots[0] = (char *)src;
+  copy_ops.stat_mask = STATX_SIZE;
+  copy_ops.dir = copy_dir;
+  copy_ops.leave = copy_leave;
+  copy_ops.arg = (void *)dst;
+  if (walk_run(&copy_ops, roots, 1, nthreads)) {
+    errors = 1;
+  }
+
+  qsort(jobs, njobs, sizeof(struct CopyJob), job_cmp);
+  nt = njobs < (size_t)nthreads ? (int)njobs : nthreads;
+  for (i = 0; i < (size_t)nt; i++) {
+    if (pthread_create(&threads[i], NULL, copy_worker, NULL) != 0) {
+      fputs("pthread_create(3) failed\n", stderr);
+      exit(1);
+    }
+  }
+  for (i = 0; i < (size_t)nt; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(jobs);
+
+  for (i = 0; i < ndirs; i++) {
+    int fd = open(dirs[i]->dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd < 0 || copy_attrs(fd, &dirs[i]->st) < 0 || fsync(fd) < 0) {
+      error(dirs[i]->dst);
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    free(dirs[i]->dst);
+    free(dirs[i]);
+  }
+  free(dirs);
+  parent = parent_of(dst);
+  if (fsync_path(parent) < 0) {
+    error(parent);
+  }
+  free(parent);
+
+  if (errors) {
+    fprintf(stderr, "%s: not removed, the copy is incomplete\n", src);
+    return;
+  }
+  remove_ops.hold_fds = 1;
+  remove_ops.dir = remove_dir;
+  remove_ops.leave = remove_leave;
+  if (walk_run(&remove_ops, roots, 1, nthreads)) {
+    errors = 1;
+  }
 }
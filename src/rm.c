@@ -1,20 +1,241 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "walk.h"
+
+#define FAILED ((void *)1) /* WalkDir.data: something below could not be removed */
+
+static void remove_dir(struct Walker *w, struct WalkDir *dir, struct WalkEntry *ents, size_t n);
+static void remove_leave(struct Walker *w, struct WalkDir *dir);
+static void *progress_main(void *arg);
+
+static int opt_force = 0;
+static int opt_recursive = 0;
+static int opt_progress = 0;
+static int nthreads;
+static int errors = 0;
+
+static unsigned long n_files = 0;
+static unsigned long n_dirs = 0;
+static int done = 0;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t progress_cond = PTHREAD_COND_INITIALIZER;
+
+static struct option longopts[] = {
+  {"force", no_argument, NULL, 'f'},
+  {"recursive", no_argument, NULL, 'r'},
+  {"progress", no_argument, NULL, 'P'},
+  {"threads", required_argument, NULL, 'j'},
+  {0, 0, 0, 0}
+};
+
+#define USAGE "Usage: %s [-f] [-r] [--progress] [-j threads] path...\n"
 
 int main(int argc, char *argv[]) {
-  int i;
+  static struct WalkOps ops;
+  pthread_t progress;
+  char **dirs;
+  int ndirs = 0, opt, i;
 
-  if (argc < 2) {
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt_long(argc, argv, "frRj:", longopts, NULL)) != -1) {
+    switch (opt) {
+      case 'f':
+        opt_force = 1;
+        break;
+      case 'r':
+      case 'R':
+        opt_recursive = 1;
+        break;
+      case 'P':
+        opt_progress = 1;
+        break;
+      case 'j':
+        nthreads = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, USAGE, argv[0]);
+        exit(1);
+    }
+  }
+  if (optind == argc) {
+    if (opt_force) {
+      exit(0);
+    }
     fprintf(stderr, "%s: no arguments\n", argv[0]);
     exit(1);
   }
 
-  for (i = 1; i < argc; i++) {
+  dirs = malloc(sizeof(char *) * (argc - optind));
+  if (!dirs) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  for (i = optind; i < argc; i++) {
+    size_t len = strlen(argv[i]);
+    const char *base;
+    struct stat st;
+
+    /* the last component, ignoring trailing slashes: "../" and "a/./" are refused too */
+    while (len > 1 && argv[i][len - 1] == '/') {
+      len--;
+    }
+    for (base = argv[i] + len; base > argv[i] && base[-1] != '/'; base--)
+      ;
+    len -= base - argv[i];
+    if ((len == 1 && base[0] == '.') || (len == 2 && base[0] == '.' && base[1] == '.')) {
+      fprintf(stderr, "%s: refusing to remove '.' or '..'\n", argv[i]);
+      errors = 1;
+      continue;
+    }
+    if (opt_recursive && lstat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+      if (strspn(argv[i], "/") == strlen(argv[i])) {
+        fprintf(stderr, "%s: refusing to remove '/'\n", argv[i]);
+        errors = 1;
+        continue;
+      }
+      dirs[ndirs++] = argv[i];
+      continue;
+    }
     if (unlink(argv[i]) < 0) {
-      perror(argv[i]);
+      if (!(opt_force && errno == ENOENT)) {
+        perror(argv[i]);
+        errors = 1;
+      }
+      continue;
+    }
+    n_files++;
+  }
+
+  if (ndirs > 0) {
+    if (opt_progress && pthread_create(&progress, NULL, progress_main, NULL) != 0) {
+      fputs("pthread_create(3) failed\n", stderr);
       exit(1);
     }
+    ops.dir = remove_dir;
+    ops.leave = remove_leave;
+    ops.hold_fds = 1;
+    if (walk_run(&ops, dirs, ndirs, nthreads)) {
+      errors = 1;
+    }
+    if (opt_progress) {
+      pthread_mutex_lock(&progress_lock);
+      done = 1;
+      pthread_cond_signal(&progress_cond);
+      pthread_mutex_unlock(&progress_lock);
+      pthread_join(progress, NULL);
+    }
+  }
+  free(dirs);
+  exit(errors ? 1 : 0);
+}
+
+static void mark_failed(struct WalkDir *dir) {
+  if (dir) {
+    __atomic_store_n(&dir->data, FAILED, __ATOMIC_RELAXED);
+  }
+}
+
+/*
+ * Everything but subdirectories is unlinked right away, relative to the
+ * directory's own fd. Subdirectories are left to the walker, which runs
+ * remove_leave on each once it is empty.
+ */
+static void remove_dir(struct Walker *w, struct WalkDir *dir, struct WalkEntry *ents, size_t n) {
+  unsigned long removed = 0;
+  size_t i;
+
+  (void)w;
+  for (i = 0; i < n; i++) {
+    if (ents[i].type == DT_DIR) {
+      continue;
+    }
+    if (unlinkat(dir->fd, ents[i].name, 0) < 0) {
+      if (!(opt_force && errno == ENOENT)) {
+        fprintf(stderr, "%s/%s: %s\n", dir->path, ents[i].name, strerror(errno));
+        __atomic_store_n(&errors, 1, __ATOMIC_RELAXED);
+        mark_failed(dir);
+      }
+      continue;
+    }
+    removed++;
+  }
+  __atomic_add_fetch(&n_files, removed, __ATOMIC_RELAXED);
+}
+
+/* post-order: the directory is empty now, unless something in it failed */
+static void remove_leave(struct Walker *w, struct WalkDir *dir) {
+  struct WalkDir *parent = dir->parent;
+  int ret;
+
+  (void)w;
+  /* dir->failed: it could not be read, and walk.h already said why */
+  if (dir->failed || __atomic_load_n(&dir->data, __ATOMIC_RELAXED) == FAILED) {
+    mark_failed(parent);
+    return;
+  }
+  if (parent && parent->fd >= 0) {
+    ret = unlinkat(parent->fd, dir->name, AT_REMOVEDIR);
+  } else {
+    ret = rmdir(dir->path);
+  }
+  if (ret < 0) {
+    if (!(opt_force && errno == ENOENT)) {
+      perror(dir->path);
+      __atomic_store_n(&errors, 1, __ATOMIC_RELAXED);
+      mark_failed(parent);
+    }
+    return;
+  }
+  __atomic_add_fetch(&n_dirs, 1, __ATOMIC_RELAXED);
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* once a second on stderr: totals so far and the recent rate */
+static void *progress_main(void *arg) {
+  double start = now(), last = start, t;
+  unsigned long last_files = 0, files;
+  struct timespec deadline;
+  int finished = 0;
+
+  (void)arg;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  while (!finished) {
+    deadline.tv_sec++;
+    pthread_mutex_lock(&progress_lock);
+    while (!done && pthread_cond_timedwait(&progress_cond, &progress_lock, &deadline) != ETIMEDOUT)
+      ;
+    finished = done;
+    pthread_mutex_unlock(&progress_lock);
+
+    t = now();
+    files = __atomic_load_n(&n_files, __ATOMIC_RELAXED);
+    if (finished) {
+      fprintf(stderr, "removed %lu files, %lu directories in %.1fs (%.0f files/s)\n",
+              files, __atomic_load_n(&n_dirs, __ATOMIC_RELAXED), t - start,
+              t > start ? files / (t - start) : 0.0);
+    } else {
+      fprintf(stderr, "%lu files, %lu directories, %.0f files/s\n",
+              files, __atomic_load_n(&n_dirs, __ATOMIC_RELAXED),
+              t > last ? (files - last_files) / (t - last) : 0.0);
+    }
+    last = t;
+    last_files = files;
   }
-  exit(0);
+  return NULL;
 }
@@ -1,25 +1,140 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "event.h"
 
-typedef void (*sighandler_t)(int);
+static void on_sigint(struct EvLoop *loop, const struct signalfd_siginfo *si, void *arg);
+static void on_sigterm(struct EvLoop *loop, const struct signalfd_siginfo *si, void *arg);
+static void on_sighup(struct EvLoop *loop, const struct signalfd_siginfo *si, void *arg);
+static void on_tick(struct EvLoop *loop, struct EvSource *src, uint32_t events);
+static void on_sent(struct EvLoop *loop, struct EvSource *src, uint32_t events);
+static void *sender(void *arg);
+static void print_counts(struct EvLoop *loop);
 
-sighandler_t handleSignal(int sig, sighandler_t handler) {
-  struct sigaction act, old;
+static long max_traps = 1;
+static long burst = 0;
+static int verbose = 0;
 
-  act.sa_handler = handler;
-  sigemptyset(&act.sa_mask);
-  // act.sa_flags = SA_RESTART;
-  if (sigaction(sig, &act, &old) < 0) {
-    return NULL;
+#define USAGE "Usage: %s [-n traps] [-t interval_ms] [-s burst] [-v]\n"
+
+int main(int argc, char *argv[]) {
+  static struct EvLoop loop;
+  static struct EvSource ticker, sent;
+  pthread_t thread;
+  long interval = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:t:s:v")) != -1) {
+    switch (opt) {
+      case 'n':
+        max_traps = atol(optarg);
+        break;
+      case 't':
+        interval = atol(optarg);
+        break;
+      case 's':
+        burst = atol(optarg);
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      default:
+        fprintf(stderr, USAGE, argv[0]);
+        exit(1);
+    }
+  }
+
+  /* before the sender thread exists, so it inherits the blocked mask */
+  ev_init(&loop);
+  ev_signal(&loop, SIGINT, on_sigint, NULL);
+  ev_signal(&loop, SIGTERM, on_sigterm, NULL);
+  ev_signal(&loop, SIGQUIT, on_sigterm, NULL);
+  ev_signal(&loop, SIGHUP, on_sighup, NULL);
+  ev_signal(&loop, SIGUSR1, NULL, NULL); /* only counted */
+  ev_signal(&loop, SIGUSR2, NULL, NULL);
+  if (interval > 0) {
+    ev_timer(&loop, &ticker, interval, interval, on_tick, NULL);
+  }
+  if (burst > 0) {
+    ev_eventfd(&loop, &sent, on_sent, NULL);
+    if (pthread_create(&thread, NULL, sender, &sent) != 0) {
+      fputs("pthread_create(3) failed\n", stderr);
+      exit(1);
+    }
+    pthread_detach(thread);
   }
-  return old.sa_handler;
+
+  ev_run(&loop);
+  if (verbose) {
+    print_counts(&loop);
+  }
+  exit(0);
 }
 
-void printMessage() {
+static void on_sigint(struct EvLoop *loop, const struct signalfd_siginfo *si, void *arg) {
+  (void)si;
+  (void)arg;
   fprintf(stdout, "TRAP SIGINT\n");
+  fflush(stdout);
+  if (max_traps > 0 && loop->sig_count[SIGINT] >= (unsigned long)max_traps) {
+    ev_stop(loop);
+  }
 }
 
-int main(int argc, char *argv[]) {
-  handleSignal(SIGINT, printMessage);
-  pause();
+static void on_sigterm(struct EvLoop *loop, const struct signalfd_siginfo *si, void *arg) {
+  (void)arg;
+  fprintf(stdout, "exit by signal %d from pid %d\n", (int)si->ssi_signo, (int)si->ssi_pid);
+  ev_stop(loop);
+}
+
+/* the usual "reload": report what has arrived so far */
+static void on_sighup(struct EvLoop *loop, const struct signalfd_siginfo *si, void *arg) {
+  (void)si;
+  (void)arg;
+  print_counts(loop);
+}
+
+static void on_tick(struct EvLoop *loop, struct EvSource *src, uint32_t events) {
+  (void)loop;
+  (void)events;
+  /* count > 1 means the loop was late and expirations were merged */
+  fprintf(stdout, "tick %llu (+%llu)\n", (unsigned long long)src->total, (unsigned long long)src->count);
+  fflush(stdout);
+}
+
+static void on_sent(struct EvLoop *loop, struct EvSource *src, uint32_t events) {
+  (void)events;
+  fprintf(stdout, "sent %llu SIGUSR1, delivered %lu so far\n",
+          (unsigned long long)src->total, loop->sig_count[SIGUSR1]);
+  fflush(stdout);
+}
+
+/*
+ * Send SIGUSR1 burst times as fast as possible. While one is still
+ * pending the next is merged into it, so far fewer are delivered.
+ */
+static void *sender(void *arg) {
+  struct EvSource *sent = arg;
+  long i;
+
+  for (i = 0; i < burst; i++) {
+    kill(getpid(), SIGUSR1);
+  }
+  ev_notify(sent, burst);
+  return NULL;
+}
+
+static void print_counts(struct EvLoop *loop) {
+  int sig;
+
+  for (sig = 1; sig < NSIG; sig++) {
+    if (loop->sig_count[sig]) {
+      fprintf(stdout, "SIG%s: %lu\n", sigabbrev_np(sig), loop->sig_count[sig]);
+    }
+  }
+  fflush(stdout);
 }
@@ -1,38 +1,438 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <spawn.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include "fastio.h"
 
-int main(int argc, char *argv[]) {
+#define MAX_ARGS 256
+#define DEFAULT_BENCH_COUNT 1000
+
+enum { M_FORK, M_VFORK, M_POSIX_SPAWN, N_METHODS };
+
+static const char *method_names[N_METHODS] = {"fork", "vfork", "posix_spawn"};
+
+struct Job {
   pid_t pid;
+  unsigned long id;
+  double start;
+  char *command;
+};
+
+static pid_t launch(int method, char *const argv[], int in);
+static void run_one(char *command, char *arg);
+static void run_jobs(int max_jobs);
+static void bench(int count, char **argv);
+
+extern char **environ;
+
+static int method = M_POSIX_SPAWN;
+static int quiet = 0;
+
+static struct option longopts[] = {
+  {"method", required_argument, NULL, 'm'},
+  {"parallel", required_argument, NULL, 'P'},
+  {"quiet", no_argument, NULL, 'q'},
+  {"bench", optional_argument, NULL, 'B'},
+  {"ballast", required_argument, NULL, 'H'},
+  {0, 0, 0, 0}
+};
+
+#define USAGE "Usage: %s [-m fork|vfork|posix_spawn] <command> <arg>\n" \
+              "       %s [-m method] [-q] -P jobs < commands\n" \
+              "       %s --bench[=count] [-H ballast-MB] [command [arg...]]\n"
+
+int main(int argc, char *argv[]) {
+  int opt, max_jobs = 0, bench_count = 0;
+  long ballast_mb = 0;
+
+  while ((opt = getopt_long(argc, argv, "+m:P:qH:", longopts, NULL)) != -1) {
+    switch (opt) {
+      case 'm':
+        for (method = 0; method < N_METHODS && strcmp(optarg, method_names[method]) != 0; method++)
+          ;
+        if (method == N_METHODS) {
+          fprintf(stderr, "unknown method: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'P':
+        max_jobs = atoi(optarg);
+        if (max_jobs < 1) {
+          fprintf(stderr, "invalid job count: %s\n", optarg);
+          exit(1);
+        }
+        break;
+      case 'q':
+        quiet = 1;
+        break;
+      case 'B':
+        bench_count = optarg ? atoi(optarg) : DEFAULT_BENCH_COUNT;
+        if (bench_count < 1) {
+          bench_count = 1;
+        }
+        break;
+      case 'H':
+        ballast_mb = atol(optarg);
+        break;
+      default:
+        fprintf(stderr, USAGE, argv[0], argv[0], argv[0]);
+        exit(1);
+    }
+  }
+
+  if (ballast_mb > 0) {
+    /* a big parent, as fork(2) has to copy its page tables */
+    size_t size = (size_t)ballast_mb << 20;
+    char *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED) {
+      perror("mmap(2)");
+      exit(1);
+    }
+    memset(p, 1, size);
+  }
+  if (bench_count > 0) {
+    bench(bench_count, argv + optind);
+    exit(0);
+  }
+  if (max_jobs > 0) {
+    run_jobs(max_jobs);
+    /* NOT REACH */
+  }
 
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s <command> <arg>\n", argv[0]);
+  if (argc - optind != 2) {
+    fprintf(stderr, USAGE, argv[0], argv[0], argv[0]);
     exit(1);
   }
-  pid = fork();
+  run_one(argv[optind], argv[optind + 1]);
+  exit(0);
+}
+
+static void run_one(char *command, char *arg) {
+  char *args[] = {command, arg, NULL};
+  int status;
+  pid_t pid;
+
+  pid = launch(method, args, -1);
   if (pid < 0) {
-    fprintf(stderr, "fork(2) failed\n");
+    perror(command);
     exit(1);
   }
-  if (pid == 0) { // child process
-    execl(argv[1], argv[1], argv[2], NULL);
-    // child process returns error code
-    perror(argv[1]);
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      perror("waitpid(2)");
+      exit(1);
+    }
+  }
+  printf("child (PID=%d) finished; ", pid);
+  if (WIFEXITED(status)) {
+    printf("exit, status=%d\n", WEXITSTATUS(status));
+  } else if (WIFSIGNALED(status)) {
+    printf("signal, sig=%d\n", WTERMSIG(status));
+  } else {
+    printf("abnormal exit\n");
+  }
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* in a fork or vfork child: only async-signal-safe calls from here on */
+static void child_exec(char *const argv[], int in) {
+  sigset_t none;
+
+  if (in >= 0 && dup2(in, STDIN_FILENO) < 0) {
+    _exit(127);
+  }
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, NULL);
+  if (strchr(argv[0], '/')) {
+    execve(argv[0], argv, environ);
+  } else {
+    execvp(argv[0], argv);
+  }
+  write(STDERR_FILENO, argv[0], strlen(argv[0]));
+  write(STDERR_FILENO, ": exec failed\n", 14);
+  _exit(127);
+}
+
+/*
+ * Start argv[0] (searched in PATH when it has no slash) with the given
+ * method. posix_spawn(3) is glibc's clone(CLONE_VM | CLONE_VFORK), so
+ * like vfork(2) it costs the same however large this process is; fork(2)
+ * copies the page tables first. Children start with no signals blocked,
+ * and with in as their stdin unless it is -1.
+ */
+static pid_t launch(int m, char *const argv[], int in) {
+  pid_t pid;
+
+  switch (m) {
+    case M_FORK:
+      pid = fork();
+      if (pid == 0) {
+        child_exec(argv, in);
+      }
+      return pid;
+    case M_VFORK:
+      pid = vfork();
+      if (pid == 0) {
+        child_exec(argv, in);
+      }
+      return pid;
+    default: {
+      posix_spawnattr_t attr;
+      posix_spawn_file_actions_t actions;
+      sigset_t none;
+      int err;
+
+      posix_spawn_file_actions_init(&actions);
+      if (in >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, in, STDIN_FILENO);
+      }
+      sigemptyset(&none);
+      posix_spawnattr_init(&attr);
+      posix_spawnattr_setsigmask(&attr, &none);
+      posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+      if (strchr(argv[0], '/')) {
+        err = posix_spawn(&pid, argv[0], &actions, &attr, argv, environ);
+      } else {
+        err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+      }
+      posix_spawnattr_destroy(&attr);
+      posix_spawn_file_actions_destroy(&actions);
+      if (err != 0) {
+        errno = err;
+        return -1;
+      }
+      return pid;
+    }
+  }
+}
+
+/*
+ * A command line is split on blanks and run directly, unless it needs
+ * a shell (quotes, variables, redirections, globs, ...) or has more
+ * words than args can hold, in which case it goes to /bin/sh -c.
+ * Returns argv in args, over a copy in buf.
+ */
+static void split_command(char *buf, char **args) {
+  int n = 0;
+  char *p;
+
+  for (p = buf + strspn(buf, " \t"); *p && n < MAX_ARGS; p += strspn(p, " \t")) {
+    p += strcspn(p, " \t");
+    n++;
+  }
+  if (n == MAX_ARGS || strpbrk(buf, "\"'\\$`|&;<>()*?[]{}~#=\n")) {
+    args[0] = "/bin/sh";
+    args[1] = "-c";
+    args[2] = buf;
+    args[3] = NULL;
+    return;
+  }
+  n = 0;
+  for (p = strtok(buf, " \t"); p && n < MAX_ARGS - 1; p = strtok(NULL, " \t")) {
+    args[n++] = p;
+  }
+  args[n] = NULL;
+}
+
+static int failed = 0;
+
+static void report(struct Job *job, int status, const struct rusage *ru) {
+  char how[32];
+
+  if (WIFEXITED(status)) {
+    snprintf(how, sizeof how, "exit=%d", WEXITSTATUS(status));
+    failed |= WEXITSTATUS(status) != 0;
+  } else if (WIFSIGNALED(status)) {
+    snprintf(how, sizeof how, "signal=%d", WTERMSIG(status));
+    failed = 1;
+  } else {
+    snprintf(how, sizeof how, "abnormal");
+    failed = 1;
+  }
+  if (!quiet) {
+    fprintf(stderr, "[%lu] pid=%d %s wall=%.3fs user=%.3fs sys=%.3fs: %s\n", job->id, job->pid, how,
+            now() - job->start, ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6,
+            ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6, job->command);
+  }
+  free(job->command);
+  job->pid = 0;
+}
+
+/*
+ * -P: read command lines from stdin and keep up to max_jobs of them
+ * running. SIGCHLD is blocked and read from a signalfd, polled together
+ * with stdin, so the loop never sits in a blocking waitpid(2). Since
+ * pending SIGCHLDs coalesce, every wakeup reaps with wait4(WNOHANG)
+ * until nothing is left, taking each job's CPU times from its rusage.
+ * Jobs get /dev/null as stdin, as with xargs(1), so they cannot eat
+ * the command lines that follow.
+ */
+static void run_jobs(int max_jobs) {
+  struct Job *jobs = calloc(max_jobs, sizeof(struct Job));
+  struct FioReader in;
+  sigset_t mask;
+  unsigned long next_id = 1;
+  int sfd, devnull, running = 0, eof = 0, i;
+
+  if (!jobs) {
+    perror("calloc(3)");
     exit(1);
-  } else { // parent process
-    int status;
-
-    waitpid(pid, &status, 0);
-    printf("child (PID=%d) finished; ", pid);
-    if (WIFEXITED(status)) {
-      printf("exit, status=%d\n", WEXITSTATUS(status));
-    } else if (WIFSIGNALED(status)) {
-      printf("signal, sig=%d\n", WTERMSIG(status));
-    } else {
-      printf("abnormal exit\n");
+  }
+  devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  if (devnull < 0) {
+    perror("/dev/null");
+    exit(1);
+  }
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0 ||
+      (sfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK)) < 0) {
+    perror("signalfd(2)");
+    exit(1);
+  }
+  if (fio_open(&in, STDIN_FILENO) < 0) {
+    perror("stdin");
+    exit(1);
+  }
+
+  while (!eof || running > 0) {
+    struct pollfd fds[2];
+    struct signalfd_siginfo si;
+    struct rusage ru;
+    int status, nfds = 1, buffered;
+    pid_t pid;
+
+    fds[0].fd = sfd;
+    fds[0].events = POLLIN;
+    if (!eof && running < max_jobs) {
+      fds[1].fd = STDIN_FILENO;
+      fds[1].events = POLLIN;
+      nfds = 2;
     }
-    exit(0);
+    /* lines already read ahead into the buffer don't make stdin poll ready */
+    buffered = nfds == 2 && in.pos < in.len;
+    if (poll(fds, nfds, buffered ? 0 : -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("poll(2)");
+      exit(1);
+    }
+
+    if (nfds == 2 && (buffered || fds[1].revents)) {
+      const unsigned char *line;
+      size_t len;
+      int ret = fio_getline(&in, &line, &len);
+
+      if (ret < 0) {
+        perror("stdin");
+        exit(1);
+      }
+      if (ret == 0) {
+        eof = 1;
+      } else {
+        char *args[MAX_ARGS], *buf;
+
+        if (len > 0 && line[len - 1] == '\n') {
+          len--;
+        }
+        buf = strndup((const char *)line, len);
+        for (i = 0; i < max_jobs && jobs[i].pid != 0; i++)
+          ;
+        jobs[i].command = strndup((const char *)line, len);
+        if (!buf || !jobs[i].command) {
+          perror("strndup(3)");
+          exit(1);
+        }
+        split_command(buf, args);
+        if (args[0]) {
+          jobs[i].id = next_id++;
+          jobs[i].start = now();
+          jobs[i].pid = launch(method, args, devnull);
+          if (jobs[i].pid < 0) {
+            perror(args[0]);
+            failed = 1;
+            jobs[i].pid = 0;
+            free(jobs[i].command);
+          } else {
+            running++;
+          }
+        } else {
+          free(jobs[i].command);
+        }
+        free(buf);
+      }
+    }
+
+    if (fds[0].revents) {
+      while (read(sfd, &si, sizeof si) > 0)
+        ;
+      while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+        for (i = 0; i < max_jobs && jobs[i].pid != pid; i++)
+          ;
+        if (i < max_jobs) {
+          report(&jobs[i], status, &ru);
+          running--;
+        }
+      }
+    }
+  }
+  fio_close(&in);
+  close(sfd);
+  free(jobs);
+  exit(failed ? 1 : 0);
+}
+
+/*
+ * --bench: start the command count times with each method, one at a
+ * time, and report the mean time the parent spends in the launch call
+ * and the mean time until the child has exited.
+ */
+static void bench(int count, char **argv) {
+  char *true_argv[] = {"/bin/true", NULL};
+  int m, i;
+
+  if (!argv[0]) {
+    argv = true_argv;
+  }
+  printf("%-12s %12s %12s\n", "method", "launch(us)", "total(us)");
+  for (m = 0; m < N_METHODS; m++) {
+    double launch_time = 0, total = 0;
+
+    for (i = 0; i < count; i++) {
+      double t0 = now(), t1;
+      int status;
+      pid_t pid = launch(m, argv, -1);
+
+      t1 = now();
+      if (pid < 0) {
+        perror(argv[0]);
+        exit(1);
+      }
+      waitpid(pid, &status, 0);
+      launch_time += t1 - t0;
+      total += now() - t0;
+    }
+    printf("%-12s %12.1f %12.1f\n", method_names[m], launch_time / count * 1e6, total / count * 1e6);
   }
 }
@@ -1,21 +1,160 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <time.h>
+#include "fastio.h"
+
+#define MAX_THREADS 64
+#define BATCH_SIZE 1024   /* paths per unit of work */
+#define ROUND_BATCHES 256 /* batches read ahead before they are stat'ed */
+
+enum {
+  F_PATH, F_TYPE, F_MODE, F_DEV, F_INO, F_RDEV, F_NLINK, F_UID, F_GID,
+  F_SIZE, F_BLKSIZE, F_BLOCKS, F_ATIME, F_MTIME, F_CTIME, F_BTIME, N_FIELDS
+};
+
+struct Field {
+  const char *name;
+  unsigned int mask; /* what statx(2) must fill in for it */
+};
+
+static const struct Field fields[N_FIELDS] = {
+  {"path",    0},
+  {"type",    STATX_TYPE},
+  {"mode",    STATX_MODE},
+  {"dev",     0},
+  {"ino",     STATX_INO},
+  {"rdev",    0},
+  {"nlink",   STATX_NLINK},
+  {"uid",     STATX_UID},
+  {"gid",     STATX_GID},
+  {"size",    STATX_SIZE},
+  {"blksize", 0},
+  {"blocks",  STATX_BLOCKS},
+  {"atime",   STATX_ATIME},
+  {"mtime",   STATX_MTIME},
+  {"ctime",   STATX_CTIME},
+  {"btime",   STATX_BTIME},
+};
+
+#define DEFAULT_FIELDS "path,type,mode,nlink,uid,gid,size,mtime"
+
+struct Text {
+  char *buf;
+  size_t len;
+  size_t cap;
+};
+
+struct Batch {
+  char **paths;
+  size_t n;
+  struct Text out;
+  int errors;
+};
 
 static char *filetype(mode_t mode);
+static void do_single(const char *path);
+static void do_batch(char **paths, int npaths);
+
+static int selected[N_FIELDS];
+static int n_selected = 0;
+static unsigned int stat_mask = 0;
+static int stat_flags = AT_SYMLINK_NOFOLLOW;
+static int json = 0;
+static int delim = '\n';
+static int nthreads = 1;
+
+static struct option longopts[] = {
+  {"fields", required_argument, NULL, 'f'},
+  {"json", no_argument, NULL, 'J'},
+  {"null", no_argument, NULL, '0'},
+  {"dereference", no_argument, NULL, 'L'},
+  {"threads", required_argument, NULL, 'j'},
+  {0, 0, 0, 0}
+};
+
+#define USAGE "Usage: %s <path>\n       %s [-f field,...] [--json] [-0] [-L] [-j threads] [path...]\n"
 
 int main(int argc, char *argv[]) {
-  struct stat st;
+  const char *spec = DEFAULT_FIELDS;
+  int opt, batch = 0;
 
-  if (argc != 2) {
-    fprintf(stderr, "wrong arguments\n");
-    exit(1);
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt_long(argc, argv, "f:J0Lj:", longopts, NULL)) != -1) {
+    batch = 1;
+    switch (opt) {
+      case 'f':
+        spec = optarg;
+        break;
+      case 'J':
+        json = 1;
+        break;
+      case '0':
+        delim = '\0';
+        break;
+      case 'L':
+        stat_flags = 0;
+        break;
+      case 'j':
+        nthreads = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, USAGE, argv[0], argv[0]);
+        exit(1);
+    }
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  if (nthreads > MAX_THREADS) {
+    nthreads = MAX_THREADS;
+  }
+
+  if (!batch && argc - optind == 1) {
+    do_single(argv[optind]);
+    exit(0);
   }
 
-  if (lstat(argv[1], &st) < 0) {
-    perror(argv[1]);
+  while (*spec) {
+    size_t len = strcspn(spec, ",");
+    int i;
+
+    for (i = 0; i < N_FIELDS; i++) {
+      if (strlen(fields[i].name) == len && strncmp(fields[i].name, spec, len) == 0) {
+        break;
+      }
+    }
+    if (i == N_FIELDS) {
+      fprintf(stderr, "unknown field: %.*s\n", (int)len, spec);
+      exit(1);
+    }
+    selected[n_selected++] = i;
+    stat_mask |= fields[i].mask;
+    spec += len + (spec[len] == ',');
+    if (n_selected == N_FIELDS) {
+      break;
+    }
+  }
+  do_batch(argv + optind, argc - optind);
+  /* NOT REACH */
+  exit(1);
+}
+
+static void do_single(const char *path) {
+  struct stat st;
+
+  if (lstat(path, &st) < 0) {
+    perror(path);
     exit(1);
   }
 
@@ -24,7 +163,7 @@ int main(int argc, char *argv[]) {
   printf("dev\t%llu\n", (unsigned long long) st.st_dev);
   printf("ino\t%lu\n", (unsigned long) st.st_ino);
   printf("rdev\t%llu\n", (unsigned long long) st.st_rdev);
-  printf("nlink\t%d\n", st.st_nlink);
+  printf("nlink\t%d\n", (int) st.st_nlink);
   printf("uid\t%d\n", st.st_uid);
   printf("gid\t%d\n", st.st_gid);
   printf("size\t%ld\n", (long) st.st_size);
@@ -33,7 +172,6 @@ int main(int argc, char *argv[]) {
   printf("atime\t%s", ctime(&st.st_atime));
   printf("mtime\t%s", ctime(&st.st_mtime));
   printf("ctime\t%s", ctime(&st.st_ctime));
-  exit(0);
 }
 
 static char *filetype(mode_t mode) {
@@ -46,3 +184,311 @@ static char *filetype(mode_t mode) {
   if (S_ISSOCK(mode)) { return "socket"; }
   return "unknown";
 }
+
+static void put(struct Text *t, const char *p, size_t n) {
+  if (t->len + n > t->cap) {
+    t->cap = t->cap ? t->cap * 2 : 64 * 1024;
+    while (t->len + n > t->cap) {
+      t->cap *= 2;
+    }
+    t->buf = realloc(t->buf, t->cap);
+    if (!t->buf) {
+      perror("realloc(3)");
+      exit(1);
+    }
+  }
+  memcpy(t->buf + t->len, p, n);
+  t->len += n;
+}
+
+static void put_u64(struct Text *t, uint64_t v) {
+  char buf[24], *p = buf + sizeof buf;
+
+  do {
+    *--p = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  put(t, p, buf + sizeof buf - p);
+}
+
+/*
+ * ISO 8601 in UTC, computed directly from the epoch (days-to-civil), so
+ * no time zone or locale is consulted per file as ctime(3) would.
+ */
+static void put_time(struct Text *t, struct statx_timestamp ts) {
+  int64_t days = ts.tv_sec / 86400, secs = ts.tv_sec % 86400, era, year;
+  unsigned doe, yoe, doy, mp, day, month;
+  char buf[40];
+  int n;
+
+  if (secs < 0) {
+    secs += 86400;
+    days--;
+  }
+  days += 719468;
+  era = (days >= 0 ? days : days - 146096) / 146097;
+  doe = days - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  year = yoe + era * 400;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+  day = doy - (153 * mp + 2) / 5 + 1;
+  month = mp < 10 ? mp + 3 : mp - 9;
+  year += month <= 2;
+  n = snprintf(buf, sizeof buf, "%04lld-%02u-%02uT%02u:%02u:%02u.%09uZ",
+               (long long)year, month, day, (unsigned)(secs / 3600),
+               (unsigned)(secs / 60 % 60), (unsigned)(secs % 60), ts.tv_nsec);
+  put(t, buf, n);
+}
+
+/* the path as a TSV cell (\t, \n, \\ escaped) or a JSON string */
+static void put_path(struct Text *t, const char *s) {
+  const char *run = s;
+
+  if (json) {
+    put(t, "\"", 1);
+  }
+  for (; *s; s++) {
+    unsigned char c = *s;
+    char esc[8];
+
+    if (c >= 0x20 && c != '\\' && !(json && c == '"')) {
+      continue;
+    }
+    put(t, run, s - run);
+    run = s + 1;
+    if (c == '\t') {
+      put(t, "\\t", 2);
+    } else if (c == '\n') {
+      put(t, "\\n", 2);
+    } else if (c == '\\' || c == '"') {
+      esc[0] = '\\';
+      esc[1] = c;
+      put(t, esc, 2);
+    } else {
+      put(t, esc, snprintf(esc, sizeof esc, json ? "\\u%04x" : "\\x%02x", c));
+    }
+  }
+  put(t, run, s - run);
+  if (json) {
+    put(t, "\"", 1);
+  }
+}
+
+static void format_record(struct Text *t, const char *path, const struct statx *stx) {
+  int i;
+
+  if (json) {
+    put(t, "{", 1);
+  }
+  for (i = 0; i < n_selected; i++) {
+    int f = selected[i];
+    char buf[16];
+
+    if (i > 0) {
+      put(t, json ? "," : "\t", 1);
+    }
+    if (json) {
+      put(t, "\"", 1);
+      put(t, fields[f].name, strlen(fields[f].name));
+      put(t, "\":", 2);
+    }
+    switch (f) {
+      case F_PATH:    put_path(t, path); break;
+      case F_TYPE:
+        if (json) { put(t, "\"", 1); }
+        put(t, filetype(stx->stx_mode), strlen(filetype(stx->stx_mode)));
+        if (json) { put(t, "\"", 1); }
+        break;
+      case F_MODE:
+        put(t, buf, snprintf(buf, sizeof buf, json ? "\"%04o\"" : "%04o", stx->stx_mode & ~S_IFMT));
+        break;
+      case F_DEV:     put_u64(t, makedev(stx->stx_dev_major, stx->stx_dev_minor)); break;
+      case F_INO:     put_u64(t, stx->stx_ino); break;
+      case F_RDEV:    put_u64(t, makedev(stx->stx_rdev_major, stx->stx_rdev_minor)); break;
+      case F_NLINK:   put_u64(t, stx->stx_nlink); break;
+      case F_UID:     put_u64(t, stx->stx_uid); break;
+      case F_GID:     put_u64(t, stx->stx_gid); break;
+      case F_SIZE:    put_u64(t, stx->stx_size); break;
+      case F_BLKSIZE: put_u64(t, stx->stx_blksize); break;
+      case F_BLOCKS:  put_u64(t, stx->stx_blocks); break;
+      default: {
+        struct statx_timestamp ts = f == F_ATIME ? stx->stx_atime : f == F_MTIME ? stx->stx_mtime :
+                                    f == F_CTIME ? stx->stx_ctime : stx->stx_btime;
+
+        if (f == F_BTIME && !(stx->stx_mask & STATX_BTIME)) {
+          put(t, json ? "null" : "-", json ? 4 : 1);
+          break;
+        }
+        if (json) { put(t, "\"", 1); }
+        put_time(t, ts);
+        if (json) { put(t, "\"", 1); }
+      }
+    }
+  }
+  put(t, json ? "}\n" : "\n", json ? 2 : 1);
+}
+
+struct Pool {
+  struct Batch *batches;
+  size_t n;
+  size_t next;
+  pthread_mutex_t lock;
+};
+
+static void stat_batch(struct Batch *b) {
+  size_t i;
+
+  for (i = 0; i < b->n; i++) {
+    struct statx stx;
+
+    if (statx(AT_FDCWD, b->paths[i], stat_flags | AT_NO_AUTOMOUNT, stat_mask, &stx) < 0) {
+      fprintf(stderr, "%s: %s\n", b->paths[i], strerror(errno));
+      b->errors = 1;
+      continue;
+    }
+    format_record(&b->out, b->paths[i], &stx);
+  }
+}
+
+static void *stat_worker(void *arg) {
+  struct Pool *pool = arg;
+
+  while (1) {
+    size_t i;
+
+    pthread_mutex_lock(&pool->lock);
+    i = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    if (i >= pool->n) {
+      return NULL;
+    }
+    stat_batch(&pool->batches[i]);
+  }
+}
+
+/*
+ * Stat one round of batches on the pool and write the records in input
+ * order. Returns nonzero if any path failed.
+ */
+static int run_round(struct Batch *batches, size_t n, struct FioWriter *out) {
+  pthread_t threads[MAX_THREADS];
+  struct Pool pool;
+  int i, nt, errors = 0;
+  size_t k;
+
+  pool.batches = batches;
+  pool.n = n;
+  pool.next = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+  nt = (size_t)nthreads < n ? nthreads : (int)n;
+  if (nt <= 1) {
+    stat_worker(&pool);
+  } else {
+    for (i = 0; i < nt; i++) {
+      if (pthread_create(&threads[i], NULL, stat_worker, &pool) != 0) {
+        fputs("pthread_create(3) failed\n", stderr);
+        exit(1);
+      }
+    }
+    for (i = 0; i < nt; i++) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+  pthread_mutex_destroy(&pool.lock);
+  for (k = 0; k < n; k++) {
+    if (fio_write(out, batches[k].out.buf, batches[k].out.len) < 0) {
+      exit(1);
+    }
+    batches[k].out.len = 0;
+    errors |= batches[k].errors;
+    batches[k].errors = 0;
+  }
+  return errors;
+}
+
+/*
+ * Paths come from the arguments, or else from stdin one per line (NUL
+ * separated with -0). They are grouped into batches, and up to
+ * ROUND_BATCHES batches at a time are stat'ed by the thread pool, so
+ * memory stays bounded however long the input is.
+ */
+static void do_batch(char **paths, int npaths) {
+  static struct Batch batches[ROUND_BATCHES];
+  static char *round_paths[ROUND_BATCHES * BATCH_SIZE];
+  struct FioWriter out;
+  struct FioReader in;
+  size_t n = 0, k;
+  int errors = 0, ret = 0, i;
+
+  if (fio_writer_open(&out, STDOUT_FILENO) < 0) {
+    perror("stdout");
+    exit(1);
+  }
+  for (k = 0; k < ROUND_BATCHES; k++) {
+    batches[k].paths = round_paths + k * BATCH_SIZE;
+  }
+  if (npaths == 0 && fio_open(&in, STDIN_FILENO) < 0) {
+    perror("stdin");
+    exit(1);
+  }
+  for (i = 0; ; i++) {
+    char *path = NULL;
+
+    if (npaths > 0) {
+      if (i < npaths) {
+        path = paths[i];
+      }
+    } else {
+      const unsigned char *line;
+      size_t len;
+
+      ret = fio_getdelim(&in, delim, &line, &len);
+      if (ret < 0) {
+        perror("stdin");
+        exit(1);
+      }
+      if (ret > 0) {
+        if (len > 0 && line[len - 1] == delim) {
+          len--;
+        }
+        if (len == 0) {
+          i--;
+          continue;
+        }
+        path = strndup((const char *)line, len);
+        if (!path) {
+          perror("strndup(3)");
+          exit(1);
+        }
+      }
+    }
+    if (path) {
+      round_paths[n++] = path;
+    }
+    if (n == ROUND_BATCHES * BATCH_SIZE || (!path && n > 0)) {
+      size_t nb = (n + BATCH_SIZE - 1) / BATCH_SIZE;
+
+      for (k = 0; k < nb; k++) {
+        batches[k].n = k == nb - 1 ? n - k * BATCH_SIZE : BATCH_SIZE;
+      }
+      errors |= run_round(batches, nb, &out);
+      if (npaths == 0) {
+        for (k = 0; k < n; k++) {
+          free(round_paths[k]);
+        }
+      }
+      n = 0;
+    }
+    if (!path) {
+      break;
+    }
+  }
+  if (npaths == 0) {
+    fio_close(&in);
+  }
+  if (fio_writer_close(&out) < 0) {
+    exit(1);
+  }
+  exit(errors ? 1 : 0);
+}
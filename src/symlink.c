@@ -1,16 +1,340 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "fastio.h"
+
+#define MAX_THREADS 64
+#define BATCH_SIZE 1024 /* links per unit of work, all in one directory */
+
+struct Link {
+  char *target;
+  char *dir;      /* the link's directory, "." when it has none */
+  char *name;     /* the link's last component */
+  size_t order;   /* position in the manifest; the last entry for a link wins */
+};
+
+struct Batch {
+  size_t start;
+  size_t n;
+};
+
+static void do_manifest(const char *manifest, int delim);
+static void add_link(const char *target, size_t tlen, const char *path, size_t plen);
+static void run_links(void);
+static int replace_link(int dirfd, const char *dir, const char *name, const char *target, size_t id);
+
+static int opt_force = 0;
+static int nthreads;
+static int errors = 0;
+
+static struct option longopts[] = {
+  {"force", no_argument, NULL, 'f'},
+  {"from-file", required_argument, NULL, 'F'},
+  {"null", no_argument, NULL, '0'},
+  {"threads", required_argument, NULL, 'j'},
+  {0, 0, 0, 0}
+};
+
+#define USAGE "Usage: %s [-f] target link\n       %s --from-file=FILE [-0] [-j threads]\n"
 
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
+  const char *manifest = NULL;
+  int opt, delim = '\n';
+
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((opt = getopt_long(argc, argv, "f0j:", longopts, NULL)) != -1) {
+    switch (opt) {
+      case 'f':
+        opt_force = 1;
+        break;
+      case 'F':
+        manifest = optarg;
+        break;
+      case '0':
+        delim = '\0';
+        break;
+      case 'j':
+        nthreads = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, USAGE, argv[0], argv[0]);
+        exit(1);
+    }
+  }
+  if (manifest) {
+    do_manifest(manifest, delim);
+    exit(errors ? 1 : 0);
+  }
+
+  if (argc - optind != 2) {
     fprintf(stderr, "%s: wrong number of arguments\n", argv[0]);
     exit(1);
   }
-
-  if (symlink(argv[1], argv[2]) < 0) {
-    perror(argv[1]);
+  if (opt_force) {
+    add_link(argv[optind], strlen(argv[optind]), argv[optind + 1], strlen(argv[optind + 1]));
+    run_links();
+    exit(errors ? 1 : 0);
+  }
+  if (symlink(argv[optind], argv[optind + 1]) < 0) {
+    perror(argv[optind]);
     exit(1);
   }
   exit(0);
 }
+
+static void error(const char *dir, const char *name) {
+  fprintf(stderr, "%s/%s: %s\n", dir, name, strerror(errno));
+  __atomic_store_n(&errors, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Point dirfd/name at target. A link that already points there is left
+ * alone; otherwise the new link is made under a temporary name and
+ * renamed over the old one, so name always resolves to one or the other.
+ */
+static int replace_link(int dirfd, const char *dir, const char *name, const char *target, size_t id) {
+  char current[PATH_MAX], tmp[64];
+  ssize_t n;
+
+  n = readlinkat(dirfd, name, current, sizeof current);
+  if (n >= 0 && (size_t)n == strlen(target) && memcmp(current, target, n) == 0) {
+    return 0;
+  }
+  /* nothing to replace: create it in place, unless it appeared meanwhile */
+  if (n < 0 && errno == ENOENT) {
+    if (symlinkat(target, dirfd, name) == 0) {
+      return 0;
+    }
+    if (errno != EEXIST) {
+      error(dir, name);
+      return -1;
+    }
+  }
+  snprintf(tmp, sizeof tmp, ".symlink-%d-%zu", (int)getpid(), id);
+  if (symlinkat(target, dirfd, tmp) < 0) {
+    error(dir, name);
+    return -1;
+  }
+  if (renameat(dirfd, tmp, dirfd, name) < 0) {
+    error(dir, name);
+    unlinkat(dirfd, tmp, 0);
+    return -1;
+  }
+  return 0;
+}
+
+static struct Link *links = NULL;
+static size_t nlinks = 0, links_cap = 0;
+static struct Batch *batches = NULL;
+static size_t nbatches = 0, next_batch = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* by directory, then name, then the last manifest entry first */
+static int link_cmp(const void *a, const void *b) {
+  const struct Link *x = a, *y = b;
+  int c = strcmp(x->dir, y->dir);
+
+  if (c == 0) {
+    c = strcmp(x->name, y->name);
+  }
+  if (c == 0) {
+    c = x->order < y->order ? 1 : -1;
+  }
+  return c;
+}
+
+/* a line is "target<TAB>link", or with -0 two NUL-terminated fields */
+static void add_link(const char *target, size_t tlen, const char *path, size_t plen) {
+  struct Link *l;
+  char *buf;
+  size_t dlen;
+
+  while (plen > 1 && path[plen - 1] == '/') {
+    plen--;
+  }
+  if (nlinks == links_cap) {
+    links_cap = links_cap ? links_cap * 2 : 4096;
+    links = realloc(links, sizeof(struct Link) * links_cap);
+    if (!links) {
+      perror("realloc(3)");
+      exit(1);
+    }
+  }
+  /* target, directory and name share one allocation */
+  buf = malloc(tlen + plen + 4);
+  if (!buf) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  l = &links[nlinks];
+  l->order = nlinks++;
+  l->target = buf;
+  memcpy(buf, target, tlen);
+  buf[tlen] = '\0';
+  l->dir = buf + tlen + 1;
+  for (dlen = plen; dlen > 0 && path[dlen - 1] != '/'; dlen--)
+    ;
+  if (dlen == 0) {
+    strcpy(l->dir, ".");
+    l->name = l->dir + 2;
+  } else {
+    memcpy(l->dir, path, dlen > 1 ? dlen - 1 : 1);
+    l->dir[dlen > 1 ? dlen - 1 : 1] = '\0';
+    l->name = l->dir + (dlen > 1 ? dlen : 2);
+  }
+  memcpy(l->name, path + dlen, plen - dlen);
+  l->name[plen - dlen] = '\0';
+}
+
+static void *worker(void *arg) {
+  (void)arg;
+  while (1) {
+    struct Batch *b;
+    const char *dir;
+    size_t i;
+    int dirfd;
+
+    pthread_mutex_lock(&lock);
+    b = next_batch < nbatches ? &batches[next_batch++] : NULL;
+    pthread_mutex_unlock(&lock);
+    if (!b) {
+      return NULL;
+    }
+    dir = links[b->start].dir;
+    dirfd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+      for (i = b->start; i < b->start + b->n; i++) {
+        error(dir, links[i].name);
+      }
+      continue;
+    }
+    for (i = b->start; i < b->start + b->n; i++) {
+      if (i > b->start && strcmp(links[i].name, links[i - 1].name) == 0) {
+        continue; /* superseded by a later manifest line */
+      }
+      replace_link(dirfd, dir, links[i].name, links[i].target, i);
+    }
+    close(dirfd);
+  }
+}
+
+static void do_manifest(const char *manifest, int delim) {
+  struct FioReader in;
+  const unsigned char *line;
+  size_t len;
+  int fd, ret;
+
+  fd = strcmp(manifest, "-") == 0 ? STDIN_FILENO : open(manifest, O_RDONLY);
+  if (fd < 0 || fio_open(&in, fd) < 0) {
+    perror(manifest);
+    exit(1);
+  }
+  while ((ret = fio_getdelim(&in, delim, &line, &len)) > 0) {
+    char *target = NULL;
+    size_t tlen = 0;
+
+    if (len > 0 && line[len - 1] == delim) {
+      len--;
+    }
+    if (delim == '\0') {
+      if (len == 0) {
+        continue;
+      }
+      target = strndup((const char *)line, len);
+      tlen = len;
+      ret = fio_getdelim(&in, delim, &line, &len);
+      if (ret <= 0) {
+        fprintf(stderr, "%s: link path missing for %s\n", manifest, target);
+        exit(1);
+      }
+      if (len > 0 && line[len - 1] == delim) {
+        len--;
+      }
+      add_link(target, tlen, (const char *)line, len);
+      free(target);
+    } else {
+      const unsigned char *tab = memchr(line, '\t', len);
+
+      if (len == 0) {
+        continue;
+      }
+      if (!tab || tab + 1 == line + len) {
+        fprintf(stderr, "%s: expected \"target<TAB>link\": %.*s\n", manifest, (int)len, line);
+        errors = 1;
+        continue;
+      }
+      add_link((const char *)line, tab - line, (const char *)tab + 1, line + len - tab - 1);
+    }
+  }
+  if (ret < 0) {
+    perror(manifest);
+    exit(1);
+  }
+  fio_close(&in);
+  if (fd != STDIN_FILENO) {
+    close(fd);
+  }
+  run_links();
+}
+
+/*
+ * Sort the links by directory and cut each directory's links into
+ * batches. The threads take batches in turn; each batch opens its
+ * directory once and does all its work with symlinkat(2), readlinkat(2)
+ * and renameat(2) relative to that fd.
+ */
+static void run_links(void) {
+  pthread_t threads[MAX_THREADS];
+  size_t i, j;
+  int nt;
+
+  qsort(links, nlinks, sizeof(struct Link), link_cmp);
+  batches = malloc(sizeof(struct Batch) * (nlinks / BATCH_SIZE + nlinks + 1));
+  if (!batches) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  for (i = 0; i < nlinks; i = j) {
+    for (j = i + 1; j < nlinks && j - i < BATCH_SIZE && strcmp(links[j].dir, links[i].dir) == 0; j++)
+      ;
+    /* keep all entries for one name in the same batch */
+    while (j < nlinks && strcmp(links[j].dir, links[i].dir) == 0 &&
+           strcmp(links[j].name, links[j - 1].name) == 0) {
+      j++;
+    }
+    batches[nbatches].start = i;
+    batches[nbatches++].n = j - i;
+  }
+
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  nt = nbatches < (size_t)nthreads ? (int)nbatches : nthreads;
+  if (nt > MAX_THREADS) {
+    nt = MAX_THREADS;
+  }
+  for (i = 0; i < (size_t)nt; i++) {
+    if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+      fputs("pthread_create(3) failed\n", stderr);
+      exit(1);
+    }
+  }
+  for (i = 0; i < (size_t)nt; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (i = 0; i < nlinks; i++) {
+    free(links[i].target);
+  }
+  free(links);
+  free(batches);
+}
@@ -0,0 +1,519 @@
+/*
+ * Parallel directory walker, header-only like fastio.h.
+ *
+ * Every directory is a job on a per-thread deque. A worker pushes the
+ * subdirectories it finds onto the back of its own deque and pops from
+ * the back, which keeps the walk depth-first and the frontier small,
+ * and steals from the front of the other deques when it runs dry.
+ *
+ * Directories are opened with openat(2) relative to their parent's fd,
+ * never by re-resolving the full path. A parent's fd stays open until
+ * its last subdirectory has been opened. Once more than max_fds
+ * directories are open, a parent's fd is closed right after reading,
+ * and its subdirectories are opened by full path instead; that bounds
+ * fd use on arbitrarily wide trees.
+ *
+ * ops->dir runs on a worker thread for each directory, with all of its
+ * entries. Clearing an entry's descend flag prunes that subdirectory.
+ * ops->leave runs once a directory and everything below it are done
+ * (post-order), on whichever thread finished last. With ops->hold_fds a
+ * directory's fd stays open until it has been left, so leave can still
+ * act through dir->parent->fd; under fd pressure it is closed early as
+ * usual, and dir->parent->fd is then -1. A directory that could not be
+ * opened or read to the end has its failed flag set before leave runs;
+ * the error has already been reported.
+ */
+#ifndef WALK_H
+#define WALK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#define WALK_MAX_THREADS 64
+#define WALK_DIRENT_BUF_SIZE (256 * 1024)
+#define WALK_SEEN_SHARDS 64
+
+struct WalkStat {
+  uint32_t mode;
+  uint32_t nlink;
+  uint32_t uid;
+  uint32_t gid;
+  uint64_t size;
+  uint64_t blocks; /* 512-byte units */
+  uint64_t ino;
+  uint64_t dev;
+  int64_t mtime;
+};
+
+struct WalkDir {
+  struct WalkDir *parent;
+  char *path;       /* for messages, and the fallback when parent->fd is closed */
+  const char *name; /* last component of path */
+  int fd;           /* open while read, and until every subdirectory is opened */
+  int depth;
+  int root;         /* index of the root this directory descends from */
+  long pending;     /* itself plus unfinished subdirectories */
+  long unopened;    /* subdirectories still to be opened through fd */
+  int failed;       /* open or getdents64 failed; set before leave */
+  void *data;       /* owned by the caller */
+};
+
+struct WalkEntry {
+  const char *name;
+  unsigned char type;  /* DT_*, never DT_UNKNOWN */
+  int stat_ok;
+  struct WalkStat st;  /* when ops->stat_mask is set */
+  int descend;         /* preset for directories; clear to prune */
+  struct WalkDir *sub; /* the subdirectory, when descend is set */
+};
+
+struct Walker;
+
+struct WalkOps {
+  unsigned int stat_mask; /* statx(2) fields wanted for every entry, 0 for none */
+  int hold_fds;           /* keep each directory's fd open until it is left */
+  void (*dir)(struct Walker *w, struct WalkDir *dir, struct WalkEntry *ents, size_t n);
+  void (*leave)(struct Walker *w, struct WalkDir *dir);
+  void *arg;
+};
+
+struct WalkDeque {
+  pthread_mutex_t lock;
+  struct WalkDir **items;
+  size_t head;
+  size_t tail;
+  size_t cap;
+};
+
+struct WalkSeen {
+  pthread_mutex_t lock;
+  uint64_t *keys; /* pairs of dev, ino; ino 0 marks a free slot */
+  size_t n;
+  size_t cap;
+};
+
+struct Walker {
+  const struct WalkOps *ops;
+  int nthreads;
+  struct WalkDeque deques[WALK_MAX_THREADS];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  long queued;          /* directories pushed and not yet read */
+  unsigned long pushes; /* bumped on every push, so idle workers miss none */
+  long open_fds;
+  long max_fds;
+  int errors;
+  struct WalkSeen seen[WALK_SEEN_SHARDS];
+};
+
+struct WalkWorker {
+  pthread_t thread;
+  struct Walker *w;
+  int id;
+  char *dirent_buf;
+};
+
+static inline void walk_error(struct Walker *w, const char *path, int err) {
+  fprintf(stderr, "%s: %s\n", path, strerror(err));
+  __atomic_store_n(&w->errors, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns 1 if (dev, ino) was recorded before, else records it. Callers
+ * use it for files with more than one link so each is counted once.
+ */
+static inline int walk_seen(struct Walker *w, uint64_t dev, uint64_t ino) {
+  struct WalkSeen *s = &w->seen[(ino * 0x9e3779b97f4a7c15ULL >> 58) % WALK_SEEN_SHARDS];
+  size_t h, i;
+  int found = 0;
+
+  pthread_mutex_lock(&s->lock);
+  if ((s->n + 1) * 2 > s->cap) {
+    size_t cap = s->cap ? s->cap * 2 : 1024;
+    uint64_t *keys = calloc(cap * 2, sizeof(uint64_t));
+
+    if (!keys) {
+      perror("calloc(3)");
+      exit(1);
+    }
+    for (i = 0; i < s->cap; i++) {
+      if (s->keys[i * 2 + 1]) {
+        for (h = (s->keys[i * 2 + 1] * 0x9e3779b97f4a7c15ULL) & (cap - 1); keys[h * 2 + 1]; h = (h + 1) & (cap - 1))
+          ;
+        keys[h * 2] = s->keys[i * 2];
+        keys[h * 2 + 1] = s->keys[i * 2 + 1];
+      }
+    }
+    free(s->keys);
+    s->keys = keys;
+    s->cap = cap;
+  }
+  for (h = (ino * 0x9e3779b97f4a7c15ULL) & (s->cap - 1); s->keys[h * 2 + 1]; h = (h + 1) & (s->cap - 1)) {
+    if (s->keys[h * 2] == dev && s->keys[h * 2 + 1] == ino) {
+      found = 1;
+      break;
+    }
+  }
+  if (!found) {
+    s->keys[h * 2] = dev;
+    s->keys[h * 2 + 1] = ino ? ino : 1;
+    s->n++;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return found;
+}
+
+static inline void walk_push(struct Walker *w, int id, struct WalkDir *dir) {
+  struct WalkDeque *d = &w->deques[id];
+
+  pthread_mutex_lock(&d->lock);
+  if (d->tail - d->head == d->cap) {
+    size_t i, cap = d->cap ? d->cap * 2 : 64;
+    struct WalkDir **items = malloc(sizeof(struct WalkDir *) * cap);
+
+    if (!items) {
+      perror("malloc(3)");
+      exit(1);
+    }
+    for (i = d->head; i < d->tail; i++) {
+      items[i - d->head] = d->items[i % d->cap];
+    }
+    free(d->items);
+    d->items = items;
+    d->tail -= d->head;
+    d->head = 0;
+    d->cap = cap;
+  }
+  d->items[d->tail++ % d->cap] = dir;
+  pthread_mutex_unlock(&d->lock);
+}
+
+static inline struct WalkDir *walk_take(struct WalkDeque *d, int steal) {
+  struct WalkDir *dir = NULL;
+
+  pthread_mutex_lock(&d->lock);
+  if (d->head < d->tail) {
+    dir = steal ? d->items[d->head++ % d->cap] : d->items[--d->tail % d->cap];
+  }
+  pthread_mutex_unlock(&d->lock);
+  return dir;
+}
+
+static inline struct WalkDir *walk_next(struct Walker *w, int id) {
+  while (1) {
+    struct WalkDir *dir;
+    unsigned long pushes;
+    int i;
+
+    pthread_mutex_lock(&w->lock);
+    pushes = w->pushes;
+    pthread_mutex_unlock(&w->lock);
+
+    dir = walk_take(&w->deques[id], 0);
+    for (i = 1; !dir && i < w->nthreads; i++) {
+      dir = walk_take(&w->deques[(id + i) % w->nthreads], 1);
+    }
+    if (dir) {
+      return dir;
+    }
+    pthread_mutex_lock(&w->lock);
+    if (w->queued == 0) {
+      pthread_mutex_unlock(&w->lock);
+      return NULL;
+    }
+    if (w->pushes == pushes) {
+      pthread_cond_wait(&w->cond, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+static inline void walk_close_fd(struct Walker *w, struct WalkDir *dir) {
+  if (dir->fd >= 0) {
+    close(dir->fd);
+    dir->fd = -1;
+    __atomic_sub_fetch(&w->open_fds, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/* drop one reference; a directory whose count reaches zero is left */
+static inline void walk_release(struct Walker *w, struct WalkDir *dir) {
+  while (dir && __atomic_sub_fetch(&dir->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    struct WalkDir *parent = dir->parent;
+
+    if (w->ops->leave) {
+      w->ops->leave(w, dir);
+    }
+    walk_close_fd(w, dir);
+    free(dir->path);
+    free(dir);
+    dir = parent;
+  }
+}
+
+static inline struct WalkDir *walk_new_dir(struct WalkDir *parent, const char *path, const char *name) {
+  struct WalkDir *dir = calloc(1, sizeof(struct WalkDir));
+  size_t plen = strlen(path), nlen = name ? strlen(name) : 0;
+
+  if (!dir || !(dir->path = malloc(plen + nlen + 2))) {
+    perror("malloc(3)");
+    exit(1);
+  }
+  memcpy(dir->path, path, plen);
+  if (name) {
+    if (plen == 0 || path[plen - 1] != '/') {
+      dir->path[plen++] = '/';
+    }
+    memcpy(dir->path + plen, name, nlen + 1);
+    dir->name = dir->path + plen;
+    dir->depth = parent->depth + 1;
+    dir->root = parent->root;
+  } else {
+    dir->path[plen] = '\0';
+    dir->name = dir->path;
+  }
+  dir->parent = parent;
+  dir->fd = -1;
+  dir->pending = 1;
+  return dir;
+}
+
+static inline void walk_stat_entry(int fd, unsigned int mask, struct WalkEntry *e) {
+  struct statx stx;
+
+  if (statx(fd, e->name, AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT, mask | STATX_TYPE, &stx) < 0) {
+    return;
+  }
+  e->stat_ok = 1;
+  e->type = IFTODT(stx.stx_mode);
+  e->st.mode = stx.stx_mode;
+  e->st.nlink = stx.stx_nlink;
+  e->st.uid = stx.stx_uid;
+  e->st.gid = stx.stx_gid;
+  e->st.size = stx.stx_size;
+  e->st.blocks = stx.stx_blocks;
+  e->st.ino = stx.stx_ino;
+  e->st.dev = (uint64_t)stx.stx_dev_major << 32 | stx.stx_dev_minor;
+  e->st.mtime = stx.stx_mtime.tv_sec;
+}
+
+static inline void walk_dir(struct WalkWorker *ww, struct WalkDir *dir) {
+  struct Walker *w = ww->w;
+  struct WalkDir *parent = dir->parent;
+  struct WalkEntry *ents = NULL;
+  char *names = NULL;
+  size_t n = 0, cap = 0, names_len = 0, names_cap = 0, i;
+  long subs = 0;
+
+  if (!parent) {
+    dir->fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  } else if (parent->fd >= 0) {
+    dir->fd = openat(parent->fd, dir->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  } else {
+    dir->fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  }
+  if (dir->fd < 0) {
+    walk_error(w, dir->path, errno);
+    dir->failed = 1;
+  } else {
+    __atomic_add_fetch(&w->open_fds, 1, __ATOMIC_RELAXED);
+  }
+  if (parent && __atomic_sub_fetch(&parent->unopened, 1, __ATOMIC_ACQ_REL) == 0 && !w->ops->hold_fds) {
+    walk_close_fd(w, parent);
+  }
+  if (dir->fd < 0) {
+    walk_release(w, dir);
+    return;
+  }
+
+  while (1) {
+    ssize_t nread = getdents64(dir->fd, ww->dirent_buf, WALK_DIRENT_BUF_SIZE);
+    ssize_t off;
+
+    if (nread < 0) {
+      walk_error(w, dir->path, errno);
+      dir->failed = 1;
+      break;
+    }
+    if (nread == 0) {
+      break;
+    }
+    for (off = 0; off < nread; ) {
+      struct dirent64 *d = (struct dirent64 *)(ww->dirent_buf + off);
+      size_t len = strlen(d->d_name) + 1;
+
+      off += d->d_reclen;
+      if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) {
+        continue;
+      }
+      if (n == cap) {
+        cap = cap ? cap * 2 : 64;
+        ents = realloc(ents, sizeof(struct WalkEntry) * cap);
+      }
+      if (names_len + len > names_cap) {
+        names_cap = names_cap ? names_cap * 2 : 4096;
+        while (names_len + len > names_cap) {
+          names_cap *= 2;
+        }
+        names = realloc(names, names_cap);
+      }
+      if (!ents || !names) {
+        perror("realloc(3)");
+        exit(1);
+      }
+      memcpy(names + names_len, d->d_name, len);
+      memset(&ents[n], 0, sizeof(struct WalkEntry));
+      ents[n].name = (char *)names_len; /* rebased below, names may move */
+      ents[n].type = d->d_type;
+      names_len += len;
+      n++;
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    struct WalkEntry *e = &ents[i];
+
+    e->name = names + (size_t)e->name;
+    if (w->ops->stat_mask || e->type == DT_UNKNOWN) {
+      walk_stat_entry(dir->fd, w->ops->stat_mask, e);
+    }
+    if (e->type == DT_DIR) {
+      e->descend = 1;
+      e->sub = walk_new_dir(dir, dir->path, e->name);
+    }
+  }
+  if (w->ops->dir) {
+    w->ops->dir(w, dir, ents, n);
+  }
+  for (i = 0; i < n; i++) {
+    if (ents[i].sub && ents[i].descend) {
+      subs++;
+    } else if (ents[i].sub) {
+      free(ents[i].sub->path);
+      free(ents[i].sub);
+    }
+  }
+
+  /* set both counts before any subdirectory can run */
+  __atomic_add_fetch(&dir->pending, subs, __ATOMIC_ACQ_REL);
+  if (subs > 0 && __atomic_load_n(&w->open_fds, __ATOMIC_RELAXED) <= w->max_fds) {
+    dir->unopened = subs;
+  } else {
+    walk_close_fd(w, dir);
+  }
+  if (subs > 0) {
+    pthread_mutex_lock(&w->lock);
+    w->queued += subs;
+    w->pushes++;
+    pthread_mutex_unlock(&w->lock);
+    for (i = n; i-- > 0; ) {
+      if (ents[i].sub && ents[i].descend) {
+        walk_push(w, ww->id, ents[i].sub);
+      }
+    }
+    pthread_cond_broadcast(&w->cond);
+  }
+  free(ents);
+  free(names);
+  walk_release(w, dir);
+}
+
+static inline void *walk_worker_main(void *arg) {
+  struct WalkWorker *ww = arg;
+  struct WalkDir *dir;
+
+  while ((dir = walk_next(ww->w, ww->id)) != NULL) {
+    walk_dir(ww, dir);
+    pthread_mutex_lock(&ww->w->lock);
+    if (--ww->w->queued == 0) {
+      pthread_cond_broadcast(&ww->w->cond);
+    }
+    pthread_mutex_unlock(&ww->w->lock);
+  }
+  return NULL;
+}
+
+/*
+ * Walk every root on nthreads threads and return once all of them have
+ * been left. Returns nonzero if any directory could not be read.
+ */
+static inline int walk_run(const struct WalkOps *ops, char **roots, int nroots, int nthreads) {
+  static struct WalkWorker workers[WALK_MAX_THREADS];
+  struct Walker *w;
+  struct rlimit rl;
+  int i, errors;
+
+  w = calloc(1, sizeof(struct Walker));
+  if (!w) {
+    perror("calloc(3)");
+    exit(1);
+  }
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+  if (nthreads > WALK_MAX_THREADS) {
+    nthreads = WALK_MAX_THREADS;
+  }
+  w->ops = ops;
+  w->nthreads = nthreads;
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  for (i = 0; i < nthreads; i++) {
+    pthread_mutex_init(&w->deques[i].lock, NULL);
+  }
+  for (i = 0; i < WALK_SEEN_SHARDS; i++) {
+    pthread_mutex_init(&w->seen[i].lock, NULL);
+  }
+  /* leave half the descriptors to the caller's own work */
+  w->max_fds = 1024;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+    w->max_fds = rl.rlim_cur / 2;
+  }
+
+  for (i = 0; i < nroots; i++) {
+    struct WalkDir *dir = walk_new_dir(NULL, roots[i], NULL);
+
+    dir->root = i;
+    walk_push(w, i % nthreads, dir);
+    w->queued++;
+  }
+  for (i = 0; i < nthreads; i++) {
+    workers[i].w = w;
+    workers[i].id = i;
+    workers[i].dirent_buf = malloc(WALK_DIRENT_BUF_SIZE);
+    if (!workers[i].dirent_buf) {
+      perror("malloc(3)");
+      exit(1);
+    }
+    if (pthread_create(&workers[i].thread, NULL, walk_worker_main, &workers[i]) != 0) {
+      fputs("pthread_create(3) failed\n", stderr);
+      exit(1);
+    }
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    free(workers[i].dirent_buf);
+  }
+
+  errors = w->errors;
+  for (i = 0; i < nthreads; i++) {
+    free(w->deques[i].items);
+  }
+  for (i = 0; i < WALK_SEEN_SHARDS; i++) {
+    free(w->seen[i].keys);
+  }
+  free(w);
+  return errors;
+}
+
+#endif
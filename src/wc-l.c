@@ -1,17 +1,344 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "fastio.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define PARALLEL_MIN (64 * 1024 * 1024)  /* smaller files are not worth a thread */
+#define CHUNK_MIN (16 * 1024 * 1024)
+#define MAX_THREADS 64
+
+struct Counts {
+    unsigned long long lines;
+    unsigned long long words;
+    unsigned long long bytes;
+};
+
+struct Chunk {
+    pthread_t thread;
+    const unsigned char *p;
+    size_t n;
+    int in_space;
+    struct Counts c;
+};
+
+static void count_block(const unsigned char *p, size_t n, int *in_space, struct Counts *c);
+static int count_fd(int fd, const char *path, struct Counts *c);
+static void print_counts(const struct Counts *c, const char *name);
+
+static int opt_lines = 0, opt_words = 0, opt_bytes = 0;
+static int nthreads = 1;
+static int avx2 = 0;
 
 int main(int argc, char *argv[]) {
-    int count = 0;
-    FILE *f = fdopen(STDIN_FILENO, "r");
+    struct Counts total = {0, 0, 0};
+    int opt, i, status = 0;
+
+    while ((opt = getopt(argc, argv, "lwc")) != -1) {
+        switch (opt) {
+        case 'l':
+            opt_lines = 1;
+            break;
+        case 'w':
+            opt_words = 1;
+            break;
+        case 'c':
+            opt_bytes = 1;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-l] [-w] [-c] [file...]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (!opt_lines && !opt_words && !opt_bytes) {
+        opt_lines = 1;
+    }
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    if (nthreads > MAX_THREADS) {
+        nthreads = MAX_THREADS;
+    }
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+    if (optind == argc) {
+        struct Counts c = {0, 0, 0};
+
+        if (count_fd(STDIN_FILENO, "stdin", &c) < 0) {
+            exit(1);
+        }
+        print_counts(&c, NULL);
+        exit(0);
+    }
+    for (i = optind; i < argc; i++) {
+        struct Counts c = {0, 0, 0};
+        int fd = open(argv[i], O_RDONLY);
+
+        if (fd < 0) {
+            perror(argv[i]);
+            status = 1;
+            continue;
+        }
+        if (count_fd(fd, argv[i], &c) < 0) {
+            status = 1;
+        }
+        close(fd);
+        print_counts(&c, argv[i]);
+        total.lines += c.lines;
+        total.words += c.words;
+        total.bytes += c.bytes;
+    }
+    if (argc - optind > 1) {
+        print_counts(&total, "total");
+    }
+    exit(status);
+}
+
+static void print_counts(const struct Counts *c, const char *name) {
+    int fields = opt_lines + opt_words + opt_bytes;
+
+    if (fields == 1 && !name) {
+        printf("%llu\n", opt_lines ? c->lines : opt_words ? c->words : c->bytes);
+        return;
+    }
+    if (opt_lines) { printf(" %7llu", c->lines); }
+    if (opt_words) { printf(" %7llu", c->words); }
+    if (opt_bytes) { printf(" %7llu", c->bytes); }
+    if (name) { printf(" %s", name); }
+    putchar('\n');
+}
+
+static int is_space(unsigned char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/*
+ * Scalar kernel, also used for the tails the vector kernels leave over.
+ * A word starts at every non-space byte that follows a space; *in_space
+ * carries that state across blocks and is 1 at the start of a file.
+ */
+static void count_scalar(const unsigned char *p, size_t n, int *in_space, struct Counts *c) {
+    unsigned long long lines = 0, words = 0;
+    size_t i;
+
+    if (!opt_words) {
+        for (i = 0; i < n; i++) {
+            lines += p[i] == '\n';
+        }
+    } else {
+        int sp = *in_space;
+
+        for (i = 0; i < n; i++) {
+            int s = is_space(p[i]);
+
+            lines += p[i] == '\n';
+            words += sp && !s;
+            sp = s;
+        }
+        *in_space = sp;
+    }
+    c->lines += lines;
+    c->words += words;
+}
+
+#if defined(__x86_64__)
+/*
+ * Newline-only kernels add the 0/-1 compare results into byte lanes and
+ * fold them with psadbw before a lane can overflow, so the inner loop
+ * is one load, one compare and one subtract per vector.
+ */
+static size_t lines_sse2(const unsigned char *p, size_t n, unsigned long long *lines) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    __m128i total = _mm_setzero_si128();
+    size_t i = 0;
+
+    while (n - i >= 16) {
+        __m128i acc = _mm_setzero_si128();
+        int k;
+
+        for (k = 0; k < 255 && n - i >= 16; k++, i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+        }
+        total = _mm_add_epi64(total, _mm_sad_epu8(acc, _mm_setzero_si128()));
+    }
+    *lines += (unsigned long long)_mm_cvtsi128_si64(total)
+            + (unsigned long long)_mm_cvtsi128_si64(_mm_unpackhi_epi64(total, total));
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t lines_avx2(const unsigned char *p, size_t n, unsigned long long *lines) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
 
-    char c;
-    while ((c = fgetc(f)) != EOF) {
-        if ('\n' == c) { count++; }
+    while (n - i >= 32) {
+        __m256i acc = _mm256_setzero_si256();
+        int k;
+
+        for (k = 0; k < 255 && n - i >= 32; k++, i += 32) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(acc, _mm256_setzero_si256()));
+    }
+    *lines += (unsigned long long)_mm256_extract_epi64(total, 0)
+            + (unsigned long long)_mm256_extract_epi64(total, 1)
+            + (unsigned long long)_mm256_extract_epi64(total, 2)
+            + (unsigned long long)_mm256_extract_epi64(total, 3);
+    return i;
+}
+
+/* lines and words together: space bytes become a bitmask per vector */
+static size_t words_sse2(const unsigned char *p, size_t n, int *in_space, struct Counts *c) {
+    const __m128i nl = _mm_set1_epi8('\n'), blank = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t'), four = _mm_set1_epi8(4);
+    unsigned int prev = *in_space;
+    size_t i;
+
+    for (i = 0; n - i >= 16; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i ctl = _mm_sub_epi8(v, tab);  /* '\t'..'\r' map to 0..4 */
+        __m128i sp = _mm_or_si128(_mm_cmpeq_epi8(v, blank),
+                                  _mm_cmpeq_epi8(_mm_min_epu8(ctl, four), ctl));
+        unsigned int space = _mm_movemask_epi8(sp);
+        unsigned int starts = ~space & (space << 1 | prev) & 0xffff;
+
+        c->lines += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+        c->words += __builtin_popcount(starts);
+        prev = space >> 15;
+    }
+    *in_space = prev;
+    return i;
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t words_avx2(const unsigned char *p, size_t n, int *in_space, struct Counts *c) {
+    const __m256i nl = _mm256_set1_epi8('\n'), blank = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t'), four = _mm256_set1_epi8(4);
+    unsigned long long prev = *in_space;
+    size_t i;
+
+    for (i = 0; n - i >= 32; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i ctl = _mm256_sub_epi8(v, tab);
+        __m256i sp = _mm256_or_si256(_mm256_cmpeq_epi8(v, blank),
+                                     _mm256_cmpeq_epi8(_mm256_min_epu8(ctl, four), ctl));
+        unsigned long long space = (unsigned int)_mm256_movemask_epi8(sp);
+        unsigned long long starts = ~space & (space << 1 | prev) & 0xffffffffULL;
+
+        c->lines += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+        c->words += __builtin_popcountll(starts);
+        prev = space >> 31;
+    }
+    *in_space = prev;
+    return i;
+}
+#endif
+
+static void count_block(const unsigned char *p, size_t n, int *in_space, struct Counts *c) {
+    size_t done = 0;
+
+#if defined(__x86_64__)
+    if (!opt_words) {
+        done = avx2 ? lines_avx2(p, n, &c->lines) : lines_sse2(p, n, &c->lines);
+    } else {
+        done = avx2 ? words_avx2(p, n, in_space, c) : words_sse2(p, n, in_space, c);
+    }
+#endif
+    count_scalar(p + done, n - done, in_space, c);
+}
+
+static void *chunk_main(void *arg) {
+    struct Chunk *ch = arg;
+
+    count_block(ch->p, ch->n, &ch->in_space, &ch->c);
+    return NULL;
+}
+
+/*
+ * Large mappings are cut into one chunk per CPU. Word state at a chunk
+ * boundary only depends on the byte before it, which is already mapped.
+ */
+static void count_parallel(const unsigned char *p, size_t n, struct Counts *c) {
+    static struct Chunk chunks[MAX_THREADS];
+    size_t size, off = 0;
+    int nchunks, i;
+
+    nchunks = n / CHUNK_MIN;
+    if (nchunks > nthreads) {
+        nchunks = nthreads;
+    }
+    if (nchunks < 2) {
+        int in_space = 1;
+
+        count_block(p, n, &in_space, c);
+        return;
+    }
+    size = n / nchunks;
+    for (i = 0; i < nchunks; i++) {
+        chunks[i].p = p + off;
+        chunks[i].n = i == nchunks - 1 ? n - off : size;
+        chunks[i].in_space = off == 0 ? 1 : is_space(p[off - 1]);
+        memset(&chunks[i].c, 0, sizeof(struct Counts));
+        if (pthread_create(&chunks[i].thread, NULL, chunk_main, &chunks[i]) != 0) {
+            fputs("pthread_create(3) failed\n", stderr);
+            exit(1);
+        }
+        off += chunks[i].n;
+    }
+    for (i = 0; i < nchunks; i++) {
+        pthread_join(chunks[i].thread, NULL);
+        c->lines += chunks[i].c.lines;
+        c->words += chunks[i].c.words;
+    }
+}
+
+static int count_fd(int fd, const char *path, struct Counts *c) {
+    struct FioReader in;
+    const unsigned char *p = NULL;
+    struct stat st;
+    int in_space = 1;
+    size_t n = 0;
+    int ret;
+
+    if (fstat(fd, &st) < 0) {
+        perror(path);
+        return -1;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size > 0 && !opt_lines && !opt_words) {
+        c->bytes = st.st_size;
+        return 0;  /* -c alone needs no reading */
+    }
+    if (fio_open(&in, fd) < 0) {
+        perror(path);
+        return -1;
+    }
+    while ((ret = fio_block(&in, &p, &n)) > 0) {
+        c->bytes += n;
+        if (in.mapped && n >= PARALLEL_MIN) {
+            count_parallel(p, n, c);
+        } else {
+            count_block(p, n, &in_space, c);
+        }
+    }
+    fio_close(&in);
+    if (ret < 0) {
+        perror(path);
+        return -1;
     }
-    fclose(f);
-    if ('\n' == c) { count--; }
-    printf("%d\n", count);
-    exit(0);
+    return 0;
 }